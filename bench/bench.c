@@ -0,0 +1,93 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+
+#include "bench.h"
+
+volatile long bench_sink;
+
+static long allocations;
+static int counting;
+static int cache_misses = -1; // The perf counter, or -1 without one
+static unsigned int rng_state = 2021;
+
+// glibc's own allocator, under the names it exports for replacements.
+extern void* __libc_malloc(size_t size);
+extern void* __libc_calloc(size_t count, size_t size);
+extern void* __libc_realloc(void* ptr, size_t size);
+
+void* malloc(size_t size) {
+  allocations += counting;
+  return __libc_malloc(size);
+}
+
+void* calloc(size_t count, size_t size) {
+  allocations += counting;
+  return __libc_calloc(count, size);
+}
+
+void* realloc(void* ptr, size_t size) {
+  allocations += counting;
+  return __libc_realloc(ptr, size);
+}
+
+unsigned int bench_random(void) {
+  rng_state ^= rng_state << 13;
+  rng_state ^= rng_state >> 17;
+  rng_state ^= rng_state << 5;
+  return rng_state;
+}
+
+void bench_init(const char* title) {
+  struct perf_event_attr attr;
+
+  memset(&attr, 0, sizeof(attr));
+  attr.type = PERF_TYPE_HARDWARE;
+  attr.size = sizeof(attr);
+  attr.config = PERF_COUNT_HW_CACHE_MISSES;
+  attr.disabled = 1;
+  attr.exclude_kernel = 1;
+  attr.exclude_hv = 1;
+  if (cache_misses == -1)
+    cache_misses = syscall(__NR_perf_event_open, &attr, 0, -1, -1, 0);
+
+  printf("%s\n", title);
+  printf("  %-40s %10s %12s %14s\n", "", "ns/op", "allocs/op", "misses/op");
+}
+
+void bench_run(const char* name, bench_fn fn, void* arg, long iterations) {
+  struct timespec begin, end;
+  long long misses = 0;
+  long before;
+  double ns;
+
+  if (cache_misses != -1) {
+    ioctl(cache_misses, PERF_EVENT_IOC_RESET, 0);
+    ioctl(cache_misses, PERF_EVENT_IOC_ENABLE, 0);
+  }
+  before = allocations;
+  counting = 1;
+  clock_gettime(CLOCK_MONOTONIC, &begin);
+  for (long i = 0; i < iterations; i++)
+    fn(arg, i);
+  clock_gettime(CLOCK_MONOTONIC, &end);
+  counting = 0;
+  if (cache_misses != -1) {
+    ioctl(cache_misses, PERF_EVENT_IOC_DISABLE, 0);
+    if (read(cache_misses, &misses, sizeof(misses)) != sizeof(misses))
+      misses = 0;
+  }
+
+  ns = (end.tv_sec - begin.tv_sec) * 1e9 + (end.tv_nsec - begin.tv_nsec);
+  if (cache_misses != -1)
+    printf("  %-40s %10.1f %12.2f %14.3f\n", name, ns / iterations,
+           (double)(allocations - before) / iterations, (double)misses / iterations);
+  else
+    printf("  %-40s %10.1f %12.2f %14s\n", name, ns / iterations,
+           (double)(allocations - before) / iterations, "-");
+}
@@ -0,0 +1,29 @@
+#ifndef BENCH_H
+#define BENCH_H
+
+/* The harness the benchmarks share. bench_run times a function over a
+ * number of iterations and prints one line for it:
+ *
+ *   <name>   <ns>/op   <allocations>/op   <cache misses>/op
+ *
+ * Allocations are counted by replacing malloc, calloc and realloc, which
+ * also catches those made inside libc, such as by strdup. Cache misses come
+ * from perf_event_open and are shown as "-" where perf counters are not
+ * available, as in most containers.
+ */
+
+typedef void (*bench_fn)(void* arg, long i);
+
+/* Opens the perf counter, if there is one, and prints the column headings. */
+void bench_init(const char* title);
+
+/* Runs fn(arg, i) for i from 0 to iterations - 1 and prints the results. */
+void bench_run(const char* name, bench_fn fn, void* arg, long iterations);
+
+/* xorshift32, so every run sees the same sequence. */
+unsigned int bench_random(void);
+
+/* Benchmarks add results in here so the compiler keeps the work. */
+extern volatile long bench_sink;
+
+#endif /* BENCH_H */
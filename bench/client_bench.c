@@ -0,0 +1,142 @@
+// The client is a single file with its own main, so it is included whole
+// and its main renamed, which gives the benchmarks its static functions too.
+#define main upush_client_main
+#include "../upush_client.c"
+#undef main
+
+#include "bench.h"
+
+#define MAX_PEERS 1024
+#define BLOCKED 64
+
+// ./bench/client_bench
+// Peers are named PEER0000, PEER0001, ... on consecutive ports, the way a
+// client that has talked to that many nicks holds them in its message queue.
+
+struct population {
+  struct message_queue* mq;
+  struct block_list* bl;
+  char names[MAX_PEERS][MAX_NAME_BYTE_SIZE];
+  int peers;
+};
+
+static const char* texts[] = {
+  "hi",
+  "hello there, how are you doing today?",
+  "Lorem ipsum dolor sit amet, consectetur adipiscing elit, sed do eiusmod tempor incididunt ut labore et "
+  "dolore magna aliqua. Ut enim ad minim veniam, quis nostrud exercitation ullamco laboris nisi ut aliquip.",
+};
+
+static const char* inputs[] = {
+  "@PEER0007 hi",
+  "@PEER0123 hello there, how are you doing today?",
+  "BLOCK PEER0042",
+  "UNBLOCK PEER0042",
+  "STATS",
+  "@ missing nick",
+};
+
+void populate(struct population* p, int peers) {
+  char port[16];
+
+  p->mq = create_message_queue();
+  p->bl = create_block_list();
+  p->peers = peers;
+  for (int i = 0; i < peers; i++) {
+    snprintf(p->names[i], MAX_NAME_BYTE_SIZE, "PEER%04d", i);
+    snprintf(port, sizeof(port), "%d", 10000 + i);
+    push_back_client(p->mq, p->names[i], "127.0.0.1", port);
+  }
+  // Every other blocked nick is a peer, when there are that many, the rest
+  // are strangers.
+  for (int i = 0; i < BLOCKED; i++) {
+    char name[MAX_NAME_BYTE_SIZE];
+    if (i % 2 == 0)
+      snprintf(name, sizeof(name), "PEER%04d", i * 7);
+    else
+      snprintf(name, sizeof(name), "STRANGER%02d", i);
+    add_block(p->bl, name);
+  }
+}
+
+void depopulate(struct population* p) {
+  destroy_message_queue(p->mq);
+  destroy_block_list(p->bl);
+  destroy_negative_cache();
+}
+
+void bench_find_client(void* arg, long i) {
+  struct population* p = arg;
+  (void)i;
+  bench_sink += find_client(p->mq, p->names[bench_random() % p->peers]) != NULL;
+}
+
+void bench_find_client_miss(void* arg, long i) {
+  struct population* p = arg;
+  (void)i;
+  bench_sink += find_client(p->mq, "NOBODY") != NULL;
+}
+
+void bench_find_client_by_port(void* arg, long i) {
+  struct population* p = arg;
+  (void)i;
+  bench_sink += find_client_by_port(p->mq, 10000 + bench_random() % p->peers) != NULL;
+}
+
+void bench_is_blocked(void* arg, long i) {
+  struct population* p = arg;
+  (void)i;
+  bench_sink += is_blocked(p->bl, p->names[bench_random() % p->peers]);
+}
+
+void bench_is_blocked_slice(void* arg, long i) {
+  struct population* p = arg;
+  (void)i;
+  bench_sink += is_blocked_slice(p->bl, slice_from_string(p->names[bench_random() % p->peers]));
+}
+
+// A message queued for a peer and taken off again once it is acknowledged.
+void bench_message_round(void* arg, long i) {
+  struct client* client = arg;
+  push_back_message(client, client->next_seq_num, (char*)texts[i % 3]);
+  advance_client_next_seq_num(client);
+  bench_sink += client->head->len;
+  pop_front_message(client);
+}
+
+void bench_check_user_input(void* arg, long i) {
+  char nick[BUFSIZE];
+  char line[BUFSIZE];
+  (void)arg;
+
+  strcpy(line, inputs[i % 6]);
+  if (check_user_input(line) == 1) {
+    extract_nickname(nick, line);
+    bench_sink += nick[0];
+  }
+}
+
+int main(void) {
+  static struct population p;
+  int sizes[] = { 16, 256, MAX_PEERS };
+  char name[64];
+
+  for (int s = 0; s < 3; s++) {
+    snprintf(name, sizeof(name), "client, %d peers, %d blocked", sizes[s], BLOCKED);
+    bench_init(name);
+    populate(&p, sizes[s]);
+    bench_run("find_client", bench_find_client, &p, 2000000 / sizes[s] * 16);
+    bench_run("find_client (not found)", bench_find_client_miss, &p, 2000000 / sizes[s] * 16);
+    bench_run("find_client_by_port", bench_find_client_by_port, &p, 2000000 / sizes[s] * 16);
+    bench_run("is_blocked", bench_is_blocked, &p, 1000000);
+    bench_run("is_blocked_slice", bench_is_blocked_slice, &p, 1000000);
+    depopulate(&p);
+  }
+
+  bench_init("client, per message");
+  populate(&p, 1);
+  bench_run("push_back_message + pop_front_message", bench_message_round, p.mq->head, 2000000);
+  bench_run("check_user_input + extract_nickname", bench_check_user_input, NULL, 2000000);
+  depopulate(&p);
+  return EXIT_SUCCESS;
+}
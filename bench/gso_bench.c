@@ -0,0 +1,110 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "send_packet.h"
+#include "io_backend.h"
+
+#define MAX_BURST 44 // As many 1400 byte datagrams as fit in one UDP payload
+#define MAX_SEGMENT 1400
+#define DATAGRAMS_PER_RUN 200000
+
+// ./bench/gso_bench
+// Sends datagrams over loopback in bursts to one address, the way a client
+// sends a window of messages or the ACKs for one: first with a sendmsg and a
+// recvfrom per datagram, then with the burst handed over in one sendmsg
+// (UDP_SEGMENT) and received in one coalesced batch (UDP_GRO). Every socket
+// sends to itself, as segmentation offload is on for one socket only.
+
+struct result {
+  double seconds;
+  long datagrams;
+  long syscalls;
+};
+
+static char burst[MAX_BURST * MAX_SEGMENT];
+
+double elapsed_s(struct timespec begin, struct timespec end) {
+  return (end.tv_sec - begin.tv_sec) + (end.tv_nsec - begin.tv_nsec) / 1e9;
+}
+
+int bound_socket(struct sockaddr_in* addr) {
+  socklen_t len = sizeof(*addr);
+  int sock = socket(AF_INET, SOCK_DGRAM, 0);
+
+  memset(addr, 0, sizeof(*addr));
+  addr->sin_family = AF_INET;
+  addr->sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  if (sock == -1 || bind(sock, (struct sockaddr*)addr, sizeof(*addr)) == -1 ||
+      getsockname(sock, (struct sockaddr*)addr, &len) == -1) {
+    perror("socket");
+    exit(EXIT_FAILURE);
+  }
+  return sock;
+}
+
+struct result run(int sock, struct sockaddr_in* addr, int count, size_t segment, int offload) {
+  struct timespec begin, end;
+  struct result result;
+  char buf[MAX_SEGMENT + 1];
+  long bursts = DATAGRAMS_PER_RUN / count;
+  long syscalls = io_syscalls();
+  ssize_t rc;
+
+  clock_gettime(CLOCK_MONOTONIC, &begin);
+  for (long b = 0; b < bursts; b++) {
+    if (offload) {
+      rc = send_packet_segments(sock, burst, count * segment, segment, 0, (struct sockaddr*)addr, sizeof(*addr));
+    } else {
+      for (int i = 0; i < count; i++) {
+        rc = send_packet(sock, burst + i * segment, segment, 0, (struct sockaddr*)addr, sizeof(*addr));
+        if (rc == -1)
+          break;
+      }
+    }
+    if (rc == -1) {
+      perror("send");
+      exit(EXIT_FAILURE);
+    }
+    for (int i = 0; i < count; i++) {
+      if (recv_packet(sock, buf, sizeof(buf), 0, NULL, NULL) == -1) {
+        perror("recv");
+        exit(EXIT_FAILURE);
+      }
+    }
+  }
+  clock_gettime(CLOCK_MONOTONIC, &end);
+
+  result.seconds = elapsed_s(begin, end);
+  result.datagrams = bursts * count;
+  result.syscalls = io_syscalls() - syscalls;
+  return result;
+}
+
+void report(const char* name, int count, size_t segment, struct result r) {
+  printf("  %-28s %3d x %4zu B %10.0f datagrams/s %8.1f MB/s %6.2f syscalls/datagram\n", name, count, segment,
+         r.datagrams / r.seconds, r.datagrams * segment / r.seconds / 1e6, (double)r.syscalls / r.datagrams);
+}
+
+int main(void) {
+  struct sockaddr_in plain_addr, offload_addr;
+  int plain = bound_socket(&plain_addr);
+  int offload = bound_socket(&offload_addr);
+  int bursts[] = { 5, 32, MAX_BURST };
+  size_t segments[] = { 64, MAX_SEGMENT };
+
+  memset(burst, 'x', sizeof(burst));
+  if (set_segmentation(offload) == -1)
+    printf("UDP segmentation offload unavailable: both runs send a datagram at a time\n");
+
+  printf("loopback, bursts to one address\n");
+  for (int s = 0; s < 2; s++) {
+    for (int b = 0; b < 3; b++) {
+      report("sendmsg + recvfrom", bursts[b], segments[s], run(plain, &plain_addr, bursts[b], segments[s], 0));
+      report("UDP_SEGMENT + UDP_GRO", bursts[b], segments[s],
+             run(offload, &offload_addr, bursts[b], segments[s], 1));
+    }
+  }
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,301 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <time.h>
+
+#include "parse_packet.h"
+
+#define BUFSIZE 1401
+#define MAX_NAME_BYTE_SIZE 20
+#define MAX_PACKETS 256
+#define ITERATIONS 2000000
+#define MUTATIONS 20000
+
+// ./bench/parse_bench bench/parse_corpus.txt
+// Every line of the corpus is one packet. REG and LOOKUP lines are NUL-padded
+// the way upush_client sends them.
+
+struct corpus {
+  int size;
+  char* packet[MAX_PACKETS];
+  size_t len[MAX_PACKETS];
+  int to_client[MAX_PACKETS];
+};
+
+static unsigned int rng_state = 2021;
+
+unsigned int next_random() {
+  rng_state ^= rng_state << 13;
+  rng_state ^= rng_state >> 17;
+  rng_state ^= rng_state << 5;
+  return rng_state;
+}
+
+double elapsed_ns(struct timespec begin, struct timespec end) {
+  return (end.tv_sec - begin.tv_sec) * 1e9 + (end.tv_nsec - begin.tv_nsec);
+}
+
+/* The client's parser before the shared one: a full strcpy and a strtok pass.
+ * NULL checks are added so the corpus cannot crash it.
+ */
+int legacy_is_valid_message_format(char* msg, char* from_nick, char* to_nick) {
+  char msg_copy[BUFSIZE];
+  char* token;
+
+  if (strlen(msg) < 23)
+    return 0;
+
+  strcpy(msg_copy, msg);
+  token = strtok(msg_copy, " ");
+  if (token == NULL || strcmp(token, "PKT"))
+    return 0;
+
+  token = strtok(NULL, " ");
+  if (token == NULL || !isdigit(token[0]) || strlen(token) > 1)
+    return 0;
+
+  token = strtok(NULL, " ");
+  if (token == NULL || strcmp(token, "FROM"))
+    return 0;
+
+  token = strtok(NULL, " ");
+  if (token == NULL || strlen(token) >= MAX_NAME_BYTE_SIZE)
+    return 0;
+  strcpy(from_nick, token);
+
+  token = strtok(NULL, " ");
+  if (token == NULL || strcmp(token, "TO"))
+    return 0;
+
+  token = strtok(NULL, " ");
+  if (token == NULL || strlen(token) >= MAX_NAME_BYTE_SIZE)
+    return 0;
+  strcpy(to_nick, token);
+
+  token = strtok(NULL, " ");
+  if (token == NULL || strcmp(token, "MSG"))
+    return 0;
+
+  token = strtok(NULL, " ");
+  if (token == NULL)
+    return 0;
+
+  return 1;
+}
+
+/* The client's receive path before the shared parser: validate, then find the
+ * message body again with offset arithmetic.
+ */
+const char* legacy_client_parse(char* buf) {
+  char from_nick[MAX_NAME_BYTE_SIZE];
+  char to_nick[MAX_NAME_BYTE_SIZE];
+
+  if (!legacy_is_valid_message_format(buf, from_nick, to_nick))
+    return NULL;
+  return buf + 20 + strlen(from_nick) + strlen(to_nick);
+}
+
+/* The server's parse before the shared parser. strtok writes into the buffer,
+ * so the packet is copied back in first; that copy is included in the timing.
+ */
+const char* legacy_server_parse(char* scratch, const char* packet, size_t len) {
+  char* command;
+  char* name;
+
+  memcpy(scratch, packet, len);
+  scratch[len] = '\0';
+  strtok(scratch, " ");
+  strtok(NULL, " ");
+  command = strtok(NULL, " ");
+  name = strtok(NULL, " ");
+  if (command == NULL || name == NULL)
+    return NULL;
+  return strcmp(command, "REG") && strcmp(command, "LOOKUP") ? NULL : name;
+}
+
+void load_corpus(struct corpus* corpus, const char* path) {
+  FILE* file = fopen(path, "r");
+  char line[BUFSIZE];
+  size_t len, padded;
+
+  if (file == NULL) {
+    perror(path);
+    exit(EXIT_FAILURE);
+  }
+
+  corpus->size = 0;
+  while (corpus->size < MAX_PACKETS && fgets(line, BUFSIZE, file) != NULL) {
+    len = strcspn(line, "\n");
+    line[len] = '\0';
+    padded = len + 1;
+    if (strstr(line, " REG ") != NULL && padded < 32)
+      padded = 32;
+    else if (strstr(line, " LOOKUP ") != NULL && padded < 36)
+      padded = 36;
+
+    corpus->packet[corpus->size] = calloc(1, padded);
+    memcpy(corpus->packet[corpus->size], line, len);
+    corpus->len[corpus->size] = padded;
+    corpus->to_client[corpus->size] = strstr(line, " FROM ") != NULL || !strncmp(line, "ACK", 3);
+    corpus->size += 1;
+  }
+  fclose(file);
+}
+
+int slice_within(struct slice s, const char* buf, size_t len) {
+  return s.ptr == NULL || (s.ptr >= buf && s.ptr + s.len <= buf + len);
+}
+
+int check_packet(const char* buf, size_t len) {
+  struct packet pkt;
+
+  switch (parse_packet(buf, len, &pkt)) {
+    case PACKET_INVALID:
+      return 1;
+    case PACKET_REG:
+    case PACKET_HB:
+    case PACKET_LOOKUP:
+    case PACKET_SUB:
+    case PACKET_UNSUB:
+      if (memchr(pkt.nick.ptr, ' ', pkt.nick.len) != NULL)
+        return 0;
+      break;
+    case PACKET_MSG:
+    case PACKET_RELAY:
+      if (memchr(pkt.from.ptr, ' ', pkt.from.len) != NULL ||
+          memchr(pkt.to.ptr, ' ', pkt.to.len) != NULL || pkt.msg.len == 0)
+        return 0;
+      break;
+    case PACKET_PING:
+      if (pkt.text.ptr != NULL || pkt.nick.ptr != NULL)
+        return 0;
+      break;
+    case PACKET_ACK:
+    case PACKET_NOTIFY:
+    case PACKET_INTRO:
+      if (pkt.text.len == 0)
+        return 0;
+      break;
+  }
+
+  return isdigit((unsigned char)pkt.seq) &&
+         slice_within(pkt.nick, buf, len) && slice_within(pkt.from, buf, len) &&
+         slice_within(pkt.to, buf, len) && slice_within(pkt.msg, buf, len) &&
+         slice_within(pkt.text, buf, len);
+}
+
+void fuzz(struct corpus* corpus) {
+  const char alphabet[] = " PKTACKREGLOOKUPFROMTOMSG0123456789\n";
+  char buf[BUFSIZE];
+  size_t len, pos;
+  int i, accepted = 0, failures = 0;
+
+  for (i = 0; i < MUTATIONS; i++) {
+    int seed = next_random() % corpus->size;
+    len = corpus->len[seed];
+    memcpy(buf, corpus->packet[seed], len);
+
+    for (int edits = 1 + next_random() % 3; edits > 0 && len > 0; edits--) {
+      pos = next_random() % len;
+      switch (next_random() % 4) {
+        case 0: // Replace a byte
+          buf[pos] = alphabet[next_random() % (sizeof(alphabet) - 1)];
+          break;
+        case 1: // Replace a byte with anything, NUL included
+          buf[pos] = next_random() & 0xff;
+          break;
+        case 2: // Delete a byte
+          memmove(buf + pos, buf + pos + 1, len - pos - 1);
+          len--;
+          break;
+        case 3: // Truncate
+          len = pos;
+          break;
+      }
+    }
+
+    if (!check_packet(buf, len)) {
+      failures++;
+      fprintf(stderr, "FUZZ: bad slices for %.*s\n", (int)len, buf);
+    }
+    if (parse_packet(buf, len, &(struct packet){0}) != PACKET_INVALID)
+      accepted++;
+  }
+
+  printf("fuzz: %d mutated packets, %d accepted, %d invariant failures\n",
+          MUTATIONS, accepted, failures);
+  if (failures)
+    exit(EXIT_FAILURE);
+}
+
+void compare(struct corpus* corpus) {
+  char scratch[BUFSIZE];
+  struct packet pkt;
+  int legacy, current, mismatches = 0;
+
+  for (int i = 0; i < corpus->size; i++) {
+    legacy = legacy_client_parse(corpus->packet[i]) != NULL ||
+             legacy_server_parse(scratch, corpus->packet[i], corpus->len[i]) != NULL;
+    parse_packet(corpus->packet[i], corpus->len[i], &pkt);
+    current = pkt.type == PACKET_MSG || pkt.type == PACKET_REG || pkt.type == PACKET_LOOKUP;
+    if (legacy != current) {
+      mismatches++;
+      printf("differs: %s (legacy %d, parse_packet %d)\n", corpus->packet[i], legacy, current);
+    }
+  }
+  printf("corpus: %d packets, %d classified differently\n", corpus->size, mismatches);
+}
+
+void benchmark(struct corpus* corpus) {
+  struct timespec begin, end;
+  char scratch[BUFSIZE];
+  struct packet pkt;
+  volatile size_t sink = 0;
+  int i, n;
+
+  clock_gettime(CLOCK_MONOTONIC, &begin);
+  for (i = 0; i < ITERATIONS; i++) {
+    n = i % corpus->size;
+    const char* parsed;
+    if (corpus->to_client[n])
+      parsed = legacy_client_parse(corpus->packet[n]);
+    else
+      parsed = legacy_server_parse(scratch, corpus->packet[n], corpus->len[n]);
+    sink += parsed != NULL ? (size_t)*parsed : 0;
+  }
+  clock_gettime(CLOCK_MONOTONIC, &end);
+  printf("legacy strtok parse:  %7.1f ns/packet\n", elapsed_ns(begin, end) / ITERATIONS);
+
+  clock_gettime(CLOCK_MONOTONIC, &begin);
+  for (i = 0; i < ITERATIONS; i++) {
+    n = i % corpus->size;
+    parse_packet(corpus->packet[n], corpus->len[n], &pkt);
+    sink += pkt.type + pkt.msg.len + pkt.nick.len;
+  }
+  clock_gettime(CLOCK_MONOTONIC, &end);
+  printf("parse_packet:         %7.1f ns/packet\n", elapsed_ns(begin, end) / ITERATIONS);
+}
+
+int main(int argc, char const *argv[]) {
+  struct corpus corpus;
+
+  if (argc < 2) {
+    printf("Usage: ./parse_bench <corpus>\n");
+    return 0;
+  }
+
+  load_corpus(&corpus, argv[1]);
+  if (corpus.size == 0) {
+    fprintf(stderr, "EMPTY CORPUS\n");
+    return EXIT_FAILURE;
+  }
+
+  compare(&corpus);
+  fuzz(&corpus);
+  benchmark(&corpus);
+
+  for (int i = 0; i < corpus.size; i++)
+    free(corpus.packet[i]);
+  return EXIT_SUCCESS;
+}
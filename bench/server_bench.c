@@ -0,0 +1,164 @@
+// The server is a single file with its own main, so it is included whole
+// and its main renamed, which gives the benchmarks its static functions too.
+#define main upush_server_main
+#include "../upush_server.c"
+#undef main
+
+#include "bench.h"
+
+#define MAX_REGISTRY 10000
+#define MAX_PACKETS 256
+
+// ./bench/server_bench bench/parse_corpus.txt
+// Nicks are registered as NICK00000, NICK00001, ... from consecutive ports
+// on 127.0.0.1. Every line of the corpus is one packet.
+
+struct population {
+  struct client_list* cl;
+  char names[MAX_REGISTRY][16];
+  struct origin origins[MAX_REGISTRY];
+  int size;
+};
+
+struct corpus {
+  int size;
+  char* packet[MAX_PACKETS];
+  size_t len[MAX_PACKETS];
+};
+
+void populate(struct population* p, int size) {
+  p->cl = create_client_list();
+  p->size = size;
+  for (int i = 0; i < size; i++) {
+    snprintf(p->names[i], sizeof(p->names[i]), "NICK%05d", i);
+    memset(&p->origins[i], 0, sizeof(struct origin));
+    p->origins[i].addr.sin_family = AF_INET;
+    p->origins[i].addr.sin_port = htons(20000 + i);
+    inet_pton(AF_INET, "127.0.0.1", &p->origins[i].addr.sin_addr);
+    push_back_client(p->cl, slice_from_string(p->names[i]), &p->origins[i]);
+  }
+}
+
+void load_corpus(struct corpus* corpus, const char* path) {
+  FILE* file = fopen(path, "r");
+  char line[BUFSIZE];
+  size_t len;
+
+  if (file == NULL) {
+    perror(path);
+    exit(EXIT_FAILURE);
+  }
+
+  corpus->size = 0;
+  while (corpus->size < MAX_PACKETS && fgets(line, BUFSIZE, file) != NULL) {
+    len = strcspn(line, "\n");
+    corpus->packet[corpus->size] = strndup(line, len);
+    corpus->len[corpus->size] = len;
+    corpus->size += 1;
+  }
+  fclose(file);
+}
+
+void bench_find_client(void* arg, long i) {
+  struct population* p = arg;
+  (void)i;
+  bench_sink += find_client(p->cl, slice_from_string(p->names[bench_random() % p->size])) != NULL;
+}
+
+void bench_find_client_miss(void* arg, long i) {
+  struct population* p = arg;
+  (void)i;
+  bench_sink += find_client(p->cl, slice_from_string("NOBODY")) != NULL;
+}
+
+void bench_find_client_by_address(void* arg, long i) {
+  struct population* p = arg;
+  (void)i;
+  bench_sink += find_client_by_address(p->cl, p->origins[bench_random() % p->size].addr) != NULL;
+}
+
+// A heartbeat from where the client registered.
+void bench_update_client(void* arg, long i) {
+  struct population* p = arg;
+  int n = bench_random() % p->size;
+  (void)i;
+  bench_sink += update_client(p->cl, slice_from_string(p->names[n]), &p->origins[n]);
+}
+
+void bench_render_batch_entry(void* arg, long i) {
+  struct population* p = arg;
+  char entry[ENTRYSIZE];
+  (void)i;
+  bench_sink += render_batch_entry(entry, p->cl, slice_from_string(p->names[bench_random() % p->size]));
+}
+
+void bench_create_ack(void* arg, long i) {
+  char ack[ACKSIZE];
+  (void)arg;
+  create_ack(ack, '0' + (i & 1), "OK");
+  bench_sink += ack[4];
+}
+
+void bench_create_lease_ack(void* arg, long i) {
+  char ack[ACKSIZE];
+  (void)arg;
+  create_lease_ack(ack, '0' + (i & 1));
+  bench_sink += ack[4];
+}
+
+// What every datagram goes through before it is served.
+void bench_admit_datagram(void* arg, long i) {
+  struct population* p = arg;
+  struct datagram* d = &batch[i % ADMIT_BATCH];
+  d->addr = p->origins[bench_random() % p->size].addr;
+  bench_sink += admit_datagram(d, i);
+}
+
+void bench_parse(void* arg, long i) {
+  struct corpus* corpus = arg;
+  struct packet pkt;
+  int n = i % corpus->size;
+  bench_sink += is_lookup(corpus->packet[n], corpus->len[n]);
+  bench_sink += parse_packet(corpus->packet[n], corpus->len[n], &pkt);
+}
+
+int main(int argc, char const *argv[]) {
+  static struct population p;
+  static struct corpus corpus;
+  int sizes[] = { 100, 1000, MAX_REGISTRY };
+  char name[64];
+
+  if (argc < 2) {
+    printf("Usage: ./server_bench <corpus>\n");
+    return 0;
+  }
+  load_corpus(&corpus, argv[1]);
+  if (corpus.size == 0) {
+    fprintf(stderr, "EMPTY CORPUS\n");
+    return EXIT_FAILURE;
+  }
+
+  for (int s = 0; s < 3; s++) {
+    long lookups = 20000000L / sizes[s];
+    snprintf(name, sizeof(name), "server, %d registered", sizes[s]);
+    bench_init(name);
+    populate(&p, sizes[s]);
+    bench_run("find_client", bench_find_client, &p, lookups);
+    bench_run("find_client (not found)", bench_find_client_miss, &p, lookups);
+    bench_run("find_client_by_address", bench_find_client_by_address, &p, lookups / 4);
+    bench_run("update_client (heartbeat)", bench_update_client, &p, lookups);
+    bench_run("render_batch_entry", bench_render_batch_entry, &p, lookups);
+    bench_run("admit_datagram", bench_admit_datagram, &p, 2000000);
+    destroy_client_list(p.cl);
+  }
+
+  bench_init("server, per packet");
+  bench_run("create_ack", bench_create_ack, NULL, 2000000);
+  bench_run("create_lease_ack", bench_create_lease_ack, NULL, 2000000);
+  snprintf(name, sizeof(name), "is_lookup + parse_packet (%d packets)", corpus.size);
+  bench_run(name, bench_parse, &corpus, 2000000);
+
+  for (int i = 0; i < corpus.size; i++)
+    free(corpus.packet[i]);
+  return EXIT_SUCCESS;
+}
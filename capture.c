@@ -0,0 +1,47 @@
+#include <string.h>
+#include <time.h>
+
+#include "capture.h"
+
+FILE* capture_open(const char* path) {
+  FILE* file = fopen(path, "wb");
+  if (file == NULL)
+    return NULL;
+
+  fwrite(CAPTURE_MAGIC, 1, CAPTURE_MAGIC_SIZE, file);
+  return file;
+}
+
+void capture_datagram(FILE* file, const void* buf, size_t len, const struct sockaddr_in* src) {
+  struct capture_record rec;
+  struct timespec now;
+
+  clock_gettime(CLOCK_REALTIME, &now);
+  rec.usec = now.tv_sec * 1000000ULL + now.tv_nsec / 1000;
+  rec.addr = src->sin_addr.s_addr;
+  rec.port = src->sin_port;
+  rec.len = len > UINT16_MAX ? UINT16_MAX : len;
+
+  fwrite(&rec, sizeof(rec), 1, file);
+  fwrite(buf, 1, rec.len, file);
+}
+
+FILE* capture_open_read(const char* path) {
+  char magic[CAPTURE_MAGIC_SIZE];
+  FILE* file = fopen(path, "rb");
+  if (file == NULL)
+    return NULL;
+
+  if (fread(magic, 1, CAPTURE_MAGIC_SIZE, file) != CAPTURE_MAGIC_SIZE ||
+      memcmp(magic, CAPTURE_MAGIC, CAPTURE_MAGIC_SIZE)) {
+    fclose(file);
+    return NULL;
+  }
+  return file;
+}
+
+int capture_read(FILE* file, struct capture_record* rec, char* buf) {
+  if (fread(rec, sizeof(*rec), 1, file) != 1)
+    return 0;
+  return fread(buf, 1, rec->len, file) == rec->len;
+}
@@ -0,0 +1,38 @@
+#ifndef CAPTURE_H
+#define CAPTURE_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <netinet/in.h>
+
+#define CAPTURE_MAGIC "UPCAP01\n"
+#define CAPTURE_MAGIC_SIZE 8
+
+/* A capture file is CAPTURE_MAGIC followed by one record per datagram, each
+ * a 16-byte header in host byte order and then len bytes of payload. The
+ * source address and port are kept in network byte order, as in sockaddr_in.
+ */
+struct capture_record {
+  uint64_t usec;
+  uint32_t addr;
+  uint16_t port;
+  uint16_t len;
+};
+
+/* Creates the capture file and writes its magic. Returns NULL on failure. */
+FILE* capture_open(const char* path);
+
+/* Appends one received datagram, stamped with the current time. */
+void capture_datagram(FILE* file, const void* buf, size_t len, const struct sockaddr_in* src);
+
+/* Opens a capture file for reading and checks its magic. Returns NULL if the
+ * file cannot be opened or is not a capture.
+ */
+FILE* capture_open_read(const char* path);
+
+/* Reads the next record into rec and its payload into buf, which must hold
+ * at least UINT16_MAX bytes. Returns 1 on success and 0 at the end of the file.
+ */
+int capture_read(FILE* file, struct capture_record* rec, char* buf);
+
+#endif /* CAPTURE_H */
@@ -0,0 +1,130 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <arpa/inet.h>
+
+#include "cluster.h"
+
+struct ring_point {
+  uint32_t hash;
+  int shard;
+};
+
+static struct sockaddr_in shards[MAX_SHARDS];
+static int shard_count;
+static int self_index = -1;
+static struct ring_point ring[MAX_SHARDS * VNODES];
+static int ring_size;
+
+uint32_t cluster_hash(const char* data, size_t len) {
+  uint32_t hash = 2166136261u;
+  for (size_t i = 0; i < len; i++) {
+    hash ^= (unsigned char)data[i];
+    hash *= 16777619u;
+  }
+
+  // FNV-1a barely mixes the last bytes, and ring points differ only there,
+  // so finish with the MurmurHash3 mixer to spread them around the ring.
+  hash ^= hash >> 16;
+  hash *= 0x85ebca6bu;
+  hash ^= hash >> 13;
+  hash *= 0xc2b2ae35u;
+  hash ^= hash >> 16;
+  return hash;
+}
+
+static int compare_ring_points(const void* a, const void* b) {
+  const struct ring_point* x = a;
+  const struct ring_point* y = b;
+  if (x->hash != y->hash)
+    return x->hash < y->hash ? -1 : 1;
+  return x->shard - y->shard;
+}
+
+int cluster_configure(const char* spec, const struct sockaddr_in* self) {
+  char copy[1024];
+  char point[64];
+  char* member;
+  char* saveptr;
+  char* colon;
+  int len;
+
+  if (strlen(spec) >= sizeof(copy))
+    return -1;
+  strcpy(copy, spec);
+
+  shard_count = 0;
+  self_index = -1;
+  for (member = strtok_r(copy, ",", &saveptr); member != NULL; member = strtok_r(NULL, ",", &saveptr)) {
+    colon = strchr(member, ':');
+    if (colon == NULL || shard_count == MAX_SHARDS)
+      return -1;
+    *colon = '\0';
+
+    memset(&shards[shard_count], 0, sizeof(struct sockaddr_in));
+    shards[shard_count].sin_family = AF_INET;
+    shards[shard_count].sin_port = htons(atoi(colon + 1));
+    if (inet_pton(AF_INET, member, &shards[shard_count].sin_addr) != 1 || atoi(colon + 1) <= 0)
+      return -1;
+    if (shards[shard_count].sin_port == self->sin_port &&
+        shards[shard_count].sin_addr.s_addr == self->sin_addr.s_addr)
+      self_index = shard_count;
+    shard_count += 1;
+  }
+  if (self_index == -1)
+    return -1;
+
+  // Points are placed by the shard's address, not its position in the list,
+  // so every shard builds the same ring whatever order it was given.
+  ring_size = 0;
+  for (int shard = 0; shard < shard_count; shard++) {
+    for (int i = 0; i < VNODES; i++) {
+      len = snprintf(point, sizeof(point), "%s:%d#%d", inet_ntoa(shards[shard].sin_addr),
+                     ntohs(shards[shard].sin_port), i);
+      ring[ring_size].hash = cluster_hash(point, len);
+      ring[ring_size].shard = shard;
+      ring_size += 1;
+    }
+  }
+  qsort(ring, ring_size, sizeof(struct ring_point), compare_ring_points);
+  return 0;
+}
+
+int cluster_enabled(void) {
+  return self_index != -1;
+}
+
+int cluster_owner(struct slice nick) {
+  uint32_t hash = cluster_hash(nick.ptr, nick.len);
+  int low = 0, high = ring_size;
+
+  // The first point at or after the hash owns it, wrapping past the top.
+  while (low < high) {
+    int mid = (low + high) / 2;
+    if (ring[mid].hash < hash)
+      low = mid + 1;
+    else
+      high = mid;
+  }
+  return ring[low == ring_size ? 0 : low].shard;
+}
+
+int cluster_self(void) {
+  return self_index;
+}
+
+int cluster_size(void) {
+  return shard_count;
+}
+
+const struct sockaddr_in* cluster_shard(int index) {
+  return &shards[index];
+}
+
+int cluster_find_shard(const struct sockaddr_in* addr) {
+  for (int i = 0; i < shard_count; i++) {
+    if (shards[i].sin_port == addr->sin_port && shards[i].sin_addr.s_addr == addr->sin_addr.s_addr)
+      return i;
+  }
+  return -1;
+}
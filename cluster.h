@@ -0,0 +1,44 @@
+#ifndef CLUSTER_H
+#define CLUSTER_H
+
+#include <stdint.h>
+#include <netinet/in.h>
+
+#include "parse_packet.h"
+
+#define MAX_SHARDS 16
+#define VNODES 64 // Points per shard on the hash ring
+
+/* A cluster is a fixed list of server processes, each owning the nicks that
+ * hash to its arcs of a consistent-hash ring. Every shard gets VNODES points
+ * on the ring, so adding a shard moves only the nicks on the arcs it takes
+ * over, about 1/n of them, and spreads the rest evenly.
+ */
+
+/* Parses "ip:port,ip:port,..." and builds the ring. self, the address this
+ * process is bound to, must be in the list. Returns -1 if the spec is invalid.
+ */
+int cluster_configure(const char* spec, const struct sockaddr_in* self);
+
+/* Returns 1 once cluster_configure has succeeded. */
+int cluster_enabled(void);
+
+/* 32-bit FNV-1a with a final mix, the hash for both ring points and nicks. */
+uint32_t cluster_hash(const char* data, size_t len);
+
+/* Returns the index of the shard that owns nick. */
+int cluster_owner(struct slice nick);
+
+/* Returns the index of this process's shard. */
+int cluster_self(void);
+
+/* Returns the number of shards. */
+int cluster_size(void);
+
+/* Returns the address of shard index. */
+const struct sockaddr_in* cluster_shard(int index);
+
+/* Returns the index of the shard at addr, or -1 if addr is not a shard. */
+int cluster_find_shard(const struct sockaddr_in* addr);
+
+#endif /* CLUSTER_H */
@@ -0,0 +1,209 @@
+#include <pthread.h>
+#include <signal.h>
+#include <stdarg.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "console.h"
+
+struct console_line {
+  enum console_level level;
+  int len;
+  char text[CONSOLE_LINE_SIZE];
+};
+
+// A single-producer, single-consumer ring: only the thread calling
+// console_log moves tail and only the output thread moves head, so neither
+// ever waits for the other to take a slot.
+static struct console_line lines[CONSOLE_LINES];
+static atomic_uint head;
+static atomic_uint tail;
+static atomic_int idle; // The output thread is asleep and needs a signal
+static atomic_long written;
+static atomic_long dropped;
+static long filtered;
+static enum console_level max_level = CONSOLE_INFO;
+
+static pthread_t thread;
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t wake = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t drained = PTHREAD_COND_INITIALIZER;
+static unsigned int flushed; // Lines written and flushed, under lock
+static int running, stopping, registered;
+
+static FILE* level_stream(enum console_level level) {
+  return level <= CONSOLE_WARNING ? stderr : stdout;
+}
+
+static void* console_thread(void* arg) {
+  struct console_line* line;
+  unsigned int next = atomic_load(&head);
+  long reported = 0, now;
+  int done;
+
+  (void)arg;
+  for (;;) {
+    while (next != atomic_load_explicit(&tail, memory_order_acquire)) {
+      line = &lines[next % CONSOLE_LINES];
+      fwrite(line->text, 1, line->len, level_stream(line->level));
+      next += 1;
+      atomic_store_explicit(&head, next, memory_order_release);
+      atomic_fetch_add(&written, 1);
+    }
+    now = atomic_load(&dropped);
+    if (now != reported) {
+      fprintf(stderr, "CONSOLE: %ld LINES DROPPED\n", now - reported);
+      reported = now;
+    }
+    fflush(stdout);
+    fflush(stderr);
+
+    pthread_mutex_lock(&lock);
+    flushed = next;
+    pthread_cond_broadcast(&drained);
+    atomic_store(&idle, 1);
+    while (!stopping && atomic_load(&tail) == next)
+      pthread_cond_wait(&wake, &lock);
+    atomic_store(&idle, 0);
+    done = stopping && atomic_load(&tail) == next;
+    pthread_mutex_unlock(&lock);
+    if (done)
+      return NULL;
+  }
+}
+
+int console_set_level(const char* name) {
+  static const char* names[] = { "error", "warning", "info", "debug" };
+
+  for (int i = CONSOLE_ERROR; i <= CONSOLE_DEBUG; i++) {
+    if (!strcmp(name, names[i])) {
+      max_level = i;
+      return 0;
+    }
+  }
+  return -1;
+}
+
+int console_start(void) {
+  sigset_t all, old;
+  int rc;
+
+  if (running)
+    return 0;
+  // The output thread takes no signals, so SIGINT and SIGTERM still
+  // interrupt the packet loop.
+  sigfillset(&all);
+  pthread_sigmask(SIG_SETMASK, &all, &old);
+  stopping = 0;
+  rc = pthread_create(&thread, NULL, console_thread, NULL);
+  pthread_sigmask(SIG_SETMASK, &old, NULL);
+  if (rc != 0)
+    return -1;
+  running = 1;
+  if (!registered) {
+    atexit(console_stop);
+    registered = 1;
+  }
+  return 0;
+}
+
+void console_stop(void) {
+  if (!running)
+    return;
+  pthread_mutex_lock(&lock);
+  stopping = 1;
+  pthread_cond_signal(&wake);
+  pthread_mutex_unlock(&lock);
+  pthread_join(thread, NULL);
+  running = 0;
+}
+
+void console_flush(void) {
+  unsigned int target;
+
+  if (!running)
+    return;
+  target = atomic_load(&tail);
+  pthread_mutex_lock(&lock);
+  while ((int)(flushed - target) < 0) {
+    pthread_cond_signal(&wake);
+    pthread_cond_wait(&drained, &lock);
+  }
+  pthread_mutex_unlock(&lock);
+}
+
+// Waits until the output thread has taken a line off the full queue.
+static void wait_for_room(unsigned int slot) {
+  pthread_mutex_lock(&lock);
+  while (slot - atomic_load_explicit(&head, memory_order_acquire) == CONSOLE_LINES) {
+    pthread_cond_signal(&wake);
+    pthread_cond_wait(&drained, &lock);
+  }
+  pthread_mutex_unlock(&lock);
+}
+
+static void queue_line(enum console_level level, int wait, const char* format, va_list ap) {
+  struct console_line* line;
+  unsigned int slot;
+  int len;
+
+  if (!running) {
+    vfprintf(level_stream(level), format, ap);
+    atomic_fetch_add(&written, 1);
+    return;
+  }
+
+  slot = atomic_load_explicit(&tail, memory_order_relaxed);
+  if (slot - atomic_load_explicit(&head, memory_order_acquire) == CONSOLE_LINES) {
+    if (!wait) {
+      atomic_fetch_add(&dropped, 1);
+      return;
+    }
+    wait_for_room(slot);
+  }
+  line = &lines[slot % CONSOLE_LINES];
+  len = vsnprintf(line->text, CONSOLE_LINE_SIZE, format, ap);
+  if (len < 0)
+    return;
+  if (len >= CONSOLE_LINE_SIZE) { // Cut short, but still a whole line
+    len = CONSOLE_LINE_SIZE - 1;
+    line->text[len - 1] = '\n';
+  }
+  line->level = level;
+  line->len = len;
+  atomic_store(&tail, slot + 1);
+
+  // Only a sleeping output thread needs the lock taken to wake it.
+  if (atomic_exchange(&idle, 0)) {
+    pthread_mutex_lock(&lock);
+    pthread_cond_signal(&wake);
+    pthread_mutex_unlock(&lock);
+  }
+}
+
+void console_log(enum console_level level, const char* format, ...) {
+  va_list ap;
+
+  if (level > max_level) {
+    filtered += 1;
+    return;
+  }
+
+  va_start(ap, format);
+  queue_line(level, 0, format, ap);
+  va_end(ap);
+}
+
+void console_print(const char* format, ...) {
+  va_list ap;
+
+  va_start(ap, format);
+  queue_line(CONSOLE_INFO, 1, format, ap);
+  va_end(ap);
+}
+
+void print_console_stats(FILE* out) {
+  fprintf(out, "CONSOLE: %ld lines, %ld filtered, %ld dropped\n", atomic_load(&written), filtered,
+          atomic_load(&dropped));
+}
@@ -0,0 +1,60 @@
+#ifndef CONSOLE_H
+#define CONSOLE_H
+
+#include <stdio.h>
+
+#define CONSOLE_LINES 1024     // Lines the queue holds, a power of two
+#define CONSOLE_LINE_SIZE 1536 // Longest line, room for a whole datagram
+
+/* Console output and logging off the packet path. Once console_start has
+ * run, console_log only formats the line into a queue that a thread of its
+ * own writes to stdout or stderr, so a slow terminal or log file never
+ * holds up a send or a receive. When the queue is full a log line is
+ * dropped and counted instead of waiting; only console_print, for what the
+ * user has to see, waits. Errors and warnings go to stderr, the rest to
+ * stdout.
+ */
+
+enum console_level {
+  CONSOLE_ERROR,
+  CONSOLE_WARNING,
+  CONSOLE_INFO,
+  CONSOLE_DEBUG
+};
+
+/* Sets the most verbose level written, from "error", "warning", "info" or
+ * "debug". Returns -1 if name is none of them. The default is info.
+ */
+int console_set_level(const char* name);
+
+/* Starts the output thread. Until then, and after console_stop,
+ * console_log writes directly. The queue is drained at exit. Returns -1 if
+ * the thread cannot be started, which leaves console_log writing directly.
+ */
+int console_start(void);
+
+/* Writes out everything queued and stops the output thread. */
+void console_stop(void);
+
+/* Waits until everything queued so far has been written, before writing
+ * to stdout or stderr directly.
+ */
+void console_flush(void);
+
+/* Queues a line at level, formatted like printf, unless the level is
+ * filtered out. The line should end with a newline.
+ */
+void console_log(enum console_level level, const char* format, ...)
+  __attribute__((format(printf, 2, 3)));
+
+/* Queues a line of output for the user, such as a received message, on
+ * stdout. Unlike console_log it is never filtered out, and when the queue is
+ * full it waits for room instead of dropping the line.
+ */
+void console_print(const char* format, ...)
+  __attribute__((format(printf, 1, 2)));
+
+/* Prints how many lines were written, filtered out and dropped. */
+void print_console_stats(FILE* out);
+
+#endif /* CONSOLE_H */
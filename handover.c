@@ -0,0 +1,120 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "handover.h"
+
+static int unix_address(const char* path, struct sockaddr_un* addr) {
+  if (strlen(path) >= sizeof(addr->sun_path))
+    return -1;
+  memset(addr, 0, sizeof(*addr));
+  addr->sun_family = AF_UNIX;
+  strcpy(addr->sun_path, path);
+  return 0;
+}
+
+int handover_listen(const char* path) {
+  struct sockaddr_un addr;
+  int listener;
+
+  if (unix_address(path, &addr) == -1)
+    return -1;
+  listener = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (listener == -1)
+    return -1;
+
+  // The predecessor is done with the path once it has handed over.
+  unlink(path);
+  if (bind(listener, (struct sockaddr*)&addr, sizeof(addr)) == -1 || listen(listener, 1) == -1) {
+    close(listener);
+    return -1;
+  }
+  return listener;
+}
+
+FILE* handover_give(int listener, int sock) {
+  struct msghdr msg;
+  struct iovec iov;
+  struct cmsghdr* cmsg;
+  char control[CMSG_SPACE(sizeof(int))];
+  char byte = 'S';
+  int conn;
+  FILE* out;
+
+  conn = accept(listener, NULL, NULL);
+  if (conn == -1)
+    return NULL;
+
+  // Ancillary data has to ride on at least one byte of ordinary data.
+  iov.iov_base = &byte;
+  iov.iov_len = 1;
+  memset(&msg, 0, sizeof(msg));
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = control;
+  msg.msg_controllen = sizeof(control);
+  cmsg = CMSG_FIRSTHDR(&msg);
+  cmsg->cmsg_level = SOL_SOCKET;
+  cmsg->cmsg_type = SCM_RIGHTS;
+  cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+  memcpy(CMSG_DATA(cmsg), &sock, sizeof(int));
+
+  if (sendmsg(conn, &msg, 0) != 1) {
+    close(conn);
+    return NULL;
+  }
+  out = fdopen(conn, "w");
+  if (out == NULL)
+    close(conn);
+  return out;
+}
+
+FILE* handover_take(const char* path, int* sock) {
+  struct sockaddr_un addr;
+  struct msghdr msg;
+  struct iovec iov;
+  struct cmsghdr* cmsg;
+  char control[CMSG_SPACE(sizeof(int))];
+  char byte;
+  int conn;
+  FILE* in;
+
+  if (unix_address(path, &addr) == -1)
+    return NULL;
+  conn = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (conn == -1)
+    return NULL;
+  if (connect(conn, (struct sockaddr*)&addr, sizeof(addr)) == -1) {
+    close(conn);
+    return NULL;
+  }
+
+  iov.iov_base = &byte;
+  iov.iov_len = 1;
+  memset(&msg, 0, sizeof(msg));
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = control;
+  msg.msg_controllen = sizeof(control);
+  if (recvmsg(conn, &msg, 0) != 1) {
+    close(conn);
+    return NULL;
+  }
+
+  cmsg = CMSG_FIRSTHDR(&msg);
+  if (cmsg == NULL || cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS) {
+    close(conn);
+    return NULL;
+  }
+  memcpy(sock, CMSG_DATA(cmsg), sizeof(int));
+
+  in = fdopen(conn, "r");
+  if (in == NULL) {
+    close(*sock);
+    close(conn);
+  }
+  return in;
+}
@@ -0,0 +1,29 @@
+#ifndef HANDOVER_H
+#define HANDOVER_H
+
+#include <stdio.h>
+
+/* A running server hands its bound UDP socket and its state to a successor
+ * over a Unix stream socket. The socket goes across as SCM_RIGHTS ancillary
+ * data, so both processes share the one kernel socket: datagrams that arrive
+ * while neither is reading wait in its receive buffer, and none are lost.
+ * The state follows on the same stream in whatever form the server writes.
+ */
+
+/* Binds and listens on a Unix socket at path, replacing any socket file a
+ * predecessor left there. Returns the listening descriptor, or -1.
+ */
+int handover_listen(const char* path);
+
+/* Accepts the successor waiting on listener and passes it sock. Returns a
+ * stream to write the state to, to be closed with fclose, or NULL.
+ */
+FILE* handover_give(int listener, int sock);
+
+/* Connects to a running server at path and takes over its socket, which is
+ * stored in sock. Returns a stream to read the state from, or NULL if no
+ * server is listening at path.
+ */
+FILE* handover_take(const char* path, int* sock);
+
+#endif /* HANDOVER_H */
@@ -0,0 +1,946 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <time.h>
+#include <poll.h>
+#include <stdint.h>
+#include <netinet/in.h>
+#include <netinet/udp.h>
+#include <sys/epoll.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+#include "io_backend.h"
+
+#if defined(__linux__) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#define HAVE_IO_URING 1
+#endif
+#endif
+
+enum backend { BACKEND_SELECT, BACKEND_EPOLL, BACKEND_URING };
+
+static enum backend backend = BACKEND_SELECT;
+static long syscalls = 0;
+
+static int epoll_fd = -1;
+static fd_set epoll_registered;
+static fd_set epoll_unpollable; /* Regular files, which epoll refuses */
+
+static int epoll_setup( void )
+{
+    epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if( epoll_fd == -1 )
+        return -1;
+    FD_ZERO(&epoll_registered);
+    FD_ZERO(&epoll_unpollable);
+    return 0;
+}
+
+static int epoll_wait_read( int nfds, fd_set* readfds, const struct timeval* timeout )
+{
+    struct epoll_event events[64];
+    struct epoll_event event;
+    struct timespec wait;
+    fd_set ready;
+    int fd, n, i, always = 0;
+
+    /* Descriptors are added and removed only when the set asked for changes,
+     * which it rarely does, so a wait is usually a single call.
+     */
+    for( fd = 0; fd < nfds; fd++ )
+    {
+        if( FD_ISSET(fd, readfds) == FD_ISSET(fd, &epoll_registered) )
+            continue;
+        memset(&event, 0, sizeof(event));
+        event.events = EPOLLIN;
+        event.data.fd = fd;
+        syscalls += 1;
+        if( FD_ISSET(fd, readfds) )
+        {
+            if( epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &event) == -1 )
+            {
+                if( errno != EPERM )
+                    return -1;
+                FD_SET(fd, &epoll_unpollable);
+            }
+            FD_SET(fd, &epoll_registered);
+        }
+        else
+        {
+            if( !FD_ISSET(fd, &epoll_unpollable) )
+                epoll_ctl(epoll_fd, EPOLL_CTL_DEL, fd, NULL);
+            FD_CLR(fd, &epoll_registered);
+            FD_CLR(fd, &epoll_unpollable);
+        }
+    }
+
+    /* A regular file, such as stdin redirected from one, is always readable,
+     * as select would say, so the wait only collects what else is ready.
+     */
+    FD_ZERO(&ready);
+    for( fd = 0; fd < nfds; fd++ )
+    {
+        if( FD_ISSET(fd, readfds) && FD_ISSET(fd, &epoll_unpollable) )
+        {
+            FD_SET(fd, &ready);
+            always += 1;
+        }
+    }
+
+    if( always > 0 )
+    {
+        wait.tv_sec = 0;
+        wait.tv_nsec = 0;
+    }
+    else if( timeout != NULL )
+    {
+        wait.tv_sec = timeout->tv_sec;
+        wait.tv_nsec = timeout->tv_usec * 1000;
+    }
+    syscalls += 1;
+    n = epoll_pwait2(epoll_fd, events, 64, timeout != NULL || always > 0 ? &wait : NULL, NULL);
+    if( n == -1 )
+        return -1;
+
+    for( i = 0; i < n; i++ )
+        FD_SET(events[i].data.fd, &ready);
+    *readfds = ready;
+    return n + always;
+}
+
+static ssize_t plain_sendmsg( int sock, const struct iovec* iov, int iovcnt, int flags,
+                              const struct sockaddr* addr, socklen_t addrlen )
+{
+    struct msghdr msg;
+
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_name = (void*)addr;
+    msg.msg_namelen = addrlen;
+    msg.msg_iov = (struct iovec*)iov;
+    msg.msg_iovlen = iovcnt;
+    syscalls += 1;
+    return sendmsg(sock, &msg, flags);
+}
+
+#define OFFLOAD_BUFFER_SIZE 65536 /* The most UDP_GRO coalesces into one batch */
+#define OFFLOAD_MAX_SIZE 65507    /* The largest UDP payload over IPv4 */
+#define OFFLOAD_MAX_SEGMENTS 64   /* UDP_MAX_SEGMENTS, as older kernels have it */
+
+/* The one socket with segmentation offload, and what is left of the last
+ * batch read from it.
+ */
+static struct {
+    int sock;
+    int gso;
+    int gro;
+    size_t offset;
+    size_t size;
+    size_t segment;
+    struct sockaddr_storage addr;
+    socklen_t addrlen;
+    char buffer[OFFLOAD_BUFFER_SIZE];
+} offload = { .sock = -1 };
+
+/* The datagrams left of the batch read from sock. */
+static int offload_held( int sock )
+{
+    if( sock != offload.sock || offload.offset >= offload.size )
+        return 0;
+    return (offload.size - offload.offset + offload.segment - 1) / offload.segment;
+}
+
+static ssize_t offload_recvfrom( int sock, void* buffer, size_t size, int flags,
+                                 struct sockaddr* addr, socklen_t* addrlen )
+{
+    char control[CMSG_SPACE(sizeof(int))];
+    struct cmsghdr* cmsg;
+    struct msghdr msg;
+    struct iovec iov;
+    ssize_t rc;
+    size_t len;
+    int segment;
+
+    if( offload.offset >= offload.size )
+    {
+        iov.iov_base = offload.buffer;
+        iov.iov_len = sizeof(offload.buffer);
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_name = &offload.addr;
+        msg.msg_namelen = sizeof(offload.addr);
+        msg.msg_iov = &iov;
+        msg.msg_iovlen = 1;
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof(control);
+        syscalls += 1;
+        rc = recvmsg(sock, &msg, flags);
+        if( rc == -1 )
+            return -1;
+
+        /* A datagram that came on its own has no segment size. */
+        offload.segment = rc;
+        for( cmsg = CMSG_FIRSTHDR(&msg); cmsg != NULL; cmsg = CMSG_NXTHDR(&msg, cmsg) )
+        {
+            if( cmsg->cmsg_level == SOL_UDP && cmsg->cmsg_type == UDP_GRO )
+            {
+                memcpy(&segment, CMSG_DATA(cmsg), sizeof(segment));
+                if( segment > 0 && segment < rc )
+                    offload.segment = segment;
+            }
+        }
+        offload.addrlen = msg.msg_namelen;
+        offload.offset = 0;
+        offload.size = rc;
+    }
+
+    len = offload.size - offload.offset;
+    if( len > offload.segment )
+        len = offload.segment;
+    memcpy(buffer, offload.buffer + offload.offset, len < size ? len : size);
+    offload.offset += len;
+    if( addr != NULL && addrlen != NULL )
+    {
+        memcpy(addr, &offload.addr, offload.addrlen < *addrlen ? offload.addrlen : *addrlen);
+        *addrlen = offload.addrlen;
+    }
+    return len < size ? len : size;
+}
+
+#ifdef HAVE_IO_URING
+
+#define URING_ENTRIES 256
+#define URING_BUFFERS 256      /* Receive buffers, a power of two */
+#define URING_BUFFER_SIZE 2048 /* Header, source address and payload */
+#define URING_BUFFER_GROUP 0
+#define URING_SEND_SLOTS 128
+#define URING_SEND_SIZE 2048
+#define URING_SEND_BATCH 32    /* Queued sends that are submitted at once */
+#define URING_WATCHED 16
+
+enum uring_op { OP_RECV = 1, OP_POLL, OP_SEND, OP_CANCEL };
+
+struct send_slot {
+    struct msghdr msg;
+    struct iovec iov;
+    struct sockaddr_storage addr;
+    char buffer[URING_SEND_SIZE];
+    struct send_slot* next;
+};
+
+/* A descriptor waited on. Datagram sockets get a multishot receive and keep
+ * the buffers it filled in a queue; anything else gets a one-shot poll.
+ */
+struct watched {
+    int fd;
+    int datagram;
+    int armed;
+    int ready;                          /* A poll fired and was not reported */
+    struct msghdr recv_msg;             /* Tells the kernel the buffer layout */
+    unsigned short queue[URING_BUFFERS]; /* Buffer ids, oldest first */
+    unsigned queue_head;
+    unsigned queue_size;
+};
+
+struct uring {
+    int fd;
+    unsigned* sq_head;
+    unsigned* sq_tail;
+    unsigned sq_mask;
+    unsigned* sq_array;
+    struct io_uring_sqe* sqes;
+    unsigned* cq_head;
+    unsigned* cq_tail;
+    unsigned cq_mask;
+    struct io_uring_cqe* cqes;
+    unsigned sends_in_flight;
+    struct io_uring_buf_ring* buf_ring;
+    unsigned short buf_tail;
+    char* buffers;
+    struct send_slot* slots;
+    struct send_slot* free_slots;
+    struct watched watched[URING_WATCHED];
+    int watched_count;
+};
+
+static struct uring ring;
+
+static int uring_enter( unsigned to_submit, unsigned min_complete, unsigned flags,
+                        const struct timeval* timeout )
+{
+    struct io_uring_getevents_arg arg;
+    struct __kernel_timespec ts;
+
+    syscalls += 1;
+    if( timeout == NULL )
+        return syscall(__NR_io_uring_enter, ring.fd, to_submit, min_complete, flags, NULL, 0);
+
+    ts.tv_sec = timeout->tv_sec;
+    ts.tv_nsec = timeout->tv_usec * 1000;
+    memset(&arg, 0, sizeof(arg));
+    arg.ts = (unsigned long long)(uintptr_t)&ts;
+    return syscall(__NR_io_uring_enter, ring.fd, to_submit, min_complete,
+                   flags | IORING_ENTER_EXT_ARG, &arg, sizeof(arg));
+}
+
+/* Entries queued and not yet taken by the kernel, which moves the head. */
+static unsigned uring_unsubmitted( void )
+{
+    return *ring.sq_tail - __atomic_load_n(ring.sq_head, __ATOMIC_ACQUIRE);
+}
+
+static void uring_submit( void )
+{
+    while( uring_unsubmitted() > 0 )
+    {
+        if( uring_enter(uring_unsubmitted(), 0, 0, NULL) < 0 && errno != EINTR && errno != EBUSY )
+            return;
+    }
+}
+
+static struct io_uring_sqe* uring_get_sqe( void )
+{
+    unsigned tail = *ring.sq_tail;
+    struct io_uring_sqe* sqe;
+
+    if( uring_unsubmitted() > ring.sq_mask )
+    {
+        uring_submit();
+        if( uring_unsubmitted() > ring.sq_mask )
+            return NULL;
+    }
+
+    sqe = &ring.sqes[tail & ring.sq_mask];
+    memset(sqe, 0, sizeof(*sqe));
+    ring.sq_array[tail & ring.sq_mask] = tail & ring.sq_mask;
+    __atomic_store_n(ring.sq_tail, tail + 1, __ATOMIC_RELEASE);
+    return sqe;
+}
+
+static unsigned long long uring_tag( enum uring_op op, unsigned index )
+{
+    return (unsigned long long)op << 32 | index;
+}
+
+static void uring_recycle_buffer( unsigned short bid )
+{
+    struct io_uring_buf* buf = &ring.buf_ring->bufs[ring.buf_tail & (URING_BUFFERS - 1)];
+
+    buf->addr = (unsigned long long)(uintptr_t)(ring.buffers + bid * URING_BUFFER_SIZE);
+    buf->len = URING_BUFFER_SIZE;
+    buf->bid = bid;
+    ring.buf_tail += 1;
+    __atomic_store_n(&ring.buf_ring->tail, ring.buf_tail, __ATOMIC_RELEASE);
+}
+
+static struct watched* uring_watch( int fd )
+{
+    struct watched* w;
+    int type;
+    socklen_t len = sizeof(type);
+    int i;
+
+    for( i = 0; i < ring.watched_count; i++ )
+    {
+        if( ring.watched[i].fd == fd )
+            return &ring.watched[i];
+    }
+    if( ring.watched_count == URING_WATCHED )
+        return NULL;
+
+    w = &ring.watched[ring.watched_count++];
+    memset(w, 0, sizeof(*w));
+    w->fd = fd;
+    syscalls += 1;
+    w->datagram = getsockopt(fd, SOL_SOCKET, SO_TYPE, &type, &len) == 0 && type == SOCK_DGRAM;
+    w->recv_msg.msg_namelen = sizeof(struct sockaddr_storage);
+    return w;
+}
+
+static void uring_arm( struct watched* w )
+{
+    struct io_uring_sqe* sqe = uring_get_sqe();
+    unsigned index = w - ring.watched;
+
+    if( sqe == NULL )
+        return;
+    sqe->fd = w->fd;
+    if( w->datagram )
+    {
+        sqe->opcode = IORING_OP_RECVMSG;
+        sqe->addr = (unsigned long long)(uintptr_t)&w->recv_msg;
+        sqe->len = 1;
+        sqe->ioprio = IORING_RECV_MULTISHOT;
+        sqe->flags = IOSQE_BUFFER_SELECT;
+        sqe->buf_group = URING_BUFFER_GROUP;
+        sqe->user_data = uring_tag(OP_RECV, index);
+    }
+    else
+    {
+        sqe->opcode = IORING_OP_POLL_ADD;
+        sqe->poll32_events = POLLIN;
+        sqe->user_data = uring_tag(OP_POLL, index);
+    }
+    w->armed = 1;
+}
+
+static void uring_complete( struct io_uring_cqe* cqe )
+{
+    enum uring_op op = cqe->user_data >> 32;
+    unsigned index = cqe->user_data & 0xffffffff;
+    struct watched* w = op == OP_RECV || op == OP_POLL ? &ring.watched[index] : NULL;
+    struct send_slot* slot;
+
+    if( op == OP_SEND )
+    {
+        slot = &ring.slots[index];
+        slot->next = ring.free_slots;
+        ring.free_slots = slot;
+        ring.sends_in_flight -= 1;
+    }
+    else if( op == OP_POLL )
+    {
+        w->armed = 0;
+        w->ready = 1;
+    }
+    else if( op == OP_RECV )
+    {
+        if( cqe->flags & IORING_CQE_F_BUFFER )
+        {
+            w->queue[(w->queue_head + w->queue_size) % URING_BUFFERS] =
+                cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+            w->queue_size += 1;
+        }
+        /* Out of buffers or cancelled: armed again by the next wait once
+         * buffers are back.
+         */
+        if( !(cqe->flags & IORING_CQE_F_MORE) )
+            w->armed = 0;
+    }
+}
+
+static int uring_reap( void )
+{
+    unsigned head = *ring.cq_head;
+    unsigned tail = __atomic_load_n(ring.cq_tail, __ATOMIC_ACQUIRE);
+    int count = 0;
+
+    while( head != tail )
+    {
+        uring_complete(&ring.cqes[head & ring.cq_mask]);
+        head += 1;
+        count += 1;
+    }
+    __atomic_store_n(ring.cq_head, head, __ATOMIC_RELEASE);
+    return count;
+}
+
+static int uring_setup( void )
+{
+    struct io_uring_params params;
+    struct io_uring_buf_reg reg;
+    size_t sq_size, cq_size, sqes_size;
+    char* sq;
+    char* cq;
+    int i;
+
+    memset(&params, 0, sizeof(params));
+    ring.fd = syscall(__NR_io_uring_setup, URING_ENTRIES, &params);
+    if( ring.fd == -1 )
+        return -1;
+    if( !(params.features & IORING_FEAT_SINGLE_MMAP) || !(params.features & IORING_FEAT_EXT_ARG) )
+    {
+        close(ring.fd);
+        return -1;
+    }
+
+    sq_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    cq_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    if( cq_size > sq_size )
+        sq_size = cq_size;
+    sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+
+    sq = mmap(NULL, sq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring.fd, IORING_OFF_SQ_RING);
+    ring.sqes = mmap(NULL, sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring.fd, IORING_OFF_SQES);
+    if( sq == MAP_FAILED || ring.sqes == MAP_FAILED )
+    {
+        close(ring.fd);
+        return -1;
+    }
+    cq = sq;
+
+    ring.sq_head = (unsigned*)(sq + params.sq_off.head);
+    ring.sq_tail = (unsigned*)(sq + params.sq_off.tail);
+    ring.sq_mask = *(unsigned*)(sq + params.sq_off.ring_mask);
+    ring.sq_array = (unsigned*)(sq + params.sq_off.array);
+    ring.cq_head = (unsigned*)(cq + params.cq_off.head);
+    ring.cq_tail = (unsigned*)(cq + params.cq_off.tail);
+    ring.cq_mask = *(unsigned*)(cq + params.cq_off.ring_mask);
+    ring.cqes = (struct io_uring_cqe*)(cq + params.cq_off.cqes);
+
+    /* The receive buffers are registered once as a provided buffer ring:
+     * the kernel picks one per datagram, and it is handed back after read.
+     */
+    ring.buf_ring = mmap(NULL, URING_BUFFERS * sizeof(struct io_uring_buf), PROT_READ | PROT_WRITE,
+                         MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    ring.buffers = malloc(URING_BUFFERS * URING_BUFFER_SIZE);
+    if( ring.buf_ring == MAP_FAILED || ring.buffers == NULL )
+    {
+        close(ring.fd);
+        return -1;
+    }
+    memset(&reg, 0, sizeof(reg));
+    reg.ring_addr = (unsigned long long)(uintptr_t)ring.buf_ring;
+    reg.ring_entries = URING_BUFFERS;
+    reg.bgid = URING_BUFFER_GROUP;
+    if( syscall(__NR_io_uring_register, ring.fd, IORING_REGISTER_PBUF_RING, &reg, 1) == -1 )
+    {
+        close(ring.fd);
+        return -1;
+    }
+    for( i = 0; i < URING_BUFFERS; i++ )
+        uring_recycle_buffer(i);
+
+    ring.slots = calloc(URING_SEND_SLOTS, sizeof(struct send_slot));
+    for( i = 0; i < URING_SEND_SLOTS; i++ )
+    {
+        ring.slots[i].next = ring.free_slots;
+        ring.free_slots = &ring.slots[i];
+    }
+    return 0;
+}
+
+static ssize_t uring_sendmsg( int sock, const struct iovec* iov, int iovcnt, int flags,
+                              const struct sockaddr* addr, socklen_t addrlen )
+{
+    struct send_slot* slot;
+    struct io_uring_sqe* sqe;
+    size_t size = 0;
+    int i;
+
+    for( i = 0; i < iovcnt; i++ )
+        size += iov[i].iov_len;
+    if( size > URING_SEND_SIZE || addrlen > sizeof(struct sockaddr_storage) )
+        return plain_sendmsg(sock, iov, iovcnt, flags, addr, addrlen);
+
+    while( ring.free_slots == NULL )
+    {
+        uring_enter(uring_unsubmitted(), 1, IORING_ENTER_GETEVENTS, NULL);
+        uring_reap();
+    }
+    slot = ring.free_slots;
+
+    sqe = uring_get_sqe();
+    if( sqe == NULL )
+        return plain_sendmsg(sock, iov, iovcnt, flags, addr, addrlen);
+    ring.free_slots = slot->next;
+
+    /* The pieces may change as soon as this returns, so the slot gets its
+     * own copy for the kernel to send from.
+     */
+    size = 0;
+    for( i = 0; i < iovcnt; i++ )
+    {
+        memcpy(slot->buffer + size, iov[i].iov_base, iov[i].iov_len);
+        size += iov[i].iov_len;
+    }
+    memcpy(&slot->addr, addr, addrlen);
+    slot->iov.iov_base = slot->buffer;
+    slot->iov.iov_len = size;
+    memset(&slot->msg, 0, sizeof(slot->msg));
+    slot->msg.msg_name = &slot->addr;
+    slot->msg.msg_namelen = addrlen;
+    slot->msg.msg_iov = &slot->iov;
+    slot->msg.msg_iovlen = 1;
+
+    sqe->opcode = IORING_OP_SENDMSG;
+    sqe->fd = sock;
+    sqe->addr = (unsigned long long)(uintptr_t)&slot->msg;
+    sqe->len = 1;
+    sqe->msg_flags = flags;
+    sqe->user_data = uring_tag(OP_SEND, slot - ring.slots);
+    ring.sends_in_flight += 1;
+
+    if( uring_unsubmitted() >= URING_SEND_BATCH )
+        uring_submit();
+    return size;
+}
+
+static ssize_t uring_recvfrom( int sock, void* buffer, size_t size, int flags,
+                               struct sockaddr* addr, socklen_t* addrlen )
+{
+    struct watched* w = NULL;
+    struct io_uring_recvmsg_out* out;
+    unsigned short bid;
+    char* data;
+    size_t len;
+    int i;
+
+    for( i = 0; i < ring.watched_count; i++ )
+    {
+        if( ring.watched[i].fd == sock && ring.watched[i].datagram )
+            w = &ring.watched[i];
+    }
+    if( w == NULL || (!w->armed && w->queue_size == 0) )
+    {
+        syscalls += 1;
+        return recvfrom(sock, buffer, size, flags, addr, addrlen);
+    }
+
+    while( w->queue_size == 0 )
+    {
+        if( flags & MSG_DONTWAIT || !w->armed )
+        {
+            errno = EAGAIN;
+            return -1;
+        }
+        if( uring_enter(uring_unsubmitted(), 1, IORING_ENTER_GETEVENTS, NULL) < 0 && errno == EINTR )
+            return -1;
+        uring_reap();
+    }
+
+    bid = w->queue[w->queue_head];
+    w->queue_head = (w->queue_head + 1) % URING_BUFFERS;
+    w->queue_size -= 1;
+
+    data = ring.buffers + bid * URING_BUFFER_SIZE;
+    out = (struct io_uring_recvmsg_out*)data;
+    len = out->payloadlen < size ? out->payloadlen : size;
+    memcpy(buffer, data + sizeof(*out) + w->recv_msg.msg_namelen + w->recv_msg.msg_controllen, len);
+    if( addr != NULL && addrlen != NULL )
+    {
+        memcpy(addr, data + sizeof(*out), out->namelen < *addrlen ? out->namelen : *addrlen);
+        *addrlen = out->namelen;
+    }
+    uring_recycle_buffer(bid);
+    return len;
+}
+
+static int uring_wait( int nfds, fd_set* readfds, const struct timeval* timeout )
+{
+    struct watched* w;
+    struct timeval left;
+    struct timespec now;
+    long long deadline = -1, now_usec;
+    fd_set ready;
+    int fd, count, rc;
+
+    if( timeout != NULL )
+    {
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        deadline = now.tv_sec * 1000000LL + now.tv_nsec / 1000 + timeout->tv_sec * 1000000LL + timeout->tv_usec;
+    }
+
+    for( ;; )
+    {
+        FD_ZERO(&ready);
+        count = 0;
+        for( fd = 0; fd < nfds; fd++ )
+        {
+            if( !FD_ISSET(fd, readfds) || (w = uring_watch(fd)) == NULL )
+                continue;
+            if( !w->armed && !w->ready && (!w->datagram || w->queue_size < URING_BUFFERS) )
+                uring_arm(w);
+            if( w->datagram ? w->queue_size > 0 : w->ready )
+            {
+                FD_SET(fd, &ready);
+                w->ready = 0;
+                count += 1;
+            }
+        }
+        if( count > 0 )
+        {
+            if( uring_unsubmitted() >= URING_SEND_BATCH )
+                uring_submit();
+            *readfds = ready;
+            return count;
+        }
+
+        if( deadline >= 0 )
+        {
+            clock_gettime(CLOCK_MONOTONIC, &now);
+            now_usec = now.tv_sec * 1000000LL + now.tv_nsec / 1000;
+            if( now_usec >= deadline )
+            {
+                uring_submit();
+                FD_ZERO(readfds);
+                return 0;
+            }
+            left.tv_sec = (deadline - now_usec) / 1000000;
+            left.tv_usec = (deadline - now_usec) % 1000000;
+        }
+
+        /* Queued sends go out with the wait, in the same call. */
+        rc = uring_enter(uring_unsubmitted(), 1, IORING_ENTER_GETEVENTS, deadline >= 0 ? &left : NULL);
+        if( rc < 0 && errno != ETIME && errno != EBUSY )
+            return -1;
+        uring_reap();
+    }
+}
+
+static void uring_flush( void )
+{
+    uring_submit();
+    while( ring.sends_in_flight > 0 )
+    {
+        if( uring_enter(0, 1, IORING_ENTER_GETEVENTS, NULL) < 0 && errno != EINTR )
+            return;
+        uring_reap();
+    }
+}
+
+static void uring_release( int sock )
+{
+    struct io_uring_sqe* sqe;
+    int i;
+
+    for( i = 0; i < ring.watched_count; i++ )
+    {
+        struct watched* w = &ring.watched[i];
+        if( w->fd != sock || !w->datagram )
+            continue;
+        if( !w->armed )
+            return;
+        sqe = uring_get_sqe();
+        if( sqe == NULL )
+            return;
+        sqe->opcode = IORING_OP_ASYNC_CANCEL;
+        sqe->addr = uring_tag(OP_RECV, i);
+        sqe->user_data = uring_tag(OP_CANCEL, i);
+        while( w->armed )
+        {
+            if( uring_enter(uring_unsubmitted(), 1, IORING_ENTER_GETEVENTS, NULL) < 0 && errno != EINTR )
+                return;
+            uring_reap();
+        }
+        return;
+    }
+}
+
+/* Runs at exit. A receive still armed keeps its socket open, and bound,
+ * until the kernel gets round to tearing down the ring, so a server
+ * restarted straight away would find its port taken.
+ */
+static void uring_shutdown( void )
+{
+    int i;
+
+    for( i = 0; i < ring.watched_count; i++ )
+    {
+        if( ring.watched[i].datagram )
+            uring_release(ring.watched[i].fd);
+    }
+}
+
+static int uring_pending( int sock )
+{
+    int i;
+
+    for( i = 0; i < ring.watched_count; i++ )
+    {
+        if( ring.watched[i].fd == sock && ring.watched[i].datagram )
+            return ring.watched[i].queue_size;
+    }
+    return 0;
+}
+
+#endif /* HAVE_IO_URING */
+
+int io_set_backend( const char* name )
+{
+    if( !strcmp(name, "select") )
+    {
+        backend = BACKEND_SELECT;
+        return 0;
+    }
+    if( !strcmp(name, "epoll") )
+    {
+        if( epoll_fd == -1 && epoll_setup() == -1 )
+            return -1;
+        backend = BACKEND_EPOLL;
+        return 0;
+    }
+#ifdef HAVE_IO_URING
+    if( !strcmp(name, "uring") )
+    {
+        if( ring.buffers == NULL )
+        {
+            if( uring_setup() == -1 )
+                return -1;
+            atexit(uring_shutdown);
+        }
+        backend = BACKEND_URING;
+        return 0;
+    }
+#endif
+    return -1;
+}
+
+const char* io_backend_name( void )
+{
+    return backend == BACKEND_URING ? "uring" : backend == BACKEND_EPOLL ? "epoll" : "select";
+}
+
+ssize_t io_sendmsg( int sock, const struct iovec* iov, int iovcnt, int flags,
+                    const struct sockaddr* addr, socklen_t addrlen )
+{
+#ifdef HAVE_IO_URING
+    if( backend == BACKEND_URING )
+        return uring_sendmsg(sock, iov, iovcnt, flags, addr, addrlen);
+#endif
+    return plain_sendmsg(sock, iov, iovcnt, flags, addr, addrlen);
+}
+
+ssize_t io_recvfrom( int sock, void* buffer, size_t size, int flags,
+                     struct sockaddr* addr, socklen_t* addrlen )
+{
+#ifdef HAVE_IO_URING
+    if( backend == BACKEND_URING )
+        return uring_recvfrom(sock, buffer, size, flags, addr, addrlen);
+#endif
+    if( sock == offload.sock && offload.gro )
+        return offload_recvfrom(sock, buffer, size, flags, addr, addrlen);
+    syscalls += 1;
+    return recvfrom(sock, buffer, size, flags, addr, addrlen);
+}
+
+int io_set_segmentation( int sock )
+{
+    int on = 1, off = 0;
+
+    if( backend == BACKEND_URING || offload.sock != -1 )
+        return -1;
+
+    /* A segment size of 0 leaves plain sends alone, and is refused by
+     * kernels without UDP_SEGMENT.
+     */
+    syscalls += 2;
+    offload.gro = setsockopt(sock, SOL_UDP, UDP_GRO, &on, sizeof(on)) == 0;
+    offload.gso = setsockopt(sock, SOL_UDP, UDP_SEGMENT, &off, sizeof(off)) == 0;
+    if( !offload.gro && !offload.gso )
+        return -1;
+    offload.sock = sock;
+    return 0;
+}
+
+ssize_t io_sendsegments( int sock, const void* buffer, size_t size, size_t segment, int flags,
+                         const struct sockaddr* addr, socklen_t addrlen )
+{
+    char control[CMSG_SPACE(sizeof(uint16_t))];
+    uint16_t gso_size = segment;
+    struct cmsghdr* cmsg;
+    struct msghdr msg;
+    struct iovec iov;
+    size_t offset;
+    ssize_t rc;
+
+    if( segment == 0 || segment > size )
+        segment = size;
+
+    if( sock == offload.sock && offload.gso && size > segment && size <= OFFLOAD_MAX_SIZE &&
+        (size + segment - 1) / segment <= OFFLOAD_MAX_SEGMENTS )
+    {
+        iov.iov_base = (void*)buffer;
+        iov.iov_len = size;
+        memset(&msg, 0, sizeof(msg));
+        memset(control, 0, sizeof(control));
+        msg.msg_name = (void*)addr;
+        msg.msg_namelen = addrlen;
+        msg.msg_iov = &iov;
+        msg.msg_iovlen = 1;
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof(control);
+        cmsg = CMSG_FIRSTHDR(&msg);
+        cmsg->cmsg_level = SOL_UDP;
+        cmsg->cmsg_type = UDP_SEGMENT;
+        cmsg->cmsg_len = CMSG_LEN(sizeof(gso_size));
+        memcpy(CMSG_DATA(cmsg), &gso_size, sizeof(gso_size));
+        syscalls += 1;
+        rc = sendmsg(sock, &msg, flags);
+        if( rc != -1 || errno != EIO )
+            return rc;
+        /* The route's device cannot checksum the segments, so the burst goes
+         * out a datagram at a time, as will every one after it.
+         */
+        offload.gso = 0;
+    }
+
+    for( offset = 0; offset < size; offset += segment )
+    {
+        iov.iov_base = (char*)buffer + offset;
+        iov.iov_len = size - offset < segment ? size - offset : segment;
+        if( io_sendmsg(sock, &iov, 1, flags, addr, addrlen) == -1 )
+            return -1;
+    }
+    return size;
+}
+
+static int backend_wait( int nfds, fd_set* readfds, const struct timeval* timeout )
+{
+    struct timeval copy;
+
+#ifdef HAVE_IO_URING
+    if( backend == BACKEND_URING )
+        return uring_wait(nfds, readfds, timeout);
+#endif
+    if( backend == BACKEND_EPOLL )
+        return epoll_wait_read(nfds, readfds, timeout);
+
+    syscalls += 1;
+    if( timeout == NULL )
+        return select(nfds, readfds, NULL, NULL, NULL);
+    copy = *timeout;
+    return select(nfds, readfds, NULL, NULL, &copy);
+}
+
+int io_wait( int nfds, fd_set* readfds, const struct timeval* timeout )
+{
+    static const struct timeval now = { 0, 0 };
+    int held, rc;
+
+    /* What is left of a batch is readable already, so the wait only
+     * collects what else is.
+     */
+    held = offload_held(offload.sock) > 0 && offload.sock < nfds && FD_ISSET(offload.sock, readfds);
+    rc = backend_wait(nfds, readfds, held ? &now : timeout);
+    if( held && rc != -1 && !FD_ISSET(offload.sock, readfds) )
+    {
+        FD_SET(offload.sock, readfds);
+        rc += 1;
+    }
+    return rc;
+}
+
+void io_flush( void )
+{
+#ifdef HAVE_IO_URING
+    if( backend == BACKEND_URING )
+        uring_flush();
+#endif
+}
+
+void io_release( int sock )
+{
+#ifdef HAVE_IO_URING
+    if( backend == BACKEND_URING )
+        uring_release(sock);
+#else
+    (void)sock;
+#endif
+}
+
+int io_pending( int sock )
+{
+#ifdef HAVE_IO_URING
+    if( backend == BACKEND_URING )
+        return uring_pending(sock);
+#endif
+    return offload_held(sock);
+}
+
+long io_syscalls( void )
+{
+    return syscalls;
+}
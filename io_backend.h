@@ -0,0 +1,84 @@
+#ifndef IO_BACKEND_H
+#define IO_BACKEND_H
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/select.h>
+#include <sys/time.h>
+#include <sys/uio.h>
+
+/* The system calls behind send_packet and select_packet. Three backends do
+ * the same job:
+ *
+ *   select  select, recvfrom and sendmsg, one call each (the default)
+ *   epoll   epoll_pwait2 in place of select, so the cost of waiting does not
+ *           grow with the highest descriptor
+ *   uring   io_uring: every datagram socket waited on gets a multishot
+ *           recvmsg into a ring of buffers registered with the kernel, and
+ *           sends are queued and submitted together with the next wait, so
+ *           one io_uring_enter serves a whole burst of requests and replies
+ *
+ * Other descriptors, like stdin, are polled by whichever backend is in use.
+ * Once the uring backend has armed a socket it owns the socket's receive
+ * side: read it only through io_recvfrom.
+ */
+
+/* Switches to the backend called name. Returns -1, leaving the backend as
+ * it was, if name is unknown or the kernel does not support it.
+ */
+int io_set_backend( const char* name );
+
+/* The name of the backend in use. */
+const char* io_backend_name( void );
+
+/* Sends the datagram gathered from iovcnt buffers, like sendmsg. The uring
+ * backend copies it into a send slot, queues it and reports it sent, as a
+ * later failure has no caller left to report to, like a datagram lost on
+ * the wire.
+ */
+ssize_t io_sendmsg( int sock, const struct iovec* iov, int iovcnt, int flags,
+                    const struct sockaddr* addr, socklen_t addrlen );
+
+/* Receives like recvfrom, blocking unless flags has MSG_DONTWAIT. */
+ssize_t io_recvfrom( int sock, void* buffer, size_t size, int flags,
+                     struct sockaddr* addr, socklen_t* addrlen );
+
+/* Turns on UDP segmentation offload for one datagram socket: io_sendsegments
+ * hands the kernel a whole burst in one sendmsg (UDP_SEGMENT), and batches
+ * the kernel coalesced on receive (UDP_GRO) are read into a buffer of their
+ * own and handed out by io_recvfrom a datagram at a time. Returns -1, with
+ * sock left as it was, where the kernel supports neither, or when the
+ * backend is uring, whose receive buffers hold a single datagram.
+ */
+int io_set_segmentation( int sock );
+
+/* Sends size bytes as datagrams of segment bytes each, the last of which
+ * may be shorter, all to addr: one sendmsg where io_set_segmentation turned
+ * offload on for sock, one io_sendmsg per datagram otherwise. Returns size,
+ * or -1 if a send failed.
+ */
+ssize_t io_sendsegments( int sock, const void* buffer, size_t size, size_t segment, int flags,
+                         const struct sockaddr* addr, socklen_t addrlen );
+
+/* Waits like select on a read set, but timeout is left untouched. */
+int io_wait( int nfds, fd_set* readfds, const struct timeval* timeout );
+
+/* Submits queued sends and waits until the kernel has taken them all. */
+void io_flush( void );
+
+/* Stops receiving on sock ahead of handing it to another process. Datagrams
+ * the backend already took off the socket stay readable with io_recvfrom,
+ * and io_pending counts them. Nothing more is taken until the next io_wait
+ * on sock, which resumes receiving.
+ */
+void io_release( int sock );
+
+/* Returns the number of datagrams received on sock and not yet read,
+ * including those left of a coalesced batch.
+ */
+int io_pending( int sock );
+
+/* Returns the system calls made so far to send, receive and wait. */
+long io_syscalls( void );
+
+#endif /* IO_BACKEND_H */
@@ -0,0 +1,209 @@
+#define _GNU_SOURCE
+
+#include <ctype.h>
+#include <limits.h>
+#include <string.h>
+
+#include "parse_packet.h"
+
+/* The delimiter search is a memchr, which glibc vectorises, and the message
+ * body after MSG is never scanned at all.
+ */
+int slice_next_token(struct slice* rest, struct slice* token) {
+  const char* space;
+
+  if (rest->len == 0)
+    return 0;
+
+  space = memchr(rest->ptr, ' ', rest->len);
+  token->ptr = rest->ptr;
+  if (space == NULL) {
+    token->len = rest->len;
+    rest->ptr += rest->len;
+    rest->len = 0;
+  } else {
+    token->len = space - rest->ptr;
+    rest->ptr = space + 1;
+    rest->len -= token->len + 1;
+  }
+  return token->len > 0;
+}
+
+static int expect_token(struct slice* rest, const char* word) {
+  struct slice token;
+  return slice_next_token(rest, &token) && slice_equals(token, word);
+}
+
+int slice_to_number(struct slice token, long long* number) {
+  if (token.len == 0 || token.len > 18)
+    return 0;
+
+  *number = 0;
+  for (size_t i = 0; i < token.len; i++) {
+    if (!isdigit((unsigned char)token.ptr[i]))
+      return 0;
+    *number = *number * 10 + (token.ptr[i] - '0');
+  }
+  return 1;
+}
+
+/* An echoed timestamp sits at the end of an ACK: "ACK 0 OK TS 1620000000000000".
+ * Only the last token and the three bytes before it are looked at, so a long
+ * lookup reply is not scanned for it.
+ */
+static void split_ack_timestamp(struct packet* pkt) {
+  const char* space = memrchr(pkt->text.ptr, ' ', pkt->text.len);
+  struct slice token;
+  long long ts;
+
+  if (space == NULL || space - pkt->text.ptr < 4 || memcmp(space - 3, " TS", 3))
+    return;
+
+  token.ptr = space + 1;
+  token.len = pkt->text.ptr + pkt->text.len - token.ptr;
+  if (slice_to_number(token, &ts)) {
+    pkt->ts = ts;
+    pkt->text.len = space - 3 - pkt->text.ptr;
+  }
+}
+
+enum packet_type parse_packet(const char* buf, size_t len, struct packet* pkt) {
+  struct slice rest, token;
+  const char* end;
+  int is_ack, is_relay;
+
+  memset(pkt, 0, sizeof(struct packet));
+  pkt->type = PACKET_INVALID;
+
+  end = memchr(buf, '\0', len); // Registrations and lookups are NUL-padded.
+  if (end != NULL)
+    len = end - buf;
+  rest.ptr = buf;
+  rest.len = len;
+
+  if (!slice_next_token(&rest, &token))
+    return PACKET_INVALID;
+  if (slice_equals(token, "ACK"))
+    is_ack = 1;
+  else if (slice_equals(token, "PKT"))
+    is_ack = 0;
+  else
+    return PACKET_INVALID;
+
+  if (!slice_next_token(&rest, &token) || token.len != 1 || !isdigit((unsigned char)token.ptr[0]))
+    return PACKET_INVALID;
+  pkt->seq = token.ptr[0];
+
+  if (is_ack) {
+    if (rest.len == 0)
+      return PACKET_INVALID;
+    pkt->text = rest;
+    split_ack_timestamp(pkt);
+    pkt->type = PACKET_ACK;
+    return pkt->type;
+  }
+
+  if (!slice_next_token(&rest, &token))
+    return PACKET_INVALID;
+  is_relay = slice_equals(token, "RELAY");
+  if (is_relay && (!slice_next_token(&rest, &token) || !slice_equals(token, "FROM")))
+    return PACKET_INVALID;
+
+  if (slice_equals(token, "REG") || slice_equals(token, "HB")) {
+    if (!slice_next_token(&rest, &pkt->nick) || rest.len != 0)
+      return PACKET_INVALID;
+    pkt->type = token.ptr[0] == 'R' ? PACKET_REG : PACKET_HB;
+  } else if (slice_equals(token, "LOOKUP") || slice_equals(token, "SUB") ||
+             slice_equals(token, "UNSUB")) {
+    pkt->text = rest;
+    if (!slice_next_token(&rest, &pkt->nick))
+      return PACKET_INVALID;
+    pkt->type = token.ptr[0] == 'L' ? PACKET_LOOKUP : token.ptr[0] == 'S' ? PACKET_SUB : PACKET_UNSUB;
+  } else if (slice_equals(token, "PING")) {
+    if (rest.len != 0)
+      return PACKET_INVALID;
+    pkt->type = PACKET_PING;
+  } else if (slice_equals(token, "NOTIFY") || slice_equals(token, "INTRO")) {
+    if (rest.len == 0)
+      return PACKET_INVALID;
+    pkt->text = rest;
+    pkt->type = token.ptr[0] == 'N' ? PACKET_NOTIFY : PACKET_INTRO;
+  } else if (slice_equals(token, "FROM")) {
+    if (!slice_next_token(&rest, &pkt->from) || !expect_token(&rest, "TO") ||
+        !slice_next_token(&rest, &pkt->to) || !slice_next_token(&rest, &token))
+      return PACKET_INVALID;
+    if (slice_equals(token, "TS") &&
+        (!slice_next_token(&rest, &token) || !slice_to_number(token, &pkt->ts) ||
+         !slice_next_token(&rest, &token)))
+      return PACKET_INVALID;
+    if (!slice_equals(token, "MSG") || rest.len == 0)
+      return PACKET_INVALID;
+    pkt->msg = rest;
+    pkt->type = is_relay ? PACKET_RELAY : PACKET_MSG;
+  }
+
+  return pkt->type;
+}
+
+int parse_lookup_reply(struct slice text, struct slice* nick, struct slice* ip,
+                       struct slice* port) {
+  return expect_token(&text, "NICK") && slice_next_token(&text, nick) &&
+         expect_token(&text, "IP") && slice_next_token(&text, ip) &&
+         expect_token(&text, "PORT") && slice_next_token(&text, port);
+}
+
+int parse_gone_notice(struct slice text, struct slice* nick) {
+  return expect_token(&text, "NICK") && slice_next_token(&text, nick) &&
+         slice_equals(text, "GONE");
+}
+
+int parse_lease_reply(struct slice text, long long* lease, long long* refresh) {
+  struct slice token;
+
+  return expect_token(&text, "OK") && expect_token(&text, "LEASE") &&
+         slice_next_token(&text, &token) && slice_to_number(token, lease) &&
+         expect_token(&text, "REFRESH") && slice_next_token(&text, &token) &&
+         slice_to_number(token, refresh) && text.len == 0;
+}
+
+int parse_batch_reply(struct slice text, int* part, int* parts, struct slice* entries) {
+  struct slice token;
+  long long number, total;
+
+  if (!expect_token(&text, "BATCH") || !slice_next_token(&text, &token) ||
+      !slice_to_number(token, &number) || !slice_next_token(&text, &token) ||
+      !slice_to_number(token, &total) || number < 1 || number > total || total > INT_MAX)
+    return 0;
+
+  *part = number;
+  *parts = total;
+  *entries = text;
+  return 1;
+}
+
+int next_batch_entry(struct slice* entries, struct slice* nick, struct slice* ip,
+                     struct slice* port) {
+  return slice_next_token(entries, nick) && slice_next_token(entries, ip) &&
+         slice_next_token(entries, port);
+}
+
+struct slice slice_from_string(const char* str) {
+  struct slice s = { str, strlen(str) };
+  return s;
+}
+
+int slice_equals(struct slice s, const char* str) {
+  return s.len == strlen(str) && !memcmp(s.ptr, str, s.len);
+}
+
+int slices_equal(struct slice a, struct slice b) {
+  return a.len == b.len && !memcmp(a.ptr, b.ptr, a.len);
+}
+
+int slice_copy(char* dest, size_t size, struct slice s) {
+  if (s.len >= size)
+    return -1;
+  memcpy(dest, s.ptr, s.len);
+  dest[s.len] = '\0';
+  return 0;
+}
@@ -0,0 +1,100 @@
+#ifndef PARSE_PACKET_H
+#define PARSE_PACKET_H
+
+#include <stddef.h>
+
+/* A slice points into the buffer that was parsed. It is not NUL-terminated
+ * and is only valid for as long as that buffer is left untouched.
+ */
+struct slice {
+  const char* ptr;
+  size_t len;
+};
+
+enum packet_type {
+  PACKET_INVALID,
+  PACKET_REG,     /* PKT <seq> REG <nick> */
+  PACKET_LOOKUP,  /* PKT <seq> LOOKUP <nick> [<nick> ...] */
+  PACKET_MSG,     /* PKT <seq> FROM <nick> TO <nick> [TS <usec>] MSG <text> */
+  PACKET_ACK,     /* ACK <seq> <text> [TS <usec>] */
+  PACKET_SUB,     /* PKT <seq> SUB <nick> [<nick> ...] */
+  PACKET_UNSUB,   /* PKT <seq> UNSUB <nick> [<nick> ...] */
+  PACKET_NOTIFY,  /* PKT <seq> NOTIFY <text> */
+  PACKET_INTRO,   /* PKT <seq> INTRO NICK <nick> IP <ip> PORT <port> */
+  PACKET_RELAY,   /* PKT <seq> RELAY FROM <nick> TO <nick> [TS <usec>] MSG <text> */
+  PACKET_HB,      /* PKT <seq> HB <nick> */
+  PACKET_PING     /* PKT <seq> PING, a liveness probe answered with ACK <seq> PONG */
+};
+
+struct packet {
+  enum packet_type type;
+  char seq;
+  struct slice nick;  /* REG, HB, and the first nick of a LOOKUP, SUB or UNSUB */
+  struct slice from;
+  struct slice to;
+  struct slice msg;
+  struct slice text;  /* ACK, NOTIFY or INTRO text, or every nick of a nick list */
+  long long ts;
+};
+
+/* Validates the packet in buf in a single pass and fills in pkt with slices
+ * into buf. Trailing NUL padding is ignored. Nothing is copied. Returns the
+ * packet type, which is PACKET_INVALID if the packet is malformed. The
+ * optional send timestamp ends up in pkt->ts, which is 0 when absent.
+ */
+enum packet_type parse_packet(const char* buf, size_t len, struct packet* pkt);
+
+/* Splits the text of a lookup reply, "NICK <nick> IP <ip> PORT <port>", into
+ * its three values. Returns 1 on success and 0 if the text has another form.
+ */
+int parse_lookup_reply(struct slice text, struct slice* nick, struct slice* ip,
+                       struct slice* port);
+
+/* Takes the nick out of the text of a presence notice, "NICK <nick> GONE".
+ * A notice of a new address has the form of a lookup reply instead. Returns 1
+ * on success and 0 if the text has another form.
+ */
+int parse_gone_notice(struct slice text, struct slice* nick);
+
+/* Reads the lease a server grants with a registration, "OK LEASE <seconds>
+ * REFRESH <seconds>". Returns 1 on success and 0 if the text has another
+ * form, such as the plain "OK" of a server that does not grant leases.
+ */
+int parse_lease_reply(struct slice text, long long* lease, long long* refresh);
+
+/* Splits the text of a batch lookup reply, "BATCH <part> <parts> <entries>".
+ * Returns 1 on success and 0 if the text has another form or the part is not
+ * within 1..parts; part, parts and entries are only written on success.
+ */
+int parse_batch_reply(struct slice text, int* part, int* parts, struct slice* entries);
+
+/* Takes the next "<nick> <ip> <port>" entry off the entries of a batch lookup
+ * reply. ip and port are "-" for a nick that is not registered. Returns 0
+ * when no complete entry is left.
+ */
+int next_batch_entry(struct slice* entries, struct slice* nick, struct slice* ip,
+                     struct slice* port);
+
+/* Cuts the next space-delimited token off the front of rest. Returns 0 if the
+ * token is missing or empty.
+ */
+int slice_next_token(struct slice* rest, struct slice* token);
+
+/* Converts a slice of up to 18 decimal digits. Returns 0 if it is not one. */
+int slice_to_number(struct slice s, long long* number);
+
+/* Returns a slice of the whole NUL-terminated string str. */
+struct slice slice_from_string(const char* str);
+
+/* Returns 1 if the slice holds exactly the NUL-terminated string str. */
+int slice_equals(struct slice s, const char* str);
+
+/* Returns 1 if the two slices hold the same bytes. */
+int slices_equal(struct slice a, struct slice b);
+
+/* Copies the slice into dest as a NUL-terminated string. Returns -1 without
+ * copying if it does not fit in size bytes.
+ */
+int slice_copy(char* dest, size_t size, struct slice s);
+
+#endif /* PARSE_PACKET_H */
@@ -12,28 +12,371 @@
 #include <time.h>
 
 #include "send_packet.h"
+#include "io_backend.h"
+
+#define DEFAULT_QUEUE_LIMIT 1000
+
+struct delayed_packet {
+    long long due;
+    int sock;
+    int flags;
+    size_t size;
+    struct sockaddr_storage addr;
+    socklen_t addrlen;
+    struct delayed_packet* next;
+    char buffer[];
+};
 
 static float loss_probability = 0.0f;
 
+static int emulation_enabled = 0;
+static long long delay_usec = 0;
+static long long jitter_usec = 0;
+static long long rate_bytes = 0;
+static float reorder_probability = 0.0f;
+static float duplicate_probability = 0.0f;
+static int queue_limit = DEFAULT_QUEUE_LIMIT;
+
+static int gilbert_elliott = 0;
+static int ge_bad_state = 0;
+static float ge_to_bad = 0.0f;
+static float ge_to_good = 0.0f;
+static float ge_good_loss = 0.0f;
+static float ge_bad_loss = 0.0f;
+
+static struct delayed_packet* queue_head = NULL;
+static struct delayed_packet* queue_tail = NULL;
+static int queue_size = 0;
+static long long link_free = 0; /* When the rate-limited link is idle again */
+static long long last_due = 0;  /* Keeps jitter from reordering the queue */
+
+static struct packet_stats stats;
+
 void set_loss_probability( float x )
 {
     srand48(time(NULL));
     loss_probability = x / 100.0f;
 }
 
+static long long now_usec( void )
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1000000LL + now.tv_nsec / 1000;
+}
+
+int set_network_emulation( const char* spec )
+{
+    char copy[256];
+    char* setting;
+    char* saveptr;
+    double value;
+
+    if( strlen(spec) >= sizeof(copy) )
+        return -1;
+    strcpy(copy, spec);
+
+    for( setting = strtok_r(copy, ",", &saveptr); setting != NULL;
+         setting = strtok_r(NULL, ",", &saveptr) )
+    {
+        if( sscanf(setting, "delay=%lf", &value) == 1 && value >= 0 )
+            delay_usec = value * 1000;
+        else if( sscanf(setting, "jitter=%lf", &value) == 1 && value >= 0 )
+            jitter_usec = value * 1000;
+        else if( sscanf(setting, "rate=%lf", &value) == 1 && value > 0 )
+            rate_bytes = value * 1000 / 8;
+        else if( sscanf(setting, "reorder=%lf", &value) == 1 && value >= 0 )
+            reorder_probability = value / 100.0;
+        else if( sscanf(setting, "dup=%lf", &value) == 1 && value >= 0 )
+            duplicate_probability = value / 100.0;
+        else if( sscanf(setting, "limit=%lf", &value) == 1 && value >= 1 )
+            queue_limit = value;
+        else if( sscanf(setting, "ge=%f:%f:%f:%f", &ge_to_bad, &ge_to_good,
+                        &ge_good_loss, &ge_bad_loss) == 4 )
+        {
+            ge_to_bad /= 100.0f;
+            ge_to_good /= 100.0f;
+            ge_good_loss /= 100.0f;
+            ge_bad_loss /= 100.0f;
+            gilbert_elliott = 1;
+        }
+        else
+            return -1;
+    }
+
+    emulation_enabled = 1;
+    return 0;
+}
+
+static int lose_packet( void )
+{
+    if( !gilbert_elliott )
+        return drand48() < loss_probability;
+
+    /* Move the two-state chain first, then lose with the state's probability,
+     * so losses come in bursts while the chain stays in the bad state.
+     */
+    if( ge_bad_state )
+    {
+        if( drand48() < ge_to_good )
+            ge_bad_state = 0;
+    }
+    else if( drand48() < ge_to_bad )
+        ge_bad_state = 1;
+
+    return drand48() < (ge_bad_state ? ge_bad_loss : ge_good_loss);
+}
+
+static ssize_t emulate_packet( int sock, const struct iovec* iov, int iovcnt, size_t size, int flags,
+                               struct sockaddr* addr, socklen_t addrlen )
+{
+    struct delayed_packet* packet;
+    long long now, due;
+    size_t offset;
+    int i;
+
+    if( !emulation_enabled || (delay_usec == 0 && jitter_usec == 0 && rate_bytes == 0) )
+    {
+        stats.sent += 1;
+        return io_sendmsg(sock, iov, iovcnt, flags, addr, addrlen);
+    }
+
+    if( reorder_probability > 0 && drand48() < reorder_probability )
+    {
+        /* Skips the queue and overtakes everything still waiting in it. */
+        stats.reordered += 1;
+        stats.sent += 1;
+        return io_sendmsg(sock, iov, iovcnt, flags, addr, addrlen);
+    }
+
+    if( queue_size >= queue_limit )
+    {
+        stats.queue_dropped += 1;
+        return size;
+    }
+
+    now = now_usec();
+    due = now;
+    if( rate_bytes > 0 )
+    {
+        /* The packet is serialised onto the link after those ahead of it. */
+        due = (link_free > now ? link_free : now) + size * 1000000LL / rate_bytes;
+        link_free = due;
+    }
+    due += delay_usec;
+    if( jitter_usec > 0 )
+        due += (long long)((2 * drand48() - 1) * jitter_usec);
+    if( due < last_due )
+        due = last_due;
+    last_due = due;
+
+    packet = malloc(sizeof(struct delayed_packet) + size);
+    packet->due = due;
+    packet->sock = sock;
+    packet->flags = flags;
+    packet->size = size;
+    memcpy(&packet->addr, addr, addrlen);
+    packet->addrlen = addrlen;
+    packet->next = NULL;
+    offset = 0;
+    for( i = 0; i < iovcnt; i++ )
+    {
+        memcpy(packet->buffer + offset, iov[i].iov_base, iov[i].iov_len);
+        offset += iov[i].iov_len;
+    }
+
+    if( queue_tail != NULL )
+        queue_tail->next = packet;
+    else
+        queue_head = packet;
+    queue_tail = packet;
+    queue_size += 1;
+    stats.delayed += 1;
+
+    return size;
+}
+
 ssize_t send_packet( int sock, void* buffer, size_t size, int flags, struct sockaddr* addr, socklen_t addrlen )
 {
-    float rnd = drand48();
-    if( rnd < loss_probability)
+    struct iovec iov;
+
+    iov.iov_base = buffer;
+    iov.iov_len = size;
+    return send_packet_iov(sock, &iov, 1, flags, addr, addrlen);
+}
+
+ssize_t send_packet_iov( int sock, const struct iovec* iov, int iovcnt, int flags, struct sockaddr* addr, socklen_t addrlen )
+{
+    size_t size = 0;
+    ssize_t rc;
+    int i;
+
+    for( i = 0; i < iovcnt; i++ )
+        size += iov[i].iov_len;
+
+    if( lose_packet() )
+    {
+        stats.dropped += 1;
+        return size;
+    }
+
+    rc = emulate_packet(sock, iov, iovcnt, size, flags, addr, addrlen);
+    if( rc != -1 && duplicate_probability > 0 && drand48() < duplicate_probability )
+    {
+        stats.duplicated += 1;
+        rc = emulate_packet(sock, iov, iovcnt, size, flags, addr, addrlen);
+    }
+
+    return rc;
+}
+
+ssize_t send_packet_segments( int sock, void* buffer, size_t size, size_t segment, int flags, struct sockaddr* addr, socklen_t addrlen )
+{
+    size_t offset, count;
+    ssize_t rc;
+
+    if( segment == 0 || segment > size )
+        segment = size;
+
+    if( loss_probability > 0 || emulation_enabled )
     {
-        fprintf(stderr, "Randomly dropping a packet\n");
+        for( offset = 0; offset < size; offset += segment )
+        {
+            rc = send_packet(sock, (char*)buffer + offset, size - offset < segment ? size - offset : segment,
+                             flags, addr, addrlen);
+            if( rc == -1 )
+                return -1;
+        }
         return size;
     }
 
-    return sendto( sock,
-                   buffer,
-                   size,
-                   flags,
-                   addr,
-                   addrlen );
+    rc = io_sendsegments(sock, buffer, size, segment, flags, addr, addrlen);
+    if( rc != -1 )
+    {
+        count = (size + segment - 1) / segment;
+        stats.sent += count;
+        if( count > 1 )
+            stats.segmented += count;
+    }
+    return rc;
+}
+
+int set_segmentation( int sock )
+{
+    return io_set_segmentation(sock);
+}
+
+void send_delayed_packets( void )
+{
+    struct delayed_packet* packet;
+    struct iovec iov;
+    long long now;
+
+    if( queue_head == NULL )
+        return;
+
+    now = now_usec();
+    while( queue_head != NULL && queue_head->due <= now )
+    {
+        packet = queue_head;
+        queue_head = packet->next;
+        if( queue_head == NULL )
+            queue_tail = NULL;
+        queue_size -= 1;
+
+        /* A late error has no caller left to report to, so it only counts as
+         * a drop, like a packet lost on the wire.
+         */
+        iov.iov_base = packet->buffer;
+        iov.iov_len = packet->size;
+        if( io_sendmsg(packet->sock, &iov, 1, packet->flags,
+                       (struct sockaddr*)&packet->addr, packet->addrlen) == -1 )
+            stats.queue_dropped += 1;
+        else
+            stats.sent += 1;
+        free(packet);
+    }
+}
+
+int select_packet( int nfds, fd_set* readfds, struct timeval* timeout )
+{
+    fd_set ready;
+    struct timeval wait;
+    long long now, deadline, wait_usec;
+    int rc;
+
+    now = now_usec();
+    deadline = timeout != NULL ? now + timeout->tv_sec * 1000000LL + timeout->tv_usec : -1;
+
+    for( ;; )
+    {
+        send_delayed_packets();
+        now = now_usec();
+
+        if( deadline >= 0 )
+            wait_usec = deadline > now ? deadline - now : 0;
+        else
+            wait_usec = -1;
+        if( queue_head != NULL && (wait_usec < 0 || queue_head->due - now < wait_usec) )
+            wait_usec = queue_head->due > now ? queue_head->due - now : 0;
+
+        wait.tv_sec = wait_usec / 1000000;
+        wait.tv_usec = wait_usec % 1000000;
+        ready = *readfds;
+        rc = io_wait(nfds, &ready, wait_usec >= 0 ? &wait : NULL);
+
+        /* Woken only because a delayed packet fell due: keep waiting. */
+        if( rc != 0 || (deadline >= 0 && now_usec() >= deadline) )
+            break;
+    }
+
+    if( rc != -1 )
+        *readfds = ready;
+    if( timeout != NULL )
+    {
+        now = now_usec();
+        wait_usec = deadline > now ? deadline - now : 0;
+        timeout->tv_sec = wait_usec / 1000000;
+        timeout->tv_usec = wait_usec % 1000000;
+    }
+    return rc;
+}
+
+ssize_t recv_packet( int sock, void* buffer, size_t size, int flags, struct sockaddr* addr, socklen_t* addrlen )
+{
+    return io_recvfrom(sock, buffer, size, flags, addr, addrlen);
+}
+
+int set_io_backend( const char* name )
+{
+    return io_set_backend(name);
+}
+
+void flush_packets( void )
+{
+    io_flush();
+}
+
+void release_packets( int sock )
+{
+    io_flush();
+    io_release(sock);
+}
+
+int pending_packets( int sock )
+{
+    return io_pending(sock);
+}
+
+void get_packet_stats( struct packet_stats* out )
+{
+    *out = stats;
+}
+
+void print_packet_stats( FILE* out )
+{
+    fprintf(out, "PACKETS: %ld sent, %ld dropped, %ld queue drops, %ld duplicated, %ld reordered, %ld delayed, %ld segmented\n",
+            stats.sent, stats.dropped, stats.queue_dropped, stats.duplicated,
+            stats.reordered, stats.delayed, stats.segmented);
+    fprintf(out, "IO: %s backend, %ld system calls\n", io_backend_name(), io_syscalls());
 }
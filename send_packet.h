@@ -10,6 +10,7 @@
 #include <sys/socket.h>
 #include <sys/select.h>
 #include <sys/time.h>
+#include <sys/uio.h>
 #include <arpa/inet.h>
 
 /* This function is used to set the probability (a value between 0 and 1) for
@@ -20,8 +21,102 @@ void set_loss_probability( float x );
 
 /* This is a lossy replacement for the sendto function. It uses a random
  * number generator to drop packets with the probability chosen with
- * set_loss_probability. If it doesn't drop the packet, it calls sendto.
+ * set_loss_probability. If it doesn't drop the packet, it sends it,
+ * or hands it to the emulation stage when set_network_emulation is used.
  */
 ssize_t send_packet( int sock, void* buffer, size_t size, int flags, struct sockaddr* addr, socklen_t addrlen );
 
+/* send_packet for a datagram kept in iovcnt pieces, gathered like sendmsg
+ * does, so a header and a body can go out without first being copied into
+ * one buffer. Only a packet held back by the emulation stage is copied.
+ */
+ssize_t send_packet_iov( int sock, const struct iovec* iov, int iovcnt, int flags, struct sockaddr* addr, socklen_t addrlen );
+
+/* Sends size bytes as a burst of datagrams of segment bytes each, the last
+ * of which may be shorter, all to addr. Where set_segmentation succeeded for
+ * sock the kernel splits the burst up (UDP_SEGMENT), in one system call.
+ * While packets are being dropped or emulated, each datagram goes through
+ * send_packet on its own instead, to be dropped or delayed by itself.
+ */
+ssize_t send_packet_segments( int sock, void* buffer, size_t size, size_t segment, int flags, struct sockaddr* addr, socklen_t addrlen );
+
+/* Turns on UDP segmentation offload for sock, for send_packet_segments and
+ * for receiving the batches the kernel coalesces (UDP_GRO), which
+ * recv_packet still returns a datagram at a time. Only one socket can have
+ * it. Call it after set_io_backend. Returns -1, with everything working as
+ * before, where the kernel or the I/O backend does not support it.
+ */
+int set_segmentation( int sock );
+
+/* Turns on the emulation stage behind send_packet. The spec is a comma
+ * separated list of settings, for example "delay=20,jitter=5,rate=1000":
+ *
+ *   delay=<ms>        one-way delay
+ *   jitter=<ms>       uniform +/- variation of the delay, without reordering
+ *   rate=<kbit/s>     bandwidth cap, packets queue behind each other
+ *   reorder=<%>       packets that skip the delay and overtake the queue
+ *   dup=<%>           packets that are sent twice
+ *   ge=<p>:<r>:<g>:<b> Gilbert-Elliott loss in percent: good to bad and bad
+ *                     to good transition probabilities, then the loss
+ *                     probability in the good and in the bad state. Replaces
+ *                     the uniform loss from set_loss_probability.
+ *   limit=<packets>   delay queue length before packets are dropped
+ *
+ * Returns 0 on success and -1 if the spec is invalid.
+ */
+int set_network_emulation( const char* spec );
+
+/* A replacement for select on the read set that also drives the delay queue:
+ * it sends delayed packets as they fall due while waiting. The timeout is
+ * updated to the time left, as Linux does, and may be NULL to wait forever.
+ */
+int select_packet( int nfds, fd_set* readfds, struct timeval* timeout );
+
+/* Sends every delayed packet that is due. select_packet calls this itself. */
+void send_delayed_packets( void );
+
+/* The replacement for recvfrom that goes with select_packet. Sockets waited
+ * on with select_packet must be read with it, as some backends take
+ * datagrams off the socket before they are asked for.
+ */
+ssize_t recv_packet( int sock, void* buffer, size_t size, int flags, struct sockaddr* addr, socklen_t* addrlen );
+
+/* Chooses the system calls behind send_packet, select_packet and
+ * recv_packet: "select" (the default), "epoll" or "uring". Returns -1 if the
+ * backend is unknown or the kernel does not support it.
+ */
+int set_io_backend( const char* name );
+
+/* Makes sure every packet sent has been handed to the kernel. Call it before
+ * exiting, as the uring backend queues sends.
+ */
+void flush_packets( void );
+
+/* Stops taking datagrams off sock, before it is handed to another process.
+ * Those already taken stay readable with recv_packet until pending_packets
+ * is 0. The next select_packet on sock takes up receiving again.
+ */
+void release_packets( int sock );
+
+/* Returns the number of datagrams taken off sock and not yet read. */
+int pending_packets( int sock );
+
+struct packet_stats {
+    long sent;          /* Packets handed to sendmsg */
+    long dropped;       /* Lost to the loss model */
+    long queue_dropped; /* Dropped because the delay queue was full */
+    long duplicated;
+    long reordered;
+    long delayed;
+    long segmented;     /* Packets sent in bursts the kernel split up */
+};
+
+/* Copies the counters kept by send_packet. */
+void get_packet_stats( struct packet_stats* stats );
+
+/* Prints the counters on one line, prefixed with "PACKETS:", and the I/O
+ * backend's system calls on a second, prefixed with "IO:".
+ */
+void print_packet_stats( FILE* out );
+
 #endif /* SEND_PACKET_H */
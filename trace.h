@@ -0,0 +1,52 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+/* Static tracepoints on the packet path, for breaking latency down by stage
+ * with the usual Linux tools. Built with "make USDT=1" where <sys/sdt.h> is
+ * installed (systemtap-sdt-dev or systemtap-sdt-devel), every TRACE becomes
+ * a USDT probe of provider upush: a nop in the code and a note in the
+ * binary, which a tracer attaches to at run time, e.g.
+ *
+ *   bpftrace -l 'usdt:./upush_server:upush:*'
+ *   bpftrace -e 'usdt:./upush_server:upush:registry_lookup { @[arg2] = count(); }'
+ *
+ * Otherwise TRACE compiles to nothing and its arguments are never
+ * evaluated. The server passes nicks as a pointer and a length, as they are
+ * slices of the datagram, read with str(ptr, len); the client's are
+ * terminated. Sequence numbers are digits 0-9 and times are microseconds.
+ * Every probe fires with the tracer's own timestamp too, so the time
+ * between two probes of one packet, or a lookup's start and done, is that
+ * stage.
+ *
+ * upush_server
+ *   datagram_receive  port, len, monotonic usec the batch was taken in
+ *   parse_done        port, seq, packet type, nick, nick len
+ *   registry_lookup   nick, nick len, found, registered clients
+ *   reply_send        port, seq, buf, len
+ *
+ * upush_client
+ *   datagram_receive  port, len
+ *   parse_done        port, seq, packet type
+ *   lookup_start      nick
+ *   lookup_done       nick, 1 if found, 0 if not registered, -1 without a reply
+ *   message_send      nick, first seq, messages, bytes
+ *   retransmit        nick, seq, times sent, usec since queued
+ *   ack_match         nick, seq, retransmits, usec since queued
+ *   reply_send        port, seq (the ACKs to a peer's messages)
+ */
+
+#if defined(UPUSH_USDT) && defined(__has_include)
+#if __has_include(<sys/sdt.h>)
+#include <sys/sdt.h>
+#define TRACE(...) STAP_PROBEV(upush, __VA_ARGS__)
+#else
+#warning "USDT=1 without <sys/sdt.h>: tracepoints are left out"
+#endif
+#endif
+
+#ifndef TRACE
+static inline void trace_discard(int name, ...) { (void)name; }
+#define TRACE(name, ...) do { if (0) trace_discard(0, __VA_ARGS__); } while (0)
+#endif
+
+#endif /* TRACE_H */
@@ -1,18 +1,142 @@
 #include "send_packet.h"
+#include "parse_packet.h"
+#include "console.h"
+#include "trace.h"
 
 #include <time.h>
 #include <ctype.h>
+#include <errno.h>
 
 #define IP "127.0.0.1"
 #define BUFSIZE 1401
 #define LOOKUPSIZE 36
 #define MIN_INPUT_SIZE 4
 #define MAX_NAME_BYTE_SIZE 20
-#define ACKSIZE 32
-#define HEARTBEAT 10
+#define ACKSIZE 48
+#define HEARTBEAT 10 // Refresh interval for a server that grants no lease
 #define MAIN_LOOP_DOWNTIME 1
+#define BATCH_BUFSIZE 65536
+#define BATCH_MAX_QUEUED 256
+#define HISTOGRAM_BUCKETS 32
+#define RETRANSMIT_BUCKETS 4
+#define STATS_DUMP_INTERVAL 10
+#define BATCH_LOOKUP_MAX 128 // Nicks per batch lookup, as the server answers at most this many
+#define BATCH_MAX_PARTS 32
+#define BACKGROUND_SEQ_NUM 9 // Requests nobody waits for, apart from the 0 and 1 of blocking ones
+#define RELAY_WINDOW 8 // RELAY requests sent at once, numbered 0-7, clear of BACKGROUND_SEQ_NUM
+#define CACHE_TTL 30 // The shortest lease a server grants
+#define CACHE_REFRESH_MARGIN 5 // Refresh a peer in use this long before it expires
+#define NEGATIVE_TTL 5
+#define NEGATIVE_CACHE_MAX 64
+#define MAX_REPLICAS 8
+#define HEADER_SIZE 64 // "PKT s FROM <nick> TO <nick> " with both nicks at their longest
+#define HEADER_SEQ_OFFSET 4
+#define MAX_WINDOW 5 // Sequence numbers are one digit and run to twice the window
+#define RECV_BATCH 32 // Datagrams handled per wakeup before anything is sent
+#define LIVENESS_PROBES 4 // Probe intervals in the liveness bound, the last one ends in failure
+#define PEER_TABLE_MAX 256 // Peers kept unless set with -m
 
 static int server_seq_num;
+static int batch_mode;
+static int trace_timestamps;
+static int relay_mode;
+static int window = 1; // Messages sent to a peer before waiting for ACKs, set with -w
+static int windows_changed; // Messages were queued or acknowledged since fill_windows
+static long long liveness_usec; // Silence before a peer with messages in flight is given up, set with -k
+static int peer_table_max = PEER_TABLE_MAX;
+static long peer_clock; // Stamps peers as they are used, the least recent is evicted first
+static int refresh_interval = HEARTBEAT; // As granted with the last lease
+static int registration_lost; // The server answered a heartbeat with NOT REGISTERED
+static const char* stats_file;
+
+// Read replicas of the server, given with -R. Lookups go to them in turn and
+// only fall back on the server when a replica does not answer.
+static struct sockaddr_in replicas[MAX_REPLICAS];
+static int replica_count;
+static int next_replica;
+
+struct histogram { // Bucket i counts values in [2^i, 2^(i+1)) microseconds
+  long count;
+  long long max;
+  long buckets[HISTOGRAM_BUCKETS];
+};
+
+struct peer_stats {
+  char* name;
+  int delivered;
+  int failed;
+  long retransmits[RETRANSMIT_BUCKETS]; // Last bucket is RETRANSMIT_BUCKETS - 1 or more
+  struct histogram latency; // From @nick input to the peer's ACK
+  struct histogram rtt;     // From the acknowledged transmission to its ACK
+  struct histogram one_way; // From the peer's send timestamp to our receive
+  long last_used; // peer_clock when last recorded to
+  struct peer_stats* next;
+};
+
+struct stats_list {
+  int size;
+  struct peer_stats* head;
+  struct peer_stats* tail;
+};
+
+static struct stats_list peer_stats;
+
+struct batch_stats {
+  int queued;
+  int delivered;
+  int failed;
+  int rejected;
+  int relayed; // Handed to the server after the peer stopped answering
+  double latency_sum;
+  double latency_min;
+  double latency_max;
+  struct histogram latency;
+  struct timespec start;
+};
+
+static struct batch_stats stats;
+
+struct cache_stats {
+  long hits;
+  long misses;
+  long negative_hits;
+  long refreshes;
+};
+
+static struct cache_stats cache_stats;
+
+struct liveness_stats {
+  long probes;
+  long answered;
+  long failed; // Peers given up on
+  long moved; // Peers that had gone quiet and turned out to have a new address
+};
+
+static struct liveness_stats liveness_stats;
+
+struct memory_stats { // What the peer table and peer stats hold, allocator overhead aside
+  long peers;
+  long messages;
+  long long bytes; // Peers with their names and addresses, queued messages and peer stats
+  long evicted;
+  long stats_evicted;
+};
+
+static struct memory_stats memory_stats;
+
+struct negative_entry { // A nick the server recently answered NOT FOUND for
+  char* name;
+  time_t expires;
+  struct negative_entry* next;
+};
+
+struct negative_cache {
+  int size;
+  struct negative_entry* head;
+  struct negative_entry* tail;
+};
+
+static struct negative_cache negative_cache;
 
 struct blocked {
   char* name;
@@ -27,19 +151,31 @@ struct block_list {
 
 struct message {
   int repeat;
-  char* msg;
+  int seq_num;
+  int acked;
   time_t last_time_sent;
+  struct timespec queued;
   struct message* next;
   //struct message* prev;
+  size_t len;
+  char msg[]; // Allocated with the message, the only copy of the text
 };
 
 struct client {
   int size;
   int next_seq_num;
-  int expected_seq_num;
+  int in_flight; // Messages at the head that were sent and wait for their ACK
   char* name;
   char* ip;
   int port;
+  time_t expires; // When the address must be looked up again
+  int used; // Sent to since the last refresh, so worth refreshing
+  long last_used; // peer_clock when last sent to or heard from
+  struct sockaddr_in addr;
+  long long last_heard; // When the peer last answered, or its window started to fill
+  long long last_probe; // When the peer was last sent a PING
+  char header[HEADER_SIZE]; // Rendered on the first send with sequence number 0
+  int header_len;
   struct message* head;
   struct message* tail;
   struct client* next;
@@ -78,11 +214,21 @@ int is_blocked(struct block_list* bl, char* name) {
   return 0;
 }
 
+int is_blocked_slice(struct block_list* bl, struct slice name) {
+  struct blocked* current = bl->head;
+  while (current != NULL) {
+    if (slice_equals(name, current->name))
+      return 1;
+    current = current->next;
+  }
+  return 0;
+}
+
 void add_block(struct block_list* bl, char* name) {
   struct blocked* current = bl->head;
   while (current != NULL) {
     if (!strcmp(current->name, name)) {
-      fprintf(stderr, "%s IS ALREADY ON YOUR BLOCKLIST\n", name);
+      console_log(CONSOLE_ERROR, "%s IS ALREADY ON YOUR BLOCKLIST\n", name);
       return;
     }
     current = current->next;
@@ -175,12 +321,20 @@ void update_message_info(struct message* message) {
   message->last_time_sent = time(NULL);
 }
 
-void push_back_message(struct client* client, char* msg) {
-  struct message* message = malloc(sizeof(struct message));
-  message->msg = strdup(msg);
+void push_back_message(struct client* client, int seq_num, char* msg) {
+  size_t len = strlen(msg);
+  struct message* message = malloc(sizeof(struct message) + len + 1);
+  message->seq_num = seq_num;
+  memcpy(message->msg, msg, len + 1);
+  message->len = len;
   message->next = NULL;
   message->repeat = 0;
+  message->acked = 0;
   message->last_time_sent = 0;
+  clock_gettime(CLOCK_MONOTONIC, &message->queued);
+  stats.queued += 1;
+  memory_stats.messages += 1;
+  memory_stats.bytes += sizeof(struct message) + len + 1;
 
   if (client->tail != NULL)
     client->tail->next = message;
@@ -190,6 +344,89 @@ void push_back_message(struct client* client, char* msg) {
   client->size += 1;
 }
 
+void destroy_negative_entry(struct negative_entry* entry) {
+  free(entry->name);
+  free(entry);
+}
+
+void pop_negative_entry() {
+  struct negative_entry* entry = negative_cache.head;
+  negative_cache.head = entry->next;
+  if (negative_cache.head == NULL)
+    negative_cache.tail = NULL;
+  negative_cache.size -= 1;
+  destroy_negative_entry(entry);
+}
+
+// Entries all live NEGATIVE_TTL, so the oldest, at the head, expire first.
+void prune_negative_cache() {
+  while (negative_cache.head != NULL && negative_cache.head->expires <= time(NULL))
+    pop_negative_entry();
+}
+
+void push_back_negative_entry(const char* name) {
+  struct negative_entry* entry;
+
+  if (negative_cache.size == NEGATIVE_CACHE_MAX)
+    pop_negative_entry();
+  entry = malloc(sizeof(struct negative_entry));
+  entry->name = strdup(name);
+  entry->expires = time(NULL) + NEGATIVE_TTL;
+  entry->next = NULL;
+
+  if (negative_cache.tail != NULL)
+    negative_cache.tail->next = entry;
+  else
+    negative_cache.head = entry;
+  negative_cache.tail = entry;
+  negative_cache.size += 1;
+}
+
+int is_negatively_cached(const char* name) {
+  prune_negative_cache();
+  for (struct negative_entry* current = negative_cache.head; current != NULL; current = current->next) {
+    if (!strcmp(current->name, name))
+      return 1;
+  }
+  return 0;
+}
+
+// Drops a NOT FOUND answer as soon as the nick is known to be registered.
+void remove_negative_entry(const char* name) {
+  struct negative_entry* current = negative_cache.head;
+  struct negative_entry* prev = NULL;
+  while (current != NULL) {
+    if (!strcmp(current->name, name)) {
+      if (prev != NULL)
+        prev->next = current->next;
+      else
+        negative_cache.head = current->next;
+      if (current->next == NULL)
+        negative_cache.tail = prev;
+      negative_cache.size -= 1;
+      destroy_negative_entry(current);
+      return;
+    }
+    prev = current;
+    current = current->next;
+  }
+}
+
+void destroy_negative_cache() {
+  while (negative_cache.head != NULL)
+    pop_negative_entry();
+}
+
+void set_client_address(struct client* client, char* ip, char* port) {
+  client->ip = strdup(ip);
+  memory_stats.bytes += strlen(ip) + 1;
+  client->port = atoi(port);
+  memset(&client->addr, 0, sizeof(client->addr));
+  client->addr.sin_family = AF_INET;
+  client->addr.sin_port = htons(client->port);
+  inet_pton(AF_INET, ip, &client->addr.sin_addr);
+}
+
 int update_client(struct message_queue* mq, char* name, char* ip, char* port) {
   struct client* current = mq->head;
   struct client* temp;
@@ -198,9 +435,11 @@ int update_client(struct message_queue* mq, char* name, char* ip, char* port) {
     current = current->next;
 
     if (!strcmp(name, temp->name)) {
+      memory_stats.bytes -= strlen(temp->ip) + 1;
       free(temp->ip);
-      temp->ip = strdup(ip);
-      temp->port = atoi(port);
+      set_client_address(temp, ip, port);
+      temp->expires = time(NULL) + CACHE_TTL;
+      remove_negative_entry(name);
       return 1;
     }
   }
@@ -211,13 +450,19 @@ void push_back_client(struct message_queue* mq, char* name, char* ip, char* port
   struct client* client = malloc(sizeof(struct client));
   client->size = 0;
   client->next_seq_num = 0;
-  client->expected_seq_num = 0;
+  client->in_flight = 0;
+  client->last_heard = 0;
+  client->last_probe = 0;
   client->name = strdup(name);
-  client->ip = strdup(ip);
-  client->port = atoi(port);
+  set_client_address(client, ip, port);
+  client->header_len = 0;
+  client->expires = time(NULL) + CACHE_TTL;
+  client->used = 0;
+  client->last_used = ++peer_clock;
   client->head = NULL;
   client->tail = NULL;
   client->next = NULL;
+  remove_negative_entry(name);
 
   if (mq->tail != NULL)
     mq->tail->next = client;
@@ -225,10 +470,13 @@ void push_back_client(struct message_queue* mq, char* name, char* ip, char* port
     mq->head = client;
   mq->tail = client;
   mq->size += 1;
+  memory_stats.peers += 1;
+  memory_stats.bytes += sizeof(struct client) + strlen(name) + 1;
 }
 
 void destroy_message(struct message* message) {
-  free(message->msg);
+  memory_stats.messages -= 1;
+  memory_stats.bytes -= sizeof(struct message) + message->len + 1;
   free(message);
 }
 
@@ -240,6 +488,8 @@ void destroy_client(struct client* client) {
     current = current->next;
     destroy_message(temp);
   }
+  memory_stats.peers -= 1;
+  memory_stats.bytes -= sizeof(struct client) + strlen(client->name) + 1 + strlen(client->ip) + 1;
   free(client->name);
   free(client->ip);
   free(client);
@@ -270,6 +520,8 @@ void pop_front_message(struct client* client) {
     client->head = temp;
     client->size -= 1;
   }
+  if (client->in_flight > 0) // The head is the first to be sent
+    client->in_flight -= 1;
 
   //printf("size = %d\n", client->size);
 }
@@ -293,11 +545,9 @@ void pop_client(struct message_queue* mq, char* name) {
 
     while (current != NULL) {
       if (!strcmp(current->name, name)) {
-        if (current->next != NULL) {
-          prev->next = current->next;;
-        } else {
+        prev->next = current->next;
+        if (current->next == NULL)
           mq->tail = prev;
-        }
         mq->size -= 1;
         destroy_client(current);
         return;
@@ -309,22 +559,181 @@ void pop_client(struct message_queue* mq, char* name) {
 
 }
 
+void histogram_add(struct histogram* h, long long usec) {
+  int bucket = 0;
+  while (bucket < HISTOGRAM_BUCKETS - 1 && usec >= (1LL << (bucket + 1)))
+    bucket++;
+
+  h->buckets[bucket] += 1;
+  h->count += 1;
+  if (usec > h->max)
+    h->max = usec;
+}
+
+long long histogram_percentile(struct histogram* h, int percent) {
+  // Upper bound of the bucket holding the percentile, capped at the maximum.
+  long rank = (h->count * percent + 99) / 100;
+  long seen = 0;
+  for (int bucket = 0; bucket < HISTOGRAM_BUCKETS; bucket++) {
+    seen += h->buckets[bucket];
+    if (seen >= rank && seen > 0)
+      return (1LL << (bucket + 1)) < h->max ? (1LL << (bucket + 1)) : h->max;
+  }
+  return h->max;
+}
+
+void print_histogram(FILE* out, const char* label, struct histogram* h) {
+  if (h->count == 0)
+    return;
+  fprintf(out, "  %-11s n=%ld p50 %.3f ms p90 %.3f ms p99 %.3f ms max %.3f ms\n",
+          label, h->count, histogram_percentile(h, 50) / 1000.0,
+          histogram_percentile(h, 90) / 1000.0, histogram_percentile(h, 99) / 1000.0,
+          h->max / 1000.0);
+}
+
+void destroy_peer_stats_entry(struct peer_stats* ps) {
+  memory_stats.bytes -= sizeof(struct peer_stats) + strlen(ps->name) + 1;
+  free(ps->name);
+  free(ps);
+}
+
+// Drops the stats of the peer recorded to least recently, so they are held
+// for no more nicks than the peer table.
+void evict_peer_stats() {
+  struct peer_stats* oldest = peer_stats.head;
+  struct peer_stats* oldest_prev = NULL;
+  struct peer_stats* prev = peer_stats.head;
+
+  for (struct peer_stats* current = prev->next; current != NULL; prev = current, current = current->next) {
+    if (current->last_used < oldest->last_used) {
+      oldest = current;
+      oldest_prev = prev;
+    }
+  }
+  if (oldest_prev != NULL)
+    oldest_prev->next = oldest->next;
+  else
+    peer_stats.head = oldest->next;
+  if (peer_stats.tail == oldest)
+    peer_stats.tail = oldest_prev;
+  peer_stats.size -= 1;
+  memory_stats.stats_evicted += 1;
+  destroy_peer_stats_entry(oldest);
+}
+
+struct peer_stats* find_peer_stats(const char* name) {
+  struct peer_stats* current = peer_stats.head;
+  while (current != NULL) {
+    if (!strcmp(current->name, name)) {
+      current->last_used = ++peer_clock;
+      return current;
+    }
+    current = current->next;
+  }
+
+  if (peer_stats.size >= peer_table_max)
+    evict_peer_stats();
+  current = calloc(1, sizeof(struct peer_stats));
+  current->name = strdup(name);
+  current->last_used = ++peer_clock;
+  memory_stats.bytes += sizeof(struct peer_stats) + strlen(name) + 1;
+  if (peer_stats.tail != NULL)
+    peer_stats.tail->next = current;
+  else
+    peer_stats.head = current;
+  peer_stats.tail = current;
+  peer_stats.size += 1;
+  return current;
+}
+
+void destroy_peer_stats() {
+  struct peer_stats* current = peer_stats.head;
+  struct peer_stats* temp;
+  while (current != NULL) {
+    temp = current;
+    current = current->next;
+    destroy_peer_stats_entry(temp);
+  }
+  peer_stats.head = NULL;
+  peer_stats.tail = NULL;
+  peer_stats.size = 0;
+}
+
+void print_stats(FILE* out) {
+  struct peer_stats* current = peer_stats.head;
+
+  fprintf(out, "STATS: %d queued, %d delivered, %d failed, %d relayed\n",
+          stats.queued, stats.delivered, stats.failed, stats.relayed);
+  fprintf(out, "CACHE: %ld hits, %ld misses, %ld negative hits, %ld refreshes\n",
+          cache_stats.hits, cache_stats.misses, cache_stats.negative_hits, cache_stats.refreshes);
+  if (liveness_usec > 0)
+    fprintf(out, "LIVENESS: %ld probes, %ld answered, %ld peers failed, %ld moved\n", liveness_stats.probes,
+            liveness_stats.answered, liveness_stats.failed, liveness_stats.moved);
+  fprintf(out, "PEERS: %ld held (bound %d), %d with stats, %ld messages queued, %lld bytes, %ld evicted, "
+          "%ld stats evicted\n", memory_stats.peers, peer_table_max, peer_stats.size, memory_stats.messages,
+          memory_stats.bytes, memory_stats.evicted, memory_stats.stats_evicted);
+  print_packet_stats(out);
+  while (current != NULL) {
+    fprintf(out, "%s: %d delivered, %d failed\n", current->name, current->delivered,
+            current->failed);
+    print_histogram(out, "latency", &current->latency);
+    print_histogram(out, "rtt", &current->rtt);
+    print_histogram(out, "one-way", &current->one_way);
+    if (current->delivered > 0) {
+      fprintf(out, "  retransmits");
+      for (int i = 0; i < RETRANSMIT_BUCKETS; i++)
+        fprintf(out, " %d%s:%ld", i, i == RETRANSMIT_BUCKETS - 1 ? "+" : "", current->retransmits[i]);
+      fprintf(out, "\n");
+    }
+    current = current->next;
+  }
+}
+
+void dump_stats() {
+  FILE* out = fopen(stats_file, "w");
+  if (out == NULL) {
+    console_log(CONSOLE_ERROR, "%s: %s\n", stats_file, strerror(errno));
+    return;
+  }
+  print_stats(out);
+  fclose(out);
+}
+
+long long now_usec() {
+  struct timespec now;
+  clock_gettime(CLOCK_REALTIME, &now);
+  return now.tv_sec * 1000000LL + now.tv_nsec / 1000;
+}
+
+long long monotonic_usec() {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return now.tv_sec * 1000000LL + now.tv_nsec / 1000;
+}
+
+long long usec_since(struct timespec begin) {
+  return monotonic_usec() - (begin.tv_sec * 1000000LL + begin.tv_nsec / 1000);
+}
+
 void check_error(int i, char *msg) {
   if (i == -1) {
-    perror(msg);
+    console_log(CONSOLE_ERROR, "%s: %s\n", msg, strerror(errno));
     exit(EXIT_FAILURE);
   }
 }
 
-void get_string(char buf[], int size) {
+int get_string(char buf[], int size) {
   char c;
-  fgets(buf, size, stdin);
+  if (fgets(buf, size, stdin) == NULL)
+    return 0;
 
   if (buf[strlen(buf) - 1] == '\n') {
       buf[strlen(buf) - 1] = '\0';
   }
 
   else while ((c = getchar()) != '\n' && c != EOF);
+
+  return 1;
 }
 
 int compare_seq_nums(char received, int expected) {
@@ -339,29 +748,21 @@ void swap_server_seq_num() {
     server_seq_num = 1;
 }
 
-void swap_client_expected_seq_num(struct client* client) {
-  if (client->expected_seq_num)
-    client->expected_seq_num = 0;
-  else
-    client->expected_seq_num = 1;
-}
-
-void swap_client_next_seq_num(struct client* client) {
-  if (client->next_seq_num)
-    client->next_seq_num = 0;
-  else
-    client->next_seq_num = 1;
+// Sequence numbers run to twice the window, so a late ACK for a message that
+// left the window is never taken for one still in it.
+void advance_client_next_seq_num(struct client* client) {
+  client->next_seq_num = (client->next_seq_num + 1) % (2 * window);
 }
 
 void check_valid_nick(const char* nick) {
   if (strlen(nick) > MAX_NAME_BYTE_SIZE - 1) {
-    fprintf(stderr, "<nick> WRONG FORMAT. MAXIMUM 19 LETTERS.\n");
+    console_log(CONSOLE_ERROR, "<nick> WRONG FORMAT. MAXIMUM 19 LETTERS.\n");
     exit(EXIT_FAILURE);
   }
 
   for (size_t i = 0; i < strlen(nick); i++) {
     if (!isascii(nick[i]) || isspace(nick[i])) {
-      fprintf(stderr, "<nick> WRONG FORMAT. ONLY ASCII. NO SPACES.\n");
+      console_log(CONSOLE_ERROR, "<nick> WRONG FORMAT. ONLY ASCII. NO SPACES.\n");
       exit(EXIT_FAILURE);
     }
   }
@@ -375,6 +776,8 @@ int register_client(int sockfd, struct sockaddr_in server_addr, long seconds,
   char buf[BUFSIZE];
   int max_reg_size = 32;
   char registration[max_reg_size];
+  struct packet pkt;
+  long long lease, refresh = 0;
 
   FD_ZERO(&set);
   FD_SET(sockfd, &set);
@@ -385,24 +788,27 @@ int register_client(int sockfd, struct sockaddr_in server_addr, long seconds,
   snprintf(registration, max_reg_size, "PKT %d REG %s", server_seq_num, nick);
   rc = send_packet(sockfd, registration, max_reg_size, 0, (struct sockaddr*)&server_addr, sizeof(server_addr));
   check_error(rc, "send_packet");
-  ack = select(FD_SETSIZE, &set, NULL, NULL, &timeout);
+  ack = select_packet(FD_SETSIZE, &set, &timeout);
   check_error(ack, "select");
 
   if (ack) {
-    rc = read(sockfd, buf, BUFSIZE - 1);
+    rc = recv_packet(sockfd, buf, BUFSIZE - 1, 0, NULL, NULL);
     check_error(rc, "read");
     buf[rc] = '\0';
 
-    if (!strcmp(buf, "ACK 0 OK")) {
-      printf("REGISTRATION COMPLETE.\n");
+    if (parse_packet(buf, rc, &pkt) == PACKET_ACK && pkt.seq == '0' &&
+        (slice_equals(pkt.text, "OK") || parse_lease_reply(pkt.text, &lease, &refresh))) {
+      if (refresh > 0)
+        refresh_interval = refresh;
+      console_log(CONSOLE_INFO, "REGISTRATION COMPLETE.\n");
       server_seq_num = 1;
     } else {
-      fprintf(stderr, "INVALID REPLY RECEIVED. EXITING.\n");
+      console_log(CONSOLE_ERROR, "INVALID REPLY RECEIVED. EXITING.\n");
       return -1;
     }
 
   } else {
-    fprintf(stderr, "NO SERVER ACKNOWLEDGEMENT RECEIVED. EXITING.\n");
+    console_log(CONSOLE_ERROR, "NO SERVER ACKNOWLEDGEMENT RECEIVED. EXITING.\n");
     return -1;
   }
 
@@ -410,6 +816,7 @@ int register_client(int sockfd, struct sockaddr_in server_addr, long seconds,
 }
 
 int check_user_input(char* buf) {
+  // 4 = Stats
   // 3 = Unblock
   // 2 = Block
   // 1 = Valid message
@@ -429,6 +836,8 @@ int check_user_input(char* buf) {
 
   if (!strcmp(buf, "QUIT"))
     return 0;
+  else if (!strcmp(buf, "STATS"))
+    return 4;
   else if (first == NULL || second == NULL)
     return -1;
   else if (strlen(first) > MAX_NAME_BYTE_SIZE)
@@ -461,6 +870,122 @@ void extract_nickname_to_block(char* nick, char* valid_user_input) {
   strcpy(nick, strtok(NULL, " "));
 }
 
+// Sends "PKT s <command> n1 n2 ..." for the given nicks, split over as many
+// datagrams as needed, without waiting for the server's reply. SUB is sent
+// again for every peer with each heartbeat, which repairs a lost one, and a
+// lost refresh LOOKUP only lets the peer expire. A datagram holds at most
+// BATCH_LOOKUP_MAX nicks, as the server answers no more per LOOKUP, and
+// carries BACKGROUND_SEQ_NUM so a late reply can't pass for the answer to a
+// blocking request.
+void send_nick_list(const char* command, char** nicks, int count, int sockfd,
+                       struct sockaddr_in server_addr) {
+  char packet[BUFSIZE];
+  int rc, len, first, i = 0;
+
+  while (i < count) {
+    len = snprintf(packet, sizeof(packet), "PKT %d %s", BACKGROUND_SEQ_NUM, command);
+    for (first = i; i < count && i - first < BATCH_LOOKUP_MAX &&
+                    len + 1 + strlen(nicks[i]) < sizeof(packet); i++)
+      len += sprintf(packet + len, " %s", nicks[i]);
+    rc = send_packet(sockfd, packet, len, 0, (struct sockaddr*)&server_addr, sizeof(server_addr));
+    check_error(rc, "send_packet");
+  }
+}
+
+// Subscribes to every peer in the peer table, so the server tells us when
+// one of them moves or expires instead of us finding out by timeouts.
+void subscribe_peers(struct message_queue* mq, int sockfd, struct sockaddr_in server_addr) {
+  char* names[mq->size + 1];
+  int count = 0;
+
+  for (struct client* current = mq->head; current != NULL; current = current->next)
+    names[count++] = current->name;
+  send_nick_list("SUB", names, count, sockfd, server_addr);
+}
+
+// Parses "ip:port,ip:port,...". Returns -1 if the list is invalid.
+int set_replicas(const char* spec) {
+  char copy[256];
+  char ip[INET_ADDRSTRLEN];
+  char* member;
+  char* saveptr;
+  int port;
+
+  if (strlen(spec) >= sizeof(copy))
+    return -1;
+  strcpy(copy, spec);
+
+  for (member = strtok_r(copy, ",", &saveptr); member != NULL; member = strtok_r(NULL, ",", &saveptr)) {
+    if (replica_count == MAX_REPLICAS || sscanf(member, "%15[0-9.]:%d", ip, &port) != 2 || port <= 0 ||
+        port > 65535 || inet_pton(AF_INET, ip, &replicas[replica_count].sin_addr) != 1)
+      return -1;
+    replicas[replica_count].sin_family = AF_INET;
+    replicas[replica_count].sin_port = htons(port);
+    replica_count += 1;
+  }
+  return 0;
+}
+
+// The address to send a lookup to. The first attempt goes to the next
+// replica, a retry to the server, which always has the latest registrations.
+struct sockaddr_in lookup_address(struct sockaddr_in server_addr, int retry) {
+  if (replica_count == 0 || retry)
+    return server_addr;
+  next_replica = (next_replica + 1) % replica_count;
+  return replicas[next_replica];
+}
+
+// Returns 1 if port is that of the server or one of its replicas.
+int is_server_port(unsigned short port, unsigned short serverport) {
+  if (port == serverport)
+    return 1;
+  for (int i = 0; i < replica_count; i++) {
+    if (ntohs(replicas[i].sin_port) == port)
+      return 1;
+  }
+  return 0;
+}
+
+// Looks up, in the background, the peers that are in use and about to
+// expire. The replies are picked up by handle_server_reply.
+void refresh_peers(struct message_queue* mq, int sockfd, struct sockaddr_in server_addr) {
+  char* names[mq->size + 1];
+  int count = 0;
+
+  for (struct client* current = mq->head; current != NULL; current = current->next) {
+    if (current->used && current->expires - time(NULL) <= CACHE_REFRESH_MARGIN) {
+      current->used = 0;
+      names[count++] = current->name;
+    }
+  }
+  cache_stats.refreshes += count;
+  send_nick_list("LOOKUP", names, count, sockfd, lookup_address(server_addr, 0));
+}
+
+void forget_peer(struct message_queue* mq, char* name, int sockfd, struct sockaddr_in server_addr) {
+  send_nick_list("UNSUB", &name, 1, sockfd, server_addr);
+  pop_client(mq, name);
+}
+
+// Forgets the least recently used peers with nothing queued until the table
+// is back within -m. Peers with messages queued are never evicted, so only
+// they can take the table past the bound.
+void trim_peers(struct message_queue* mq, int sockfd, struct sockaddr_in server_addr) {
+  struct client* oldest;
+
+  while (mq->size > peer_table_max) {
+    oldest = NULL;
+    for (struct client* current = mq->head; current != NULL; current = current->next) {
+      if (current->size == 0 && (oldest == NULL || current->last_used < oldest->last_used))
+        oldest = current;
+    }
+    if (oldest == NULL)
+      return;
+    memory_stats.evicted += 1;
+    forget_peer(mq, oldest->name, sockfd, server_addr);
+  }
+}
+
 int send_lookup_to_server(char* nick, int sockfd, struct sockaddr_in server_addr,
                           long seconds, struct message_queue* mq) {
   // return 1 = Found client
@@ -471,185 +996,571 @@ int send_lookup_to_server(char* nick, int sockfd, struct sockaddr_in server_addr
   struct timeval timeout;
   char buf[BUFSIZE];
   char lookup[LOOKUPSIZE];
-  char not_found[21];
   int expected_seq_num;
+  struct packet pkt;
+  struct slice reply_nick, reply_ip, reply_port;
+  char address[INET_ADDRSTRLEN];
+  char port[8];
 
   FD_ZERO(&set);
-  timeout.tv_sec = seconds;
-  timeout.tv_usec = 0;
 
   socklen_t reply_addr_len = sizeof(struct sockaddr_in);
   struct sockaddr_in reply_addr;
+  struct sockaddr_in lookup_addr;
 
-  char* address;
-  char* port;
   int repeat = 2;
+  TRACE(lookup_start, nick);
   while (repeat > 0) {
     expected_seq_num = server_seq_num;
     swap_server_seq_num();
 
     memset(lookup, 0, LOOKUPSIZE);
     snprintf(lookup, LOOKUPSIZE, "PKT %d LOOKUP %s", expected_seq_num, nick);
-    rc = send_packet(sockfd, lookup, LOOKUPSIZE, 0, (struct sockaddr*)&server_addr, sizeof(server_addr));
+    lookup_addr = lookup_address(server_addr, repeat < 2);
+    rc = send_packet(sockfd, lookup, LOOKUPSIZE, 0, (struct sockaddr*)&lookup_addr, sizeof(lookup_addr));
     check_error(rc, "send_packet");
 
-    memset(not_found, 0, 21);
-    snprintf(not_found, 21, "ACK %d NOT FOUND", expected_seq_num);
-
-    FD_SET(sockfd, &set);
-    ack = select(FD_SETSIZE, &set, NULL, NULL, &timeout);
-    check_error(ack, "select");
-
-    if (ack) {
-      rc = recvfrom(sockfd, buf, BUFSIZE - 1, 0, (struct sockaddr*)&reply_addr, &reply_addr_len);
+    // Anything that is not the reply to this lookup is dropped without
+    // resending, or stale replies would trigger a lookup each.
+    timeout.tv_sec = seconds;
+    timeout.tv_usec = 0;
+    do {
+      FD_SET(sockfd, &set);
+      ack = select_packet(FD_SETSIZE, &set, &timeout);
+      check_error(ack, "select");
+      if (!ack)
+        break;
+
+      rc = recv_packet(sockfd, buf, BUFSIZE - 1, 0, (struct sockaddr*)&reply_addr, &reply_addr_len);
       check_error(rc, "read");
       buf[rc] = '\0';
-      printf("%s\n", buf);
-
-      if (ntohs(server_addr.sin_port) == ntohs(reply_addr.sin_port)) { // From server port
-        if (!strcmp(not_found, buf)) {
-          fprintf(stderr, "NICK %s NOT REGISTERED\n", nick);
+      console_log(CONSOLE_DEBUG, "%s\n", buf);
+
+      if (ntohs(lookup_addr.sin_port) == ntohs(reply_addr.sin_port) && // From the port asked
+          parse_packet(buf, rc, &pkt) == PACKET_ACK &&
+          compare_seq_nums(pkt.seq, expected_seq_num)) {
+        if (slice_equals(pkt.text, "NOT FOUND")) {
+          console_log(CONSOLE_ERROR, "NICK %s NOT REGISTERED\n", nick);
+          TRACE(lookup_done, nick, 0);
           return 0;
-        } else if (compare_seq_nums(buf[4], expected_seq_num)) {
-          strtok(buf, " ");
-          for (int i = 0; i < 4; i++) {
-            strtok(NULL, " "); // Skip to the address and port section
-          }
-          address = strtok(NULL, " ");
-          strtok(NULL, " ");
-          port = strtok(NULL, " ");
-          if (!update_client(mq, nick, address, port))
+        } else if (parse_lookup_reply(pkt.text, &reply_nick, &reply_ip, &reply_port) &&
+                   slice_equals(reply_nick, nick) &&
+                   slice_copy(address, sizeof(address), reply_ip) == 0 &&
+                   slice_copy(port, sizeof(port), reply_port) == 0) {
+          if (!update_client(mq, nick, address, port)) {
             push_back_client(mq, nick, address, port);
+            send_nick_list("SUB", &nick, 1, sockfd, server_addr);
+          }
+          TRACE(lookup_done, nick, 1);
           return 1;
         }
       }
+    } while (timeout.tv_sec > 0 || timeout.tv_usec > 0);
 
-    } else {
-      repeat -= 1;
-      timeout.tv_sec = seconds;
-    }
-
+    repeat -= 1;
   }
 
+  TRACE(lookup_done, nick, -1);
   return -1;
 }
 
-void send_message_to_client(char* msg, struct client* receiver_client,
-                            int sockfd, const char* from_nick, char* to_nick) {
-  struct in_addr dest_ip;
-  int rc;
-  char full_message[BUFSIZE];
-  struct sockaddr_in dest_addr;
+// Stores the entries of one "ACK s BATCH p n ..." part. Returns the number of
+// nicks that were registered.
+int store_batch_entries(struct slice entries, struct message_queue* mq) {
+  struct slice reply_nick, reply_ip, reply_port;
+  char name[MAX_NAME_BYTE_SIZE + 1];
+  char address[INET_ADDRSTRLEN];
+  char port[8];
+  int found = 0;
+
+  while (next_batch_entry(&entries, &reply_nick, &reply_ip, &reply_port)) {
+    if (slice_equals(reply_ip, "-") ||
+        slice_copy(name, sizeof(name), reply_nick) == -1 ||
+        slice_copy(address, sizeof(address), reply_ip) == -1 ||
+        slice_copy(port, sizeof(port), reply_port) == -1)
+      continue;
+    if (!update_client(mq, name, address, port))
+      push_back_client(mq, name, address, port);
+    found += 1;
+  }
+  return found;
+}
 
-  inet_pton(AF_INET, receiver_client->ip, &dest_ip);
-  dest_addr.sin_port = htons(receiver_client->port);
-  dest_addr.sin_addr = dest_ip;
-  dest_addr.sin_family = AF_INET;
+// Stores the answer to a lookup of a single nick, "NICK n IP a PORT p" or
+// "NOT FOUND". Returns 1 if the nick was found, 0 if it is not registered and
+// -1 if the text is not an answer for it.
+int store_single_reply(struct slice text, char* nick, struct message_queue* mq) {
+  struct slice reply_nick, reply_ip, reply_port;
+  char address[INET_ADDRSTRLEN];
+  char port[8];
 
-  if (msg == NULL) {
-    rc = send_packet(sockfd, receiver_client->head->msg, strlen(receiver_client->head->msg), 0,
-                    (struct sockaddr*)&dest_addr, sizeof(dest_addr));
-    check_error(rc, "send_packet");
-    update_message_info(receiver_client->head);
-  } else {
-    msg += strlen(to_nick) + 2; // +1 for the @ and +1 for the whitespace.
-    snprintf(full_message, BUFSIZE, "PKT %d FROM %s TO %s MSG %s",
-              receiver_client->next_seq_num, from_nick, to_nick, msg);
-    swap_client_next_seq_num(receiver_client);
+  if (slice_equals(text, "NOT FOUND"))
+    return 0;
+  if (!parse_lookup_reply(text, &reply_nick, &reply_ip, &reply_port) ||
+      !slice_equals(reply_nick, nick) ||
+      slice_copy(address, sizeof(address), reply_ip) == -1 ||
+      slice_copy(port, sizeof(port), reply_port) == -1)
+    return -1;
+  if (!update_client(mq, nick, address, port))
+    push_back_client(mq, nick, address, port);
+  return 1;
+}
 
-    if (receiver_client->size == 0) {
-      push_back_message(receiver_client, full_message);
+// Looks up count nicks in as few round trips as possible: up to
+// BATCH_LOOKUP_MAX nicks go in one "PKT s LOOKUP n1 n2 ..." and the server
+// answers with as many BATCH parts as it needs, or with a plain lookup reply
+// when the request holds one nick. A request that is not fully
+// answered within the timeout is sent once more. Returns the number of nicks
+// found, or -1 if the server did not answer at all.
+int send_batch_lookup_to_server(char** nicks, int count, int sockfd, struct sockaddr_in server_addr,
+                                long seconds, struct message_queue* mq) {
+  int rc, ack, len, first, last, expected_seq_num, part, parts, reply_parts;
+  int found = 0, answered = 0, request_found;
+  unsigned long long received; // Bit i for part i + 1, with room for a mask of BATCH_MAX_PARTS
+  fd_set set;
+  struct timeval timeout;
+  char buf[BUFSIZE];
+  char lookup[BUFSIZE];
+  struct packet pkt;
+  struct slice entries;
+  socklen_t reply_addr_len = sizeof(struct sockaddr_in);
+  struct sockaddr_in reply_addr;
+  struct sockaddr_in lookup_addr;
+
+  FD_ZERO(&set);
 
-      rc = send_packet(sockfd, full_message, strlen(full_message), 0,
-                      (struct sockaddr*)&dest_addr, sizeof(dest_addr));
+  for (first = 0; first < count; first = last) {
+    len = snprintf(lookup, sizeof(lookup), "PKT %d LOOKUP", server_seq_num);
+    for (last = first; last < count && last - first < BATCH_LOOKUP_MAX &&
+                       len + 1 + strlen(nicks[last]) < sizeof(lookup); last++)
+      len += sprintf(lookup + len, " %s", nicks[last]);
+
+    int repeat = 2;
+    while (repeat > 0) {
+      expected_seq_num = server_seq_num;
+      lookup[4] = '0' + expected_seq_num;
+      swap_server_seq_num();
+      lookup_addr = lookup_address(server_addr, repeat < 2);
+      rc = send_packet(sockfd, lookup, len, 0, (struct sockaddr*)&lookup_addr, sizeof(lookup_addr));
       check_error(rc, "send_packet");
-      update_message_info(receiver_client->head);
-    } else {
-      push_back_message(receiver_client, full_message);
+
+      received = 0;
+      parts = 0;
+      request_found = 0;
+      timeout.tv_sec = seconds;
+      timeout.tv_usec = 0;
+      do {
+        FD_SET(sockfd, &set);
+        ack = select_packet(FD_SETSIZE, &set, &timeout);
+        check_error(ack, "select");
+        if (!ack)
+          break;
+
+        rc = recv_packet(sockfd, buf, BUFSIZE - 1, 0, (struct sockaddr*)&reply_addr, &reply_addr_len);
+        check_error(rc, "read");
+        buf[rc] = '\0';
+
+        if (ntohs(lookup_addr.sin_port) == ntohs(reply_addr.sin_port) && // From the port asked
+            parse_packet(buf, rc, &pkt) == PACKET_ACK &&
+            compare_seq_nums(pkt.seq, expected_seq_num)) {
+          if (parse_batch_reply(pkt.text, &part, &reply_parts, &entries) &&
+              reply_parts <= BATCH_MAX_PARTS && (parts == 0 || reply_parts == parts) &&
+              !(received & 1ull << (part - 1))) {
+            parts = reply_parts;
+            received |= 1ull << (part - 1);
+            request_found += store_batch_entries(entries, mq);
+          } else if (last - first == 1 && (rc = store_single_reply(pkt.text, nicks[first], mq)) >= 0) {
+            // A lone nick reads as a plain LOOKUP, answered without BATCH
+            parts = 1;
+            received = 1;
+            request_found += rc;
+          }
+        }
+      } while ((parts == 0 || received != (1ull << parts) - 1) &&
+               (timeout.tv_sec > 0 || timeout.tv_usec > 0));
+
+      if (parts > 0 && received == (1ull << parts) - 1)
+        break;
+      repeat -= 1;
     }
+    found += request_found;
+    if (received != 0)
+      answered = 1;
   }
 
+  return answered || count == 0 ? found : -1;
 }
 
-int is_ack(char* msg) {
-  if (strlen(msg) < 8)
-    return 0;
+// Prefetches the address of every nick in a contacts file, one per line, so
+// the first message to each of them needs no lookup of its own.
+void prefetch_contacts(const char* path, const char* nick, int sockfd, struct sockaddr_in server_addr,
+                       long seconds, struct message_queue* mq) {
+  FILE* file = fopen(path, "r");
+  char line[BUFSIZE];
+  char** contacts = NULL;
+  int count = 0, capacity = 0, found;
+  size_t len;
+
+  if (file == NULL) {
+    console_log(CONSOLE_ERROR, "%s: %s\n", path, strerror(errno));
+    return;
+  }
 
-  return msg[0] == 'A' && msg[1] == 'C' && msg[2] == 'K' && isdigit(msg[4]);
-}
+  while (fgets(line, sizeof(line), file) != NULL) {
+    len = strcspn(line, " \t\r\n");
+    line[len] = '\0';
+    if (len == 0 || len > MAX_NAME_BYTE_SIZE || !strcmp(line, nick))
+      continue;
 
-void verify_ack(struct client* client, char* ack, int sockfd, const char* from_nick) {
-  if (compare_seq_nums(ack[4], client->expected_seq_num)) {
-    pop_front_message(client);
-    swap_client_expected_seq_num(client);
-    if (client->size > 0) {
-      send_message_to_client(NULL, client, sockfd, from_nick, client->name);
+    if (count == capacity) {
+      capacity = capacity ? capacity * 2 : 16;
+      contacts = realloc(contacts, capacity * sizeof(char*));
     }
+    contacts[count++] = strdup(line);
+  }
+  fclose(file);
+
+  found = send_batch_lookup_to_server(contacts, count, sockfd, server_addr, seconds, mq);
+  if (found == -1) {
+    console_log(CONSOLE_WARNING, "NO REPLY TO CONTACT PREFETCH\n");
   } else {
-    fprintf(stderr, "RECEIVED OLD ACK\n");
+    console_log(CONSOLE_INFO, "PREFETCHED %d OF %d CONTACTS\n", found, count);
+    subscribe_peers(mq, sockfd, server_addr);
   }
+
+  for (int i = 0; i < count; i++)
+    free(contacts[i]);
+  free(contacts);
 }
 
-int is_valid_message_format(char* msg, char* from_nick, char* to_nick) {
-  char msg_copy[BUFSIZE];
-  char* token;
+// Points iov at "PKT <seq> FROM <nick> TO <nick> [TS <usec>] MSG <text>":
+// the peer's header with the sequence number patched in, the optional
+// timestamp, and the queued text. Returns the length of the datagram.
+size_t gather_message(struct client* receiver_client, struct message* message, const char* from_nick,
+                      struct iovec iov[3], char stamp[32]) {
+  size_t room;
+
+  if (receiver_client->header_len == 0) {
+    receiver_client->header_len = snprintf(receiver_client->header, HEADER_SIZE, "PKT 0 FROM %s TO %s ",
+                                           from_nick, receiver_client->name);
+    if (receiver_client->header_len >= HEADER_SIZE)
+      receiver_client->header_len = HEADER_SIZE - 1;
+  }
+  receiver_client->header[HEADER_SEQ_OFFSET] = '0' + message->seq_num;
 
-  if (strlen(msg) < 23)
-    return 0;
+  iov[0].iov_base = receiver_client->header;
+  iov[0].iov_len = receiver_client->header_len;
+  if (trace_timestamps) {
+    iov[1].iov_base = stamp;
+    iov[1].iov_len = snprintf(stamp, 32, "TS %lld MSG ", now_usec());
+  } else {
+    iov[1].iov_base = "MSG ";
+    iov[1].iov_len = 4;
+  }
+  room = BUFSIZE - 1 - iov[0].iov_len - iov[1].iov_len;
+  iov[2].iov_base = message->msg;
+  iov[2].iov_len = message->len < room ? message->len : room;
+  return iov[0].iov_len + iov[1].iov_len + iov[2].iov_len;
+}
 
-  strcpy(msg_copy, msg);
-  token = strtok(msg_copy, " ");
-  if (strcmp(token, "PKT"))
-    return 0;
+// Sends a message as a datagram of its own, gathered by the kernel without
+// a copy.
+void transmit_message(struct client* receiver_client, struct message* message, int sockfd,
+                      const char* from_nick) {
+  struct iovec iov[3];
+  char stamp[32];
+  int rc;
 
-  token = strtok(NULL, " ");
-  if (!isdigit(token[0]) || strlen(token) > 1)
-    return 0;
+  gather_message(receiver_client, message, from_nick, iov, stamp);
+  TRACE(message_send, receiver_client->name, message->seq_num, 1,
+        iov[0].iov_len + iov[1].iov_len + iov[2].iov_len);
+  rc = send_packet_iov(sockfd, iov, 3, 0, (struct sockaddr*)&receiver_client->addr,
+                       sizeof(receiver_client->addr));
+  check_error(rc, "send_packet_iov");
+  update_message_info(message);
+}
 
-  token = strtok(NULL, " ");
-  if (strcmp(token, "FROM"))
-    return 0;
+// Sends the messages in the peer's window that are due: the ones not sent
+// yet, or with resend every one not acknowledged. Two or more go out as one
+// burst of datagrams NUL-padded to the same size, which receivers ignore, so
+// the kernel can split it up itself.
+void transmit_window(struct client* receiver_client, int sockfd, const char* from_nick, int resend) {
+  static char burst[MAX_WINDOW * BUFSIZE];
+  struct message* due[MAX_WINDOW];
+  struct message* message = receiver_client->head;
+  struct iovec iov[3];
+  char stamp[32];
+  size_t len[MAX_WINDOW], segment = 0, offset;
+  int count = 0, slot, rc;
+
+  for (slot = 0; message != NULL && slot < window; slot++, message = message->next) {
+    if (slot >= receiver_client->in_flight || (resend && !message->acked)) {
+      if (message->repeat > 0)
+        TRACE(retransmit, receiver_client->name, message->seq_num, message->repeat, usec_since(message->queued));
+      due[count++] = message;
+    }
+  }
+  // A peer is only expected to answer from when it has something to answer.
+  if (liveness_usec > 0 && receiver_client->in_flight == 0)
+    receiver_client->last_heard = monotonic_usec();
+  receiver_client->in_flight = slot;
+
+  if (count == 0)
+    return;
+  if (count == 1) {
+    transmit_message(receiver_client, due[0], sockfd, from_nick);
+    return;
+  }
 
-  token = strtok(NULL, " ");
-  if (token == NULL)
-    return 0;
-  strcpy(from_nick, token);
+  // Each message is gathered into room for the longest, then moved up
+  // against the one before once the longest is known.
+  for (int i = 0; i < count; i++) {
+    len[i] = gather_message(receiver_client, due[i], from_nick, iov, stamp);
+    offset = i * BUFSIZE;
+    for (int j = 0; j < 3; j++) {
+      memcpy(burst + offset, iov[j].iov_base, iov[j].iov_len);
+      offset += iov[j].iov_len;
+    }
+    if (len[i] > segment)
+      segment = len[i];
+    update_message_info(due[i]);
+  }
+  for (int i = 1; i < count; i++)
+    memmove(burst + i * segment, burst + i * BUFSIZE, len[i]);
+  for (int i = 0; i < count - 1; i++)
+    memset(burst + i * segment + len[i], 0, segment - len[i]);
+
+  TRACE(message_send, receiver_client->name, due[0]->seq_num, count, (count - 1) * segment + len[count - 1]);
+  rc = send_packet_segments(sockfd, burst, (count - 1) * segment + len[count - 1], segment, 0,
+                            (struct sockaddr*)&receiver_client->addr, sizeof(receiver_client->addr));
+  check_error(rc, "send_packet_segments");
+}
 
-  token = strtok(NULL, " ");
-  if (strcmp(token, "TO"))
-    return 0;
+// Sends what every peer's window has room for. Messages are only queued as
+// input is read and ACKs are handled, and sent from here once those are
+// done, so the ones for the same peer go out together.
+void fill_windows(struct message_queue* mq, int sockfd, const char* from_nick) {
+  if (!windows_changed)
+    return;
+  windows_changed = 0;
+  for (struct client* current = mq->head; current != NULL; current = current->next) {
+    if (current->in_flight < window && current->size > current->in_flight)
+      transmit_window(current, sockfd, from_nick, 0);
+  }
+}
 
-  token = strtok(NULL, " ");
-  if (token == NULL)
-    return 0;
-  strcpy(to_nick, token);
+void queue_message_to_client(char* msg, struct client* receiver_client, char* to_nick) {
+  msg += strlen(to_nick) + 2; // +1 for the @ and +1 for the whitespace.
+  push_back_message(receiver_client, receiver_client->next_seq_num, msg);
+  advance_client_next_seq_num(receiver_client);
+  receiver_client->last_used = ++peer_clock;
+  windows_changed = 1;
+}
 
-  token = strtok(NULL, " ");
-  if (strcmp(token, "MSG"))
-    return 0;
+double elapsed_ms(struct timespec begin, struct timespec end) {
+  return (end.tv_sec - begin.tv_sec) * 1000.0 + (end.tv_nsec - begin.tv_nsec) / 1000000.0;
+}
 
-  token = strtok(NULL, " ");
-  if (token == NULL)
-    return 0;
+void record_delivery(struct client* client, struct message* message, long long echoed_ts) {
+  struct timespec now;
+  double latency;
+  struct peer_stats* ps = find_peer_stats(client->name);
+  int retransmits = message->repeat - 1;
+
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  latency = elapsed_ms(message->queued, now);
+  TRACE(ack_match, client->name, message->seq_num, retransmits, (long long)(latency * 1000));
+  histogram_add(&stats.latency, latency * 1000);
+  histogram_add(&ps->latency, latency * 1000);
+  if (echoed_ts > 0)
+    histogram_add(&ps->rtt, now_usec() - echoed_ts);
+  ps->retransmits[retransmits < RETRANSMIT_BUCKETS ? retransmits : RETRANSMIT_BUCKETS - 1] += 1;
+  ps->delivered += 1;
+
+  if (stats.delivered == 0 || latency < stats.latency_min)
+    stats.latency_min = latency;
+  if (latency > stats.latency_max)
+    stats.latency_max = latency;
+  stats.latency_sum += latency;
+  stats.delivered += 1;
+}
 
-  return 1;
+// Takes the ACK for any message in the peer's window. The window moves on
+// past the acknowledged messages at its head, and fill_windows sends those
+// it takes in.
+void verify_ack(struct client* client, struct packet* ack) {
+  struct message* message = client->head;
+  int i;
+
+  for (i = 0; i < client->in_flight; i++, message = message->next) {
+    if (!message->acked && compare_seq_nums(ack->seq, message->seq_num))
+      break;
+  }
+  if (i == client->in_flight) {
+    console_log(CONSOLE_WARNING, "RECEIVED OLD ACK\n");
+    return;
+  }
+
+  message->acked = 1;
+  record_delivery(client, message, ack->ts);
+  while (client->head != NULL && client->head->acked)
+    pop_front_message(client);
+  windows_changed = 1;
 }
 
-void send_ack(char* msg, char seq_num, struct sockaddr_in dest_addr, int sockfd) {
-  char ack[ACKSIZE];
+void record_failure(struct client* client) {
+  stats.failed += client->size;
+  find_peer_stats(client->name)->failed += client->size;
+}
+
+void record_one_way_delay(struct packet* pkt) {
+  char from_nick[MAX_NAME_BYTE_SIZE];
+  if (pkt->ts > 0 && slice_copy(from_nick, MAX_NAME_BYTE_SIZE, pkt->from) == 0)
+    histogram_add(&find_peer_stats(from_nick)->one_way, now_usec() - pkt->ts);
+}
+
+// ACKs for the datagrams handled in one wakeup, all to the same peer.
+static struct {
+  struct sockaddr_in addr;
+  int count;
+  size_t len[RECV_BATCH];
+  char ack[RECV_BATCH][ACKSIZE];
+} acks;
+
+// Sends the queued ACKs, two or more as one burst NUL-padded like a window
+// of messages.
+void flush_acks(int sockfd) {
+  char burst[RECV_BATCH * ACKSIZE];
+  size_t segment = 0;
   int rc;
 
-  memset(ack, 0, ACKSIZE);
-  snprintf(ack, ACKSIZE, "ACK %c %s", seq_num, msg);
-  rc = send_packet(sockfd, ack, strlen(ack), 0, (struct sockaddr*)&dest_addr, sizeof(dest_addr));
-  check_error(rc, "send_packet");
+  if (acks.count == 0)
+    return;
+  if (acks.count == 1) {
+    rc = send_packet(sockfd, acks.ack[0], acks.len[0], 0, (struct sockaddr*)&acks.addr, sizeof(acks.addr));
+    check_error(rc, "send_packet");
+    acks.count = 0;
+    return;
+  }
+
+  for (int i = 0; i < acks.count; i++) {
+    if (acks.len[i] > segment)
+      segment = acks.len[i];
+  }
+  memset(burst, 0, acks.count * segment);
+  for (int i = 0; i < acks.count; i++)
+    memcpy(burst + i * segment, acks.ack[i], acks.len[i]);
+  rc = send_packet_segments(sockfd, burst, (acks.count - 1) * segment + acks.len[acks.count - 1], segment, 0,
+                            (struct sockaddr*)&acks.addr, sizeof(acks.addr));
+  check_error(rc, "send_packet_segments");
+  acks.count = 0;
+}
+
+// Queues an ACK for flush_acks. One to another peer sends those queued first.
+void queue_ack(char* msg, char seq_num, long long ts, struct sockaddr_in dest_addr, int sockfd) {
+  char* ack;
+
+  if (acks.count > 0 && (acks.count == RECV_BATCH || acks.addr.sin_port != dest_addr.sin_port ||
+                         acks.addr.sin_addr.s_addr != dest_addr.sin_addr.s_addr))
+    flush_acks(sockfd);
+  acks.addr = dest_addr;
+  ack = acks.ack[acks.count];
+
+  if (ts > 0) // Echo the sender's timestamp so it can time this transmission.
+    snprintf(ack, ACKSIZE, "ACK %c %s TS %lld", seq_num, msg, ts);
+  else
+    snprintf(ack, ACKSIZE, "ACK %c %s", seq_num, msg);
+  acks.len[acks.count++] = strlen(ack);
+  TRACE(reply_send, ntohs(dest_addr.sin_port), seq_num - '0');
 }
 
-void print_message_to_user(char* buf, char* from_nick, char* to_nick,
-                          struct block_list* bl) {
-  if (!is_blocked(bl, from_nick)) {
-    buf += 20 + strlen(from_nick) + strlen(to_nick);
-    printf("%s: %s\n", from_nick, buf);
+// Applies a server reply that arrives outside a blocking lookup: the answer
+// to a background refresh. Only peers still in the table are updated.
+void handle_server_reply(struct packet* pkt, struct message_queue* mq) {
+  struct slice reply_nick, reply_ip, reply_port, entries;
+  char name[MAX_NAME_BYTE_SIZE + 1];
+  char address[INET_ADDRSTRLEN];
+  char port[8];
+  int part, parts;
+  long long lease, refresh;
+
+  if (parse_lease_reply(pkt->text, &lease, &refresh)) {
+    if (refresh > 0)
+      refresh_interval = refresh;
+  } else if (slice_equals(pkt->text, "NOT REGISTERED")) {
+    registration_lost = 1;
+  } else if (parse_batch_reply(pkt->text, &part, &parts, &entries)) {
+    store_batch_entries(entries, mq);
+  } else if (parse_lookup_reply(pkt->text, &reply_nick, &reply_ip, &reply_port) &&
+             slice_copy(name, sizeof(name), reply_nick) == 0 &&
+             slice_copy(address, sizeof(address), reply_ip) == 0 &&
+             slice_copy(port, sizeof(port), reply_port) == 0) {
+    update_client(mq, name, address, port);
+  }
+}
+
+// Applies a presence notice from the server. A peer that moved gets its
+// pending message resent to the new address at once; a peer that is gone
+// fails its pending messages the way a NOT FOUND lookup would.
+void handle_notification(struct packet* pkt, struct message_queue* mq, int sockfd,
+                         struct sockaddr_in server_addr, const char* from_nick) {
+  struct slice notice_nick, notice_ip, notice_port;
+  char name[MAX_NAME_BYTE_SIZE + 1];
+  char address[INET_ADDRSTRLEN];
+  char port[8];
+  struct client* client;
+
+  if (parse_lookup_reply(pkt->text, &notice_nick, &notice_ip, &notice_port) &&
+      slice_copy(name, sizeof(name), notice_nick) == 0 &&
+      slice_copy(address, sizeof(address), notice_ip) == 0 &&
+      slice_copy(port, sizeof(port), notice_port) == 0) {
+    client = find_client(mq, name);
+    if (client == NULL)
+      return;
+    update_client(mq, name, address, port);
+    if (client->head != NULL) {
+      client->head->repeat = 0;
+      transmit_window(client, sockfd, from_nick, 1);
+    }
+  } else if (parse_gone_notice(pkt->text, &notice_nick) &&
+             slice_copy(name, sizeof(name), notice_nick) == 0) {
+    client = find_client(mq, name);
+    if (client == NULL)
+      return;
+    if (client->head != NULL) {
+      console_log(CONSOLE_ERROR, "NICK %s NOT REGISTERED\n", name);
+      record_failure(client);
+    }
+    forget_peer(mq, name, sockfd, server_addr);
+  }
+}
+
+// Pre-populates the peer table from a server introduction, sent when a peer
+// looked us up, so our first reply to it needs no lookup.
+void handle_introduction(struct packet* pkt, struct message_queue* mq, struct block_list* bl,
+                         int sockfd, struct sockaddr_in server_addr) {
+  struct slice intro_nick, intro_ip, intro_port;
+  char name[MAX_NAME_BYTE_SIZE + 1];
+  char address[INET_ADDRSTRLEN];
+  char port[8];
+  char* names[1] = { name };
+
+  if (!parse_lookup_reply(pkt->text, &intro_nick, &intro_ip, &intro_port) ||
+      is_blocked_slice(bl, intro_nick) ||
+      slice_copy(name, sizeof(name), intro_nick) == -1 ||
+      slice_copy(address, sizeof(address), intro_ip) == -1 ||
+      slice_copy(port, sizeof(port), intro_port) == -1)
+    return;
+
+  if (!update_client(mq, name, address, port)) {
+    push_back_client(mq, name, address, port);
+    send_nick_list("SUB", names, 1, sockfd, server_addr);
+  }
+}
+
+void print_message_to_user(struct packet* pkt, struct block_list* bl) {
+  if (!is_blocked_slice(bl, pkt->from)) {
+    console_print("%.*s: %.*s\n", (int)pkt->from.len, pkt->from.ptr, (int)pkt->msg.len, pkt->msg.ptr);
   }
 }
 
@@ -657,56 +1568,411 @@ int calculate_time_interval(time_t begin, time_t end) {
   return end - begin;
 }
 
+// Sends RELAY requests for count messages to to_nick at once, numbered with
+// the digits 0 to count - 1, and sets status[i] to 1 when the server takes
+// message i and to -1 when it refuses it. Requests not answered within the
+// timeout are sent once more and are left at 0 if that goes unanswered too.
+void send_relay_window(struct message** window, int* status, int count, const char* from_nick,
+                       const char* to_nick, int sockfd, struct sockaddr_in server_addr, long seconds) {
+  int rc, ack, len, i, pending = count;
+  fd_set set;
+  struct timeval timeout;
+  char buf[BUFSIZE];
+  char relay[BUFSIZE];
+  struct packet pkt;
+  socklen_t reply_addr_len = sizeof(struct sockaddr_in);
+  struct sockaddr_in reply_addr;
+
+  FD_ZERO(&set);
+
+  for (int repeat = 2; repeat > 0 && pending > 0; repeat--) {
+    for (i = 0; i < count; i++) {
+      if (status[i] != 0)
+        continue;
+      len = snprintf(relay, BUFSIZE, "PKT %d RELAY FROM %s TO %s MSG %s", i, from_nick, to_nick, window[i]->msg);
+      if (len >= BUFSIZE)
+        len = BUFSIZE - 1;
+      rc = send_packet(sockfd, relay, len, 0, (struct sockaddr*)&server_addr, sizeof(server_addr));
+      check_error(rc, "send_packet");
+    }
+
+    timeout.tv_sec = seconds;
+    timeout.tv_usec = 0;
+    do {
+      FD_SET(sockfd, &set);
+      ack = select_packet(FD_SETSIZE, &set, &timeout);
+      check_error(ack, "select");
+      if (!ack)
+        break;
+
+      rc = recv_packet(sockfd, buf, BUFSIZE - 1, 0, (struct sockaddr*)&reply_addr, &reply_addr_len);
+      check_error(rc, "read");
+      buf[rc] = '\0';
+
+      if (ntohs(server_addr.sin_port) != ntohs(reply_addr.sin_port) || // From server port
+          parse_packet(buf, rc, &pkt) != PACKET_ACK)
+        continue;
+      i = pkt.seq - '0';
+      if (i >= count || status[i] != 0)
+        continue;
+      if (slice_equals(pkt.text, "OK"))
+        status[i] = 1;
+      else if (slice_equals(pkt.text, "RELAY FULL") || slice_equals(pkt.text, "WRONG NAME"))
+        status[i] = -1;
+      else
+        continue; // A late answer to some other request
+      pending -= 1;
+    } while (pending > 0 && (timeout.tv_sec > 0 || timeout.tv_usec > 0));
+  }
+}
+
+// Hands the messages still queued for an unreachable peer to the server,
+// which delivers them when the peer next registers. RELAY_WINDOW of them go
+// out per round trip. Relaying stops at the first message the server does
+// not take; it and the ones after it stay queued and count as failed.
+void relay_pending_messages(struct client* client, int sockfd, struct sockaddr_in server_addr,
+                            long seconds, const char* from_nick) {
+  struct message* window[RELAY_WINDOW];
+  int status[RELAY_WINDOW];
+  struct message* message;
+  int count, taken;
+
+  do {
+    count = 0;
+    for (message = client->head; message != NULL && count < RELAY_WINDOW; message = message->next) {
+      window[count] = message;
+      status[count++] = 0;
+    }
+    send_relay_window(window, status, count, from_nick, client->name, sockfd, server_addr, seconds);
+    for (taken = 0; taken < count && status[taken] == 1; taken++) {
+      pop_front_message(client);
+      stats.relayed += 1;
+    }
+  } while (count > 0 && taken == count);
+
+  if (client->head == NULL)
+    console_log(CONSOLE_WARNING, "MESSAGES TO %s RELAYED BY SERVER\n", client->name);
+}
+
 void check_message_timeouts(struct message_queue* mq, long timeout, int sockfd,
                             struct sockaddr_in server_addr, const char* from_nick) {
   time_t current_time = time(NULL);
   struct client* current = mq->head;
   struct client* temp;
+  int lookup_code;
   // char fake_ack[ACKSIZE];
 
   while (current != NULL) {
     temp = current;
     current = current->next;
 
-    if (temp->head != NULL &&
+    if (temp->head != NULL && temp->head->repeat > 0 &&
         calculate_time_interval(temp->head->last_time_sent, current_time) >= timeout) {
 
       if (temp->head->repeat == 2) {
-        if (send_lookup_to_server(temp->name, sockfd, server_addr, timeout, mq) > 0) {
-          send_message_to_client(NULL, temp, sockfd, from_nick, temp->name);
+        lookup_code = send_lookup_to_server(temp->name, sockfd, server_addr, timeout, mq);
+        if (lookup_code > 0) {
+          transmit_window(temp, sockfd, from_nick, 1);
         } else {
-          fprintf(stderr, "NICK %s NOT REGISTERED\n", temp->name);
-          pop_client(mq, temp->name);
+          if (lookup_code == 0)
+            push_back_negative_entry(temp->name);
+          console_log(CONSOLE_ERROR, "NICK %s NOT REGISTERED\n", temp->name);
+          if (relay_mode && lookup_code == 0)
+            relay_pending_messages(temp, sockfd, server_addr, timeout, from_nick);
+          record_failure(temp);
+          forget_peer(mq, temp->name, sockfd, server_addr);
         }
       } else if (temp->head->repeat == 4) {
-        fprintf(stderr, "NICK %s UNREACHABLE\n", temp->name);
-        pop_client(mq, temp->name);
+        console_log(CONSOLE_ERROR, "NICK %s UNREACHABLE\n", temp->name);
+        if (relay_mode)
+          relay_pending_messages(temp, sockfd, server_addr, timeout, from_nick);
+        record_failure(temp);
+        forget_peer(mq, temp->name, sockfd, server_addr);
       } else {
-        send_message_to_client(NULL, temp, sockfd, from_nick, temp->name);
+        transmit_window(temp, sockfd, from_nick, 1);
       }
 
     }
   }
 }
 
+void send_probe(struct client* client, int sockfd, long long now) {
+  char probe[] = "PKT 0 PING";
+  int rc;
+
+  rc = send_packet(sockfd, probe, sizeof(probe) - 1, 0, (struct sockaddr*)&client->addr, sizeof(client->addr));
+  check_error(rc, "send_packet");
+  client->last_probe = now;
+  liveness_stats.probes += 1;
+}
+
+// Probes the peers with messages in flight that have gone quiet, a PING
+// every LIVENESS_PROBES-th of the liveness bound, and gives up on one that
+// answers nothing for all of it. Its nick is looked up again straight away:
+// at a new address its messages are resent there, otherwise they fail, or
+// are relayed, without waiting out the retransmit timeouts.
+void check_liveness(struct message_queue* mq, int sockfd, struct sockaddr_in server_addr, long seconds,
+                    const char* from_nick) {
+  long long now = monotonic_usec();
+  long long interval = liveness_usec / LIVENESS_PROBES;
+  struct client* current = mq->head;
+  struct client* temp;
+  struct sockaddr_in old_addr;
+  int lookup_code;
+
+  while (current != NULL) {
+    temp = current;
+    current = current->next;
+
+    if (temp->in_flight == 0 || now - temp->last_heard < interval)
+      continue;
+    if (now - temp->last_heard < liveness_usec) {
+      if (now - temp->last_probe >= interval)
+        send_probe(temp, sockfd, now);
+      continue;
+    }
+
+    old_addr = temp->addr;
+    lookup_code = send_lookup_to_server(temp->name, sockfd, server_addr, seconds, mq);
+    if (lookup_code > 0 && (temp->addr.sin_port != old_addr.sin_port ||
+                            temp->addr.sin_addr.s_addr != old_addr.sin_addr.s_addr)) {
+      liveness_stats.moved += 1;
+      temp->last_heard = monotonic_usec();
+      temp->head->repeat = 0;
+      transmit_window(temp, sockfd, from_nick, 1);
+      continue;
+    }
+
+    liveness_stats.failed += 1;
+    if (lookup_code == 0)
+      push_back_negative_entry(temp->name);
+    else
+      console_log(CONSOLE_ERROR, "NICK %s UNREACHABLE\n", temp->name);
+    if (relay_mode)
+      relay_pending_messages(temp, sockfd, server_addr, seconds, from_nick);
+    record_failure(temp);
+    forget_peer(mq, temp->name, sockfd, server_addr);
+  }
+}
+
+// Renews the registration every refresh interval with a compact "PKT s HB
+// nick". A server that lost the registration answers NOT REGISTERED, and the
+// full REG goes out on the next tick instead.
 int send_heartbeat(time_t heartbeat, int sockfd, struct sockaddr_in server_addr,
                     const char* nick) {
-  if (calculate_time_interval(heartbeat, time(NULL)) > HEARTBEAT) {
-    int rc;
+  if (registration_lost || calculate_time_interval(heartbeat, time(NULL)) >= refresh_interval) {
+    int rc, len;
     int max_reg_size = 32;
     char registration[max_reg_size];
 
     memset(registration, 0, max_reg_size);
-    snprintf(registration, max_reg_size, "PKT %d REG %s", server_seq_num, nick);
-    rc = send_packet(sockfd, registration, max_reg_size, 0, (struct sockaddr*)&server_addr, sizeof(server_addr));
+    if (registration_lost) {
+      snprintf(registration, max_reg_size, "PKT %d REG %s", server_seq_num, nick);
+      len = max_reg_size;
+      registration_lost = 0;
+    } else {
+      len = snprintf(registration, max_reg_size, "PKT %d HB %s", server_seq_num, nick);
+    }
+    rc = send_packet(sockfd, registration, len, 0, (struct sockaddr*)&server_addr, sizeof(server_addr));
     check_error(rc, "send_packet");
     return 1;
   }
   return 0;
 }
 
-int main(int argc, char const *argv[]) {
-  int so, rc;
+int handle_user_input(char* buf, int sockfd, struct sockaddr_in server_addr, long seconds,
+                      const char* nick, struct message_queue* mq, struct block_list* bl) {
+  // return 1 = Exit
+  int rc, input_code, lookup_code;
+  struct client* receiver_client;
+  char nick_lookup[MAX_NAME_BYTE_SIZE];
+
+  input_code = check_user_input(buf);
+  if (input_code == 1) { // 1 = Valid message
+    extract_nickname(nick_lookup, buf);
+
+    if (is_blocked(bl, nick_lookup)) {
+      console_log(CONSOLE_ERROR, "RECIPIENT IS ON YOUR BLOCKLIST\n");
+      stats.rejected += 1;
+    } else {
+      receiver_client = find_client(mq, nick_lookup);
+
+      if (receiver_client != NULL && receiver_client->expires > time(NULL)) {
+        cache_stats.hits += 1;
+        receiver_client->used = 1;
+        queue_message_to_client(buf, receiver_client, nick_lookup);
+      } else if (is_negatively_cached(nick_lookup)) {
+        cache_stats.negative_hits += 1;
+        console_log(CONSOLE_ERROR, "NICK %s NOT REGISTERED\n", nick_lookup);
+        stats.rejected += 1;
+      } else {
+        cache_stats.misses += 1;
+        fill_windows(mq, sockfd, nick); // Not held up by the lookup
+        lookup_code = send_lookup_to_server(nick_lookup, sockfd, server_addr, seconds, mq);
+        // An expired address beats none at all while the server is silent.
+        if (lookup_code == 1 || (lookup_code == -1 && receiver_client != NULL)) {
+          receiver_client = find_client(mq, nick_lookup);
+          receiver_client->used = 1;
+          queue_message_to_client(buf, receiver_client, nick_lookup);
+        } else if (lookup_code == -1) {
+          console_log(CONSOLE_ERROR, "NO ACKNOWLEDGEMENT FROM SERVER. EXITING\n");
+          return 1;
+        } else {
+          push_back_negative_entry(nick_lookup);
+          stats.rejected += 1;
+        }
+      }
+    }
+
+  } else if (input_code == 0) { // 0 = QUIT
+    return 1;
+  } else if (input_code == 69) { // Remember to remove.
+    char* quit = "quit";
+    rc = sendto(sockfd, quit, strlen(quit), 0, (struct sockaddr*)&server_addr, sizeof(server_addr));
+    check_error(rc, "sendto");
+  } else if (input_code == 2) { // 2 = Block
+    extract_nickname_to_block(nick_lookup, buf);
+    add_block(bl, nick_lookup);
+    receiver_client = find_client(mq, nick_lookup);
+    if (receiver_client != NULL) {
+      record_failure(receiver_client);
+      forget_peer(mq, nick_lookup, sockfd, server_addr);
+    }
+  } else if (input_code == 3) { // 3 = Unblock
+    extract_nickname_to_block(nick_lookup, buf);
+    remove_block(bl, nick_lookup);
+  } else if (input_code == 4) { // 4 = Stats
+    console_flush();
+    print_stats(stdout);
+  } else { // Error
+    console_log(CONSOLE_ERROR, "WRONG FORMAT\n");
+    stats.rejected += 1;
+  }
+
+  return 0;
+}
+
+static char batch_buf[BATCH_BUFSIZE];
+static size_t batch_len;
+static size_t batch_pos;
+static int batch_eof;
+
+void fill_batch_buffer() {
+  ssize_t rc;
+
+  memmove(batch_buf, batch_buf + batch_pos, batch_len - batch_pos);
+  batch_len -= batch_pos;
+  batch_pos = 0;
+
+  rc = read(STDIN_FILENO, batch_buf + batch_len, BATCH_BUFSIZE - batch_len);
+  check_error(rc, "read");
+  if (rc == 0)
+    batch_eof = 1;
+  batch_len += rc;
+}
+
+int next_batch_line(char* buf, int size) {
+  // Copies the next complete line out of the batch buffer. A full buffer
+  // without a newline, or the trailing bytes at EOF, count as a line.
+  char* line = batch_buf + batch_pos;
+  char* end = memchr(line, '\n', batch_len - batch_pos);
+  size_t line_len;
+
+  if (end != NULL)
+    line_len = end - line;
+  else if ((batch_eof || (batch_pos == 0 && batch_len == BATCH_BUFSIZE)) && batch_pos < batch_len)
+    line_len = batch_len - batch_pos;
+  else
+    return 0;
+
+  batch_pos += line_len + (end != NULL);
+  if (line_len > 0 && line[line_len - 1] == '\r')
+    line_len--;
+  if (line_len > (size_t)size - 1)
+    line_len = size - 1;
+  memcpy(buf, line, line_len);
+  buf[line_len] = '\0';
+  return 1;
+}
+
+int messages_in_flight() {
+  return stats.queued - stats.delivered - stats.failed - stats.relayed;
+}
+
+void print_batch_report() {
+  struct timespec now;
+  double seconds;
+
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  seconds = elapsed_ms(stats.start, now) / 1000.0;
+  printf("BATCH: %d queued, %d delivered, %d failed, %d relayed, %d rejected in %.3f s\n",
+          stats.queued, stats.delivered, stats.failed, stats.relayed, stats.rejected, seconds);
+  if (seconds > 0)
+    printf("BATCH: %.1f messages/sec\n", stats.delivered / seconds);
+  if (stats.delivered > 0) {
+    printf("BATCH: latency min %.3f ms avg %.3f ms max %.3f ms\n",
+            stats.latency_min, stats.latency_sum / stats.delivered, stats.latency_max);
+    printf("BATCH: latency p50 %.3f ms p90 %.3f ms p99 %.3f ms\n",
+            histogram_percentile(&stats.latency, 50) / 1000.0,
+            histogram_percentile(&stats.latency, 90) / 1000.0,
+            histogram_percentile(&stats.latency, 99) / 1000.0);
+  }
+}
+
+void handle_datagram(char* buf, int len, struct sockaddr_in addr, int sockfd, struct sockaddr_in server_addr,
+                     const char* nick, struct message_queue* mq, struct block_list* bl) {
+  unsigned short serverport = ntohs(server_addr.sin_port);
+  struct client* sender_client;
+  struct packet pkt;
+
+  parse_packet(buf, len, &pkt);
+  TRACE(parse_done, ntohs(addr.sin_port), pkt.seq - '0', pkt.type);
+  if (pkt.type == PACKET_ACK) {
+    sender_client = find_client_by_port(mq, ntohs(addr.sin_port));
+    if (is_server_port(ntohs(addr.sin_port), serverport)) {
+      // Heartbeat and subscription ACKs, and background refresh replies.
+      handle_server_reply(&pkt, mq);
+    } else if (sender_client == NULL)
+      console_log(CONSOLE_WARNING, "RECEIVED ACK FROM UNKNOWN SENDER\n");
+    else {
+      sender_client->last_used = ++peer_clock;
+      if (liveness_usec > 0)
+        sender_client->last_heard = monotonic_usec();
+      // A peer that does not know PING answers it with WRONG FORMAT, which
+      // says as much about whether it is there.
+      if (slice_equals(pkt.text, "PONG") || slice_equals(pkt.text, "WRONG FORMAT"))
+        liveness_stats.answered += 1;
+      else
+        verify_ack(sender_client, &pkt);
+    }
+
+  } else if (pkt.type == PACKET_PING) {
+    queue_ack("PONG", pkt.seq, 0, addr, sockfd);
+  } else if (pkt.type == PACKET_MSG) {
+    if (liveness_usec > 0 && (sender_client = find_client_by_port(mq, ntohs(addr.sin_port))) != NULL)
+      sender_client->last_heard = monotonic_usec();
+    if (slice_equals(pkt.to, nick)) {
+      record_one_way_delay(&pkt);
+      print_message_to_user(&pkt, bl);
+      queue_ack("OK", pkt.seq, pkt.ts, addr, sockfd);
+    } else {
+      console_log(CONSOLE_WARNING, "RECEIVED MESSAGE WITH WRONG NAME\n");
+      queue_ack("WRONG NAME", pkt.seq, pkt.ts, addr, sockfd);
+    }
+  } else if (pkt.type == PACKET_NOTIFY) {
+    if (ntohs(addr.sin_port) == serverport)
+      handle_notification(&pkt, mq, sockfd, server_addr, nick);
+  } else if (pkt.type == PACKET_INTRO) {
+    if (is_server_port(ntohs(addr.sin_port), serverport))
+      handle_introduction(&pkt, mq, bl, sockfd, server_addr);
+  } else {
+    console_log(CONSOLE_WARNING, "RECEIVED INVALID MESSAGE FORMAT\n");
+    queue_ack("WRONG FORMAT", buf[4], 0, addr, sockfd);
+  }
+}
+
+int main(int argc, char* const argv[]) {
+  int so, rc, ready, opt;
   long seconds;
   unsigned short serverport;
   fd_set set;
@@ -716,17 +1982,87 @@ int main(int argc, char const *argv[]) {
   const char* nick;
   const char* server_ip_address;
   struct message_queue* mq;
-  time_t heartbeat;
+  time_t heartbeat, next_tick, next_dump;
+  long long next_liveness_check = 0;
+  const char* netem_spec = NULL;
+  const char* contacts_file = NULL;
+  const char* io_backend = NULL;
+  const char* log_level = NULL;
   struct block_list* bl;
 
+  while ((opt = getopt(argc, argv, "bts:n:p:rR:i:l:w:k:m:")) != -1) {
+    if (opt == 'b') {
+      batch_mode = 1;
+    } else if (opt == 't') {
+      trace_timestamps = 1;
+    } else if (opt == 's') {
+      stats_file = optarg;
+    } else if (opt == 'n') {
+      netem_spec = optarg;
+    } else if (opt == 'p') {
+      contacts_file = optarg;
+    } else if (opt == 'r') {
+      relay_mode = 1;
+    } else if (opt == 'i') {
+      io_backend = optarg;
+    } else if (opt == 'l') {
+      log_level = optarg;
+    } else if (opt == 'w') {
+      window = atoi(optarg);
+      if (window < 1 || window > MAX_WINDOW) {
+        fprintf(stderr, "INVALID WINDOW\n");
+        exit(EXIT_FAILURE);
+      }
+    } else if (opt == 'k') {
+      liveness_usec = atof(optarg) * 1000;
+      if (liveness_usec < LIVENESS_PROBES) {
+        fprintf(stderr, "INVALID LIVENESS BOUND\n");
+        exit(EXIT_FAILURE);
+      }
+    } else if (opt == 'm') {
+      peer_table_max = atoi(optarg);
+      if (peer_table_max < 1) {
+        fprintf(stderr, "INVALID PEER TABLE SIZE\n");
+        exit(EXIT_FAILURE);
+      }
+    } else if (opt == 'R') {
+      if (set_replicas(optarg) == -1) {
+        fprintf(stderr, "INVALID REPLICA LIST\n");
+        exit(EXIT_FAILURE);
+      }
+    } else {
+      argc = 0;
+    }
+  }
+  argc -= optind - 1;
+  argv += optind - 1;
+
   if (argc < 6) {
-      printf("Usage: ./upush_client <nick> <ip-address> <port> <timeout> <loss_probability>\n");
+      printf("Usage: ./upush_client [-b] [-t] [-s <stats_file>] [-n <netem_spec>] [-p <contacts_file>] [-r] [-R <replicas>] [-i <io_backend>] [-l <log_level>] [-w <window>] [-k <ms>] [-m <peers>] <nick> <ip-address> <port> <timeout> <loss_probability>\n");
+      printf("  -b  batch mode: send every \"@nick text\" line from stdin, then report throughput\n");
+      printf("  -t  carry send timestamps in messages to measure round trips (peers on the old version reject them)\n");
+      printf("  -s  rewrite per-peer latency and retransmit histograms to a file every %d s\n", STATS_DUMP_INTERVAL);
+      printf("  -n  emulate the network behind send_packet, e.g. delay=20,jitter=5,ge=1:30:0:50\n");
+      printf("  -p  look up every nick in a file, one per line, in batches at startup\n");
+      printf("  -r  hand messages for unreachable peers to the server to deliver later\n");
+      printf("  -R  send lookups to these read replicas of the server, e.g. 127.0.0.1:2010,127.0.0.1:2011\n");
+      printf("  -i  I/O backend: select (default), epoll or uring; uring falls back to epoll where unsupported\n");
+      printf("  -l  most verbose output: error, warning, info (default) or debug, which shows raw lookup replies\n");
+      printf("  -w  messages to a peer sent before waiting for ACKs, 1 (default) to %d, in one burst where the\n"
+             "      kernel can segment it; a lost message can then be shown after the ones sent behind it\n", MAX_WINDOW);
+      printf("  -k  give up on a peer that answers nothing, PINGs included, for this many ms while messages to\n"
+             "      it are in flight, and look it up again at once instead of waiting out the retransmit timeouts\n");
+      printf("  -m  peers kept, %d by default; the least recently used with nothing queued are forgotten, and\n"
+             "      per-peer stats are kept for as many nicks\n", PEER_TABLE_MAX);
       return 0;
   }
   // valgrind ./upush_client KRISTIAN 127.0.0.1 2000 10 10
   // valgrind ./upush_client ALICE 127.0.0.1 2000 5 10
   // valgrind ./upush_client BOB 127.0.0.1 2000 1 10
   // valgrind ./upush_client RETARD 127.0.0.1 2000 3 10
+  // ./upush_client -b ALICE 127.0.0.1 2000 1 0 < messages.txt
+  // ./upush_client -p contacts.txt ALICE 127.0.0.1 2000 1 0
+  // ./upush_client -R 127.0.0.1:2010 ALICE 127.0.0.1 2000 1 0
 
   server_seq_num = 0;
 
@@ -739,9 +2075,28 @@ int main(int argc, char const *argv[]) {
   seconds = atoi(argv[4]);
 
   set_loss_probability(atoi(argv[5]));
+  if (log_level != NULL && console_set_level(log_level) == -1) {
+    fprintf(stderr, "INVALID LOG LEVEL\n");
+    exit(EXIT_FAILURE);
+  }
+  if (io_backend != NULL && set_io_backend(io_backend) == -1) {
+    fprintf(stderr, "IO BACKEND %s UNAVAILABLE, FALLING BACK TO epoll\n", io_backend);
+    set_io_backend("epoll");
+  }
+  if (netem_spec != NULL && set_network_emulation(netem_spec) == -1) {
+    fprintf(stderr, "INVALID NETWORK EMULATION SPEC\n");
+    exit(EXIT_FAILURE);
+  }
+
+  // From here on output is written by a thread of its own, so a slow
+  // terminal does not hold up ACKs and retransmissions.
+  if (console_start() == -1)
+    console_log(CONSOLE_WARNING, "CONSOLE THREAD UNAVAILABLE, WRITING DIRECTLY\n");
 
   so = socket(AF_INET, SOCK_DGRAM, 0);
   check_error(so, "socket");
+  if (set_segmentation(so) == -1)
+    console_log(CONSOLE_DEBUG, "UDP SEGMENTATION OFFLOAD UNAVAILABLE\n");
 
   //inet_pton(AF_INET, IP, &my_ip);
   inet_pton(AF_INET, server_ip_address, &server_ip);
@@ -765,117 +2120,128 @@ int main(int argc, char const *argv[]) {
 
   mq = create_message_queue();
   bl = create_block_list();
-  FD_ZERO(&set);
+  if (contacts_file != NULL)
+    prefetch_contacts(contacts_file, nick, so, server_addr, seconds, mq);
   buf[0] = '\0';
-  printf("How to quit: QUIT\n");
-  printf("How to send message: @nickname <message>\n");
-  printf("How to block: BLOCK <nickname>\n");
-  printf("How to unblock: UNBLOCK <nickname>\n");
+  if (!batch_mode) {
+    console_print("How to quit: QUIT\n");
+    console_print("How to send message: @nickname <message>\n");
+    console_print("How to block: BLOCK <nickname>\n");
+    console_print("How to unblock: UNBLOCK <nickname>\n");
+    console_print("How to show delivery statistics: STATS\n");
+  }
+  clock_gettime(CLOCK_MONOTONIC, &stats.start);
   // char lookup[LOOKUPSIZE];
   // char* token;
   // char* receiver_nick;
   // char msg[BUFSIZE];
-  struct timeval timeout;
-  struct client* receiver_client;
-  struct client* sender_client;
-  int input_code;
-  char nick_lookup[MAX_NAME_BYTE_SIZE];
-  int lookup_code;
-  char from_nick[MAX_NAME_BYTE_SIZE];
-  char to_nick[MAX_NAME_BYTE_SIZE];
+  struct timeval timeout, wait, waited;
+  long long until_check;
   timeout.tv_sec = MAIN_LOOP_DOWNTIME;
   timeout.tv_usec = 0;
+  next_tick = time(NULL) + MAIN_LOOP_DOWNTIME;
+  next_dump = time(NULL) + STATS_DUMP_INTERVAL;
   int exit = 0;
   while (!exit) {
-    fflush(NULL);
-    FD_SET(STDIN_FILENO, &set);
+    FD_ZERO(&set);
+    if (batch_mode) {
+      while (!exit && messages_in_flight() < BATCH_MAX_QUEUED && next_batch_line(buf, BUFSIZE)) {
+        if (buf[0] != '\0')
+          exit = handle_user_input(buf, so, server_addr, seconds, nick, mq, bl);
+      }
+      if (batch_eof && batch_pos == batch_len && messages_in_flight() == 0)
+        exit = 1;
+      if (exit)
+        break;
+      if (!batch_eof && messages_in_flight() < BATCH_MAX_QUEUED)
+        FD_SET(STDIN_FILENO, &set);
+    } else {
+      FD_SET(STDIN_FILENO, &set);
+    }
     FD_SET(so, &set);
-    rc = select(FD_SETSIZE, &set, NULL, NULL, &timeout);
-    check_error(rc, "select");
+    fill_windows(mq, so, nick);
+
+    // Liveness is checked twice a probe interval, so a peer is given up on
+    // at most half an interval past the bound, without the timeouts below
+    // running any more often.
+    wait = timeout;
+    if (liveness_usec > 0) {
+      until_check = next_liveness_check - monotonic_usec();
+      if (until_check < 0)
+        until_check = 0;
+      if (until_check < wait.tv_sec * 1000000LL + wait.tv_usec) {
+        wait.tv_sec = until_check / 1000000;
+        wait.tv_usec = until_check % 1000000;
+      }
+    }
+    waited = wait;
+    ready = select_packet(FD_SETSIZE, &set, &wait);
+    check_error(ready, "select");
+    timersub(&waited, &wait, &waited);
+    timersub(&timeout, &waited, &timeout);
 
     if (FD_ISSET(STDIN_FILENO, &set)) {
-        get_string(buf, BUFSIZE);
-        //printf("You wrote: %s\n", buf);
-
-        input_code = check_user_input(buf);
-        if (input_code == 1) { // 1 = Valid message
-          extract_nickname(nick_lookup, buf);
-
-          if (is_blocked(bl, nick_lookup)) {
-            fprintf(stderr, "RECIPIENT IS ON YOUR BLOCKLIST\n");
-          } else {
-            receiver_client = find_client(mq, nick_lookup);
-
-            if (receiver_client == NULL) {
-              lookup_code = send_lookup_to_server(nick_lookup, so, server_addr, seconds, mq);
-              if (lookup_code == 1) {
-                receiver_client = find_client(mq, nick_lookup);
-                send_message_to_client(buf, receiver_client, so, nick, nick_lookup);
-              } else if (lookup_code == -1) {
-                fprintf(stderr, "NO ACKNOWLEDGEMENT FROM SERVER. EXITING\n");
-                exit = 1;
-              }
-
-            } else {
-              send_message_to_client(buf, receiver_client, so, nick, nick_lookup);
-            }
-          }
-
-        } else if (input_code == 0) { // 0 = QUIT
-          exit = 1;
-        } else if (input_code == 69) { // Remember to remove.
-          char* quit = "quit";
-          rc = sendto(so, quit, strlen(quit), 0, (struct sockaddr*)&server_addr, sizeof(server_addr));
-          check_error(rc, "sendto");
-        } else if (input_code == 2) { // 2 = Block
-          extract_nickname_to_block(nick_lookup, buf);
-          add_block(bl, nick_lookup);
-          pop_client(mq, nick_lookup);
-        } else if (input_code == 3) { // 3 = Unblock
-          extract_nickname_to_block(nick_lookup, buf);
-          remove_block(bl, nick_lookup);
-        } else { // Error
-          fprintf(stderr, "WRONG FORMAT\n");
-        }
+      if (batch_mode) {
+        fill_batch_buffer();
+      } else if (get_string(buf, BUFSIZE)) {
+        exit = handle_user_input(buf, so, server_addr, seconds, nick, mq, bl);
+      } else {
+        exit = 1;
+      }
+    }
 
-    } else if (FD_ISSET(so, &set)) {
-        rc = recvfrom(so, buf, BUFSIZE - 1, 0, (struct sockaddr*)&dest_addr, &dest_addr_len);
+    // Everything that has arrived is handled before anything is sent, so the
+    // ACKs to a peer, and the messages they make room for, go out together.
+    if (FD_ISSET(so, &set)) {
+      for (int i = 0; i < RECV_BATCH; i++) {
+        rc = recv_packet(so, buf, BUFSIZE - 1, i == 0 ? 0 : MSG_DONTWAIT, (struct sockaddr*)&dest_addr,
+                         &dest_addr_len);
+        if (rc == -1 && i > 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+          break;
         check_error(rc, "read");
         buf[rc] = '\0';
-        //printf("%s\n", buf);
-
-        if (is_ack(buf)) {
-          sender_client = find_client_by_port(mq, ntohs(dest_addr.sin_port));
-          if (ntohs(dest_addr.sin_port) == serverport) {
-            // printf("RECEIVED ACK FROM SERVER\n");
-            // Debug, Expected to occur when timeout = 0 and after sending heartbeats
-          } else if (sender_client == NULL)
-            fprintf(stderr, "RECEIVED ACK FROM UNKNOWN SENDER\n");
-          else
-            verify_ack(sender_client, buf, so, nick);
-
-        } else if (is_valid_message_format(buf, from_nick, to_nick)) {
-          if (!strcmp(to_nick, nick)) {
-            print_message_to_user(buf, from_nick, to_nick, bl);
-            send_ack("OK", buf[4], dest_addr, so);
-          } else {
-            fprintf(stderr, "RECEIVED MESSAGE WITH WRONG NAME\n");
-            send_ack("WRONG NAME", buf[4], dest_addr, so);
-          }
-        } else {
-          fprintf(stderr, "RECEIVED INVALID MESSAGE FORMAT\n");
-          send_ack("WRONG FORMAT", buf[4], dest_addr, so);
-        }
-    } else { // Timeout
+        TRACE(datagram_receive, ntohs(dest_addr.sin_port), rc);
+        handle_datagram(buf, rc, dest_addr, so, server_addr, nick, mq, bl);
+      }
+      flush_acks(so);
+    }
+    trim_peers(mq, so, server_addr);
+
+    if (liveness_usec > 0 && monotonic_usec() >= next_liveness_check) {
+      check_liveness(mq, so, server_addr, seconds, nick);
+      next_liveness_check = monotonic_usec() + liveness_usec / LIVENESS_PROBES / 2;
+    }
+
+    if (!timerisset(&timeout) || time(NULL) >= next_tick) { // Timeout
       timeout.tv_sec = MAIN_LOOP_DOWNTIME;
-      if (send_heartbeat(heartbeat, so, server_addr, nick))
+      timeout.tv_usec = 0;
+      next_tick = time(NULL) + MAIN_LOOP_DOWNTIME;
+      if (send_heartbeat(heartbeat, so, server_addr, nick)) {
         heartbeat = time(NULL);
+        subscribe_peers(mq, so, server_addr);
+      }
       check_message_timeouts(mq, seconds, so, server_addr, nick);
+      refresh_peers(mq, so, server_addr);
+      if (stats_file != NULL && time(NULL) >= next_dump) {
+        dump_stats();
+        next_dump = time(NULL) + STATS_DUMP_INTERVAL;
+      }
     }
   }
 
+  console_stop();
+  if (batch_mode) {
+    print_batch_report();
+    print_console_stats(stdout);
+  }
+  if (stats_file != NULL)
+    dump_stats();
+
   destroy_block_list(bl);
   destroy_message_queue(mq);
+  destroy_peer_stats();
+  destroy_negative_cache();
+  flush_packets();
   close(so);
   return EXIT_SUCCESS;
 }
@@ -0,0 +1,359 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <poll.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <arpa/inet.h>
+
+#include "capture.h"
+#include "parse_packet.h"
+
+#define BUFSIZE 1401
+#define MAX_PENDING 256
+#define POLL_EVERY 32
+#define DRAIN_TIME_MS 1000
+#define REGRESSION_TOLERANCE 0.10
+
+struct source {
+  uint32_t addr;
+  uint16_t port;
+  int sockfd;
+  int pending;
+  char pending_seq[MAX_PENDING];
+  long long pending_usec[MAX_PENDING];
+};
+
+struct datagram {
+  long long usec;
+  int source;
+  int expects_reply;
+  char seq;
+  uint16_t len;
+  char* data;
+};
+
+struct replay {
+  int size;
+  int capacity;
+  struct datagram* datagrams;
+  int sources_size;
+  int sources_capacity;
+  struct source* sources;
+  struct pollfd* fds;
+  int expected;
+  int replies;
+  int latencies_size;
+  long long* latencies;
+};
+
+struct report {
+  double rate;
+  long long p99;
+  double reply_ratio;
+};
+
+void check_error(int i, char* msg) {
+  if (i == -1) {
+    perror(msg);
+    exit(EXIT_FAILURE);
+  }
+}
+
+long long now_usec() {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return now.tv_sec * 1000000LL + now.tv_nsec / 1000;
+}
+
+int compare_latencies(const void* a, const void* b) {
+  long long x = *(const long long*)a;
+  long long y = *(const long long*)b;
+  return (x > y) - (x < y);
+}
+
+long long percentile(struct replay* r, int percent) {
+  if (r->latencies_size == 0)
+    return 0;
+  int rank = (r->latencies_size * percent + 99) / 100;
+  return r->latencies[rank > 0 ? rank - 1 : 0];
+}
+
+int find_source(struct replay* r, uint32_t addr, uint16_t port) {
+  // Every original source gets its own socket, so the server still sees the
+  // same client behind each registration, only on a kernel-chosen port.
+  struct sockaddr_in any;
+  int fd;
+
+  for (int i = 0; i < r->sources_size; i++) {
+    if (r->sources[i].addr == addr && r->sources[i].port == port)
+      return i;
+  }
+
+  if (r->sources_size == r->sources_capacity) {
+    r->sources_capacity = r->sources_capacity ? r->sources_capacity * 2 : 16;
+    r->sources = realloc(r->sources, r->sources_capacity * sizeof(struct source));
+  }
+
+  fd = socket(AF_INET, SOCK_DGRAM, 0);
+  check_error(fd, "socket");
+  memset(&any, 0, sizeof(any));
+  any.sin_family = AF_INET;
+  check_error(bind(fd, (struct sockaddr*)&any, sizeof(any)), "bind");
+
+  memset(&r->sources[r->sources_size], 0, sizeof(struct source));
+  r->sources[r->sources_size].addr = addr;
+  r->sources[r->sources_size].port = port;
+  r->sources[r->sources_size].sockfd = fd;
+  return r->sources_size++;
+}
+
+void load_capture(struct replay* r, const char* path) {
+  struct capture_record rec;
+  struct datagram* d;
+  struct packet pkt;
+  static char buf[UINT16_MAX];
+  FILE* file = capture_open_read(path);
+
+  if (file == NULL) {
+    fprintf(stderr, "%s: NOT A CAPTURE FILE\n", path);
+    exit(EXIT_FAILURE);
+  }
+
+  while (capture_read(file, &rec, buf)) {
+    if (rec.len == 4 && !memcmp(buf, "quit", 4)) // Would stop the server under test.
+      continue;
+
+    if (r->size == r->capacity) {
+      r->capacity = r->capacity ? r->capacity * 2 : 1024;
+      r->datagrams = realloc(r->datagrams, r->capacity * sizeof(struct datagram));
+    }
+
+    d = &r->datagrams[r->size++];
+    d->usec = rec.usec;
+    d->source = find_source(r, rec.addr, rec.port);
+    d->len = rec.len;
+    d->data = malloc(rec.len);
+    memcpy(d->data, buf, rec.len);
+    parse_packet(buf, rec.len, &pkt);
+    d->expects_reply = pkt.type == PACKET_REG || pkt.type == PACKET_HB || pkt.type == PACKET_LOOKUP;
+    d->seq = pkt.seq;
+  }
+  fclose(file);
+
+  r->fds = malloc(r->sources_size * sizeof(struct pollfd));
+  for (int i = 0; i < r->sources_size; i++) {
+    r->fds[i].fd = r->sources[i].sockfd;
+    r->fds[i].events = POLLIN;
+  }
+  r->latencies = malloc((r->size + 1) * sizeof(long long));
+}
+
+void match_reply(struct replay* r, struct source* src, char seq) {
+  // Replies are matched to the oldest outstanding request with the same
+  // sequence number from the same source.
+  for (int i = 0; i < src->pending; i++) {
+    if (src->pending_seq[i] == seq) {
+      r->latencies[r->latencies_size++] = now_usec() - src->pending_usec[i];
+      r->replies += 1;
+      src->pending -= 1;
+      memmove(&src->pending_seq[i], &src->pending_seq[i + 1], src->pending - i);
+      memmove(&src->pending_usec[i], &src->pending_usec[i + 1],
+              (src->pending - i) * sizeof(long long));
+      return;
+    }
+  }
+}
+
+void poll_replies(struct replay* r, int timeout_ms) {
+  char buf[BUFSIZE];
+  struct packet pkt;
+  int rc;
+
+  rc = poll(r->fds, r->sources_size, timeout_ms);
+  if (rc == -1 && errno == EINTR)
+    return;
+  check_error(rc, "poll");
+
+  for (int i = 0; rc > 0 && i < r->sources_size; i++) {
+    if (!(r->fds[i].revents & POLLIN))
+      continue;
+    while ((rc = recv(r->fds[i].fd, buf, BUFSIZE, MSG_DONTWAIT)) > 0) {
+      if (parse_packet(buf, rc, &pkt) == PACKET_ACK)
+        match_reply(r, &r->sources[i], pkt.seq);
+    }
+    rc = 1;
+  }
+}
+
+void send_datagram(struct replay* r, struct datagram* d, struct sockaddr_in* server_addr) {
+  struct source* src = &r->sources[d->source];
+  int rc;
+
+  rc = sendto(src->sockfd, d->data, d->len, 0, (struct sockaddr*)server_addr, sizeof(*server_addr));
+  check_error(rc, "sendto");
+
+  if (d->expects_reply) {
+    r->expected += 1;
+    if (src->pending == MAX_PENDING) { // Give up on the oldest request.
+      src->pending -= 1;
+      memmove(&src->pending_seq[0], &src->pending_seq[1], src->pending);
+      memmove(&src->pending_usec[0], &src->pending_usec[1], src->pending * sizeof(long long));
+    }
+    src->pending_seq[src->pending] = d->seq;
+    src->pending_usec[src->pending] = now_usec();
+    src->pending += 1;
+  }
+}
+
+int read_report(const char* path, struct report* report) {
+  FILE* file = fopen(path, "r");
+  int n;
+  if (file == NULL)
+    return 0;
+  n = fscanf(file, "rate %lf\np99_usec %lld\nreply_ratio %lf\n",
+             &report->rate, &report->p99, &report->reply_ratio);
+  fclose(file);
+  return n == 3;
+}
+
+void write_report(const char* path, struct report* report) {
+  FILE* file = fopen(path, "w");
+  if (file == NULL) {
+    perror(path);
+    return;
+  }
+  fprintf(file, "rate %.1f\np99_usec %lld\nreply_ratio %.4f\n",
+          report->rate, report->p99, report->reply_ratio);
+  fclose(file);
+}
+
+int check_regression(struct report* baseline, struct report* current) {
+  int failed = 0;
+
+  if (current->rate < baseline->rate * (1 - REGRESSION_TOLERANCE)) {
+    printf("REGRESSION: rate %.1f/s, baseline %.1f/s\n", current->rate, baseline->rate);
+    failed = 1;
+  }
+  if (current->p99 > baseline->p99 * (1 + REGRESSION_TOLERANCE) + 100) {
+    printf("REGRESSION: p99 %lld us, baseline %lld us\n", current->p99, baseline->p99);
+    failed = 1;
+  }
+  if (current->reply_ratio < baseline->reply_ratio - REGRESSION_TOLERANCE / 10) {
+    printf("REGRESSION: %.2f%% replies, baseline %.2f%%\n",
+           current->reply_ratio * 100, baseline->reply_ratio * 100);
+    failed = 1;
+  }
+  if (!failed)
+    printf("NO REGRESSION AGAINST BASELINE\n");
+  return failed;
+}
+
+int main(int argc, char* const argv[]) {
+  struct replay r;
+  struct report report, baseline;
+  struct sockaddr_in server_addr;
+  const char* report_file = NULL;
+  const char* baseline_file = NULL;
+  long long start, due, now, first, capture_span, replay_span;
+  double speed;
+  int opt, failed = 0;
+
+  while ((opt = getopt(argc, argv, "o:g:")) != -1) {
+    if (opt == 'o') {
+      report_file = optarg;
+    } else if (opt == 'g') {
+      baseline_file = optarg;
+    } else {
+      argc = 0;
+    }
+  }
+  argc -= optind - 1;
+  argv += optind - 1;
+
+  if (argc < 5) {
+    printf("Usage: ./upush_replay [-o <report>] [-g <baseline_report>] <capture> <ip-address> <port> <speed>\n");
+    printf("  speed 1 replays in real time, N replays N times faster and 0 as fast as possible\n");
+    printf("  -o  write throughput and latency to a report file\n");
+    printf("  -g  compare against an earlier report and exit with failure on a regression\n");
+    return 0;
+  }
+  // ./upush_replay -o before.txt traffic.cap 127.0.0.1 2001 0
+  // ./upush_replay -g before.txt traffic.cap 127.0.0.1 2001 0
+
+  memset(&r, 0, sizeof(r));
+  load_capture(&r, argv[1]);
+  if (r.size == 0) {
+    fprintf(stderr, "EMPTY CAPTURE\n");
+    return EXIT_FAILURE;
+  }
+
+  memset(&server_addr, 0, sizeof(server_addr));
+  server_addr.sin_family = AF_INET;
+  server_addr.sin_port = htons(atoi(argv[3]));
+  if (inet_pton(AF_INET, argv[2], &server_addr.sin_addr) != 1) {
+    fprintf(stderr, "INVALID IP ADDRESS\n");
+    return EXIT_FAILURE;
+  }
+  speed = atof(argv[4]);
+
+  first = r.datagrams[0].usec;
+  capture_span = r.datagrams[r.size - 1].usec - first;
+  start = now_usec();
+  for (int i = 0; i < r.size; i++) {
+    if (speed > 0) {
+      due = start + (r.datagrams[i].usec - first) / speed;
+      while ((now = now_usec()) < due)
+        poll_replies(&r, (due - now) / 1000);
+    }
+    if (i % POLL_EVERY == 0)
+      poll_replies(&r, 0);
+    send_datagram(&r, &r.datagrams[i], &server_addr);
+  }
+  replay_span = now_usec() - start;
+
+  due = now_usec() + DRAIN_TIME_MS * 1000LL;
+  while (r.replies < r.expected && (now = now_usec()) < due)
+    poll_replies(&r, (due - now) / 1000 + 1);
+
+  qsort(r.latencies, r.latencies_size, sizeof(long long), compare_latencies);
+  report.rate = replay_span > 0 ? r.size * 1e6 / replay_span : 0;
+  report.p99 = percentile(&r, 99);
+  report.reply_ratio = r.expected > 0 ? (double)r.replies / r.expected : 1;
+
+  printf("capture: %d datagrams from %d sources over %.3f s (%.1f datagrams/s)\n",
+         r.size, r.sources_size, capture_span / 1e6,
+         capture_span > 0 ? r.size * 1e6 / capture_span : 0);
+  printf("replay:  %d datagrams in %.3f s (%.1f datagrams/s)\n",
+         r.size, replay_span / 1e6, report.rate);
+  printf("replies: %d of %d (%.2f%% lost)\n", r.replies, r.expected,
+         (1 - report.reply_ratio) * 100);
+  printf("latency: p50 %.3f ms p90 %.3f ms p99 %.3f ms max %.3f ms\n",
+         percentile(&r, 50) / 1000.0, percentile(&r, 90) / 1000.0,
+         percentile(&r, 99) / 1000.0, percentile(&r, 100) / 1000.0);
+
+  if (report_file != NULL)
+    write_report(report_file, &report);
+
+  if (baseline_file != NULL) {
+    if (!read_report(baseline_file, &baseline)) {
+      fprintf(stderr, "%s: INVALID REPORT\n", baseline_file);
+      failed = 1;
+    } else {
+      failed = check_regression(&baseline, &report);
+    }
+  }
+
+  for (int i = 0; i < r.size; i++)
+    free(r.datagrams[i].data);
+  for (int i = 0; i < r.sources_size; i++)
+    close(r.sources[i].sockfd);
+  free(r.datagrams);
+  free(r.sources);
+  free(r.fds);
+  free(r.latencies);
+  return failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -1,26 +1,206 @@
 #include "send_packet.h"
+#include "parse_packet.h"
+#include "capture.h"
+#include "cluster.h"
+#include "handover.h"
+#include "console.h"
+#include "trace.h"
 
 #include <time.h>
+#include <errno.h>
+#include <signal.h>
 
 #define IP "127.0.0.1"
-#define BUFSIZE 256
+#define BUFSIZE 1401
 #define ACKSIZE 64
-#define HEARTBEAT 30
+#define REFRESH_MIN 10 // Seconds between heartbeats while the registry is small
+#define REFRESH_MAX 300
+#define HEARTBEAT_RATE 100 // Heartbeats per second the refresh interval aims for
+#define LEASE_FACTOR 3 // A lease outlasts this many refresh intervals
+#define REPLYSIZE 1400 // Largest batch reply datagram
+#define MAX_BATCH 128 // Nicks answered per batch lookup
+#define ENTRYSIZE 64
+#define BATCH_HEADER_SIZE 24 // "ACK s BATCH ppp nnn "
+#define NOTICESIZE 128
+#define SUB_BUCKETS 4096 // Hash buckets of the subscription index, a power of two
+#define SUBS_PER_SUBSCRIBER 512 // Twice the peers a client keeps by default
+#define SWEEP_INTERVAL 1 // Seconds between sweeps for expired registrations
+#define RELAY_BUDGET (1 << 20) // Bytes held for all recipients together
+#define RELAY_QUEUE_MAX 256 // Messages held for one recipient
+#define RELAY_WINDOW 10 // Messages in flight per recipient, one per sequence digit
+#define RELAY_TTL 300
+#define FWD_HEADER_SIZE 96 // "FWD <ip> <port> <nick> " in front of a forwarded packet
+#define MAX_FWD_NICK 32
+#define REPLICA_TIMEOUT 30 // Replicas not heard from for this long are dropped
+#define REPLICA_KEEPALIVE 5 // How often a replica tells the primary it is there
+#define RESYNC_INTERVAL 1 // Least time between two resync requests
+#define MAX_REPLICAS 8 // Replica addresses a primary takes SYNC and RESYNC from
+#define ADMIT_RATE 200 // Datagrams per second one source address may send
+#define ADMIT_BURST 400
+#define ADMIT_SLOTS 4096 // Sources tracked at once, a power of two
+#define ADMIT_BATCH 64 // Datagrams taken off the socket and served by priority at once
+#define HANDOVER_VERSION 2 // Version 1 had no leases and no version in its header
+
+static volatile sig_atomic_t stop_server;
 
 struct client {
   char* name;
   char* ip;
   int port;
+  struct sockaddr_in via; // The shard the client talks to, if not this one
+  int forwarded;
   time_t heartbeat;
+  int lease; // Seconds the registration lasts without a heartbeat
   struct client* next;
 };
 
+// Where a packet came from. A packet forwarded by another shard carries the
+// client's own address, and everything sent back goes through that shard.
+struct origin {
+  struct sockaddr_in addr;
+  struct sockaddr_in via;
+  int forwarded;
+  struct slice requester; // The client's nick, as vouched for by the forwarding shard
+};
+
 struct client_list {
   int size;
   struct client* head;
   struct client* tail;
 };
 
+struct subscription {
+  char* nick; // The nick being watched
+  char* subscriber;
+  struct sockaddr_in addr; // Where the subscriber last subscribed from
+  struct sockaddr_in via;
+  int forwarded;
+  time_t refreshed; // Clients subscribe again with every heartbeat
+  struct subscription* next; // In the bucket of nick
+  struct subscription* next_of_subscriber; // In the bucket of subscriber
+};
+
+// Subscriptions are chained twice: by the nick watched, for notices and
+// renewals, and by subscriber, to count against SUBS_PER_SUBSCRIBER and to
+// drop a subscriber's all at once.
+struct subscription_list {
+  int size;
+  long refused;
+  struct subscription* by_nick[SUB_BUCKETS];
+  struct subscription* by_subscriber[SUB_BUCKETS];
+};
+
+struct relayed_message {
+  char* from;
+  char* text;
+  char seq; // Digit it was last sent with, or 0 while not in flight
+  time_t received;
+  struct relayed_message* next;
+};
+
+struct relay_queue { // Messages held for one recipient until it shows up
+  char* nick;
+  int size;
+  int in_flight;
+  struct relayed_message* head;
+  struct relayed_message* tail;
+  struct relay_queue* next;
+};
+
+struct relay_list {
+  int size;
+  long bytes;
+  long accepted;
+  long refused;
+  long delivered;
+  long expired;
+  struct relay_queue* head;
+};
+
+static struct relay_list relays;
+
+struct replica {
+  struct sockaddr_in addr;
+  time_t heard;
+  struct replica* next;
+};
+
+// The primary numbers every registry change and sends it to each replica as
+// "CHG <epoch> <seqno> REG <nick> <ip> <port>" or "CHG <epoch> <seqno> DEL
+// <nick>", with "NOP <epoch> <seqno>" every SWEEP_INTERVAL so a replica
+// notices a lost change even when nothing else happens. The epoch is the
+// primary's start time, so a restarted primary is never mistaken for the
+// old one.
+struct replication {
+  long epoch;
+  long seqno; // Last change published, or applied on a replica
+  int following; // This process is a replica of primary
+  int synced; // On a replica: seqno is a consistent point of the stream
+  struct sockaddr_in primary;
+  time_t last_request; // On a replica: when SYNC or RESYNC was last sent
+  long changes;
+  long snapshots;
+  long gaps;
+  long refused; // SYNC and RESYNC from addresses not given with -P
+  struct sockaddr_in allowed[MAX_REPLICAS];
+  int allowed_count;
+  int size;
+  struct replica* head;
+};
+
+static struct replication replication;
+
+// Every lease granted is LEASE_FACTOR times the current refresh interval,
+// which grows with the registry so the heartbeats reaching the server stay
+// near HEARTBEAT_RATE per second however large the fleet gets.
+struct lease_stats {
+  int refresh;
+  long registrations;
+  long heartbeats;
+  long unknown; // Heartbeats for a registration the server does not have
+};
+
+static struct lease_stats leases = { REFRESH_MIN, 0, 0, 0 };
+
+// Every source address gets a token bucket, refilled at rate per second up
+// to burst, and a datagram that finds it empty is dropped before it is even
+// parsed. The buckets live in a direct-mapped table: a source that lands on
+// a slot held by another takes it over with a full bucket, which only ever
+// errs on the side of letting traffic in.
+struct admission_slot {
+  in_addr_t ip;
+  in_port_t port;
+  double tokens;
+  long long refilled; // Microseconds
+};
+
+struct admission {
+  int rate; // 0 turns admission control off
+  int burst;
+  long admitted;
+  long limited;
+  long shed; // LOOKUPs dropped while overloaded
+  long overloaded; // Batches that filled up, so more was waiting
+  struct admission_slot slots[ADMIT_SLOTS];
+};
+
+static struct admission admission = { .rate = ADMIT_RATE, .burst = ADMIT_BURST };
+
+struct datagram {
+  int len; // -1 once refused
+  int lookup;
+  double tokens; // Left in the source's bucket after this one
+  struct sockaddr_in addr;
+  char buf[BUFSIZE + FWD_HEADER_SIZE];
+};
+
+static struct datagram batch[ADMIT_BATCH];
+
+// Expiry happens deep inside lookups, so the subscriptions and the socket to
+// send on are kept here rather than passed down every call.
+static struct subscription_list subscriptions;
+static int server_socket;
+
 struct client_list* create_client_list() {
   struct client_list* cl = malloc(sizeof(struct client_list));
   cl->size = 0;
@@ -31,7 +211,7 @@ struct client_list* create_client_list() {
 
 void check_error(int i, char* msg) {
   if (i == -1) {
-    perror(msg);
+    console_log(CONSOLE_ERROR, "%s: %s\n", msg, strerror(errno));
     exit(EXIT_FAILURE);
   }
 }
@@ -66,30 +246,47 @@ struct client* create_client(char* name, struct sockaddr_in clientaddr) {
   return new_client;
 }
 
-int update_client(struct client_list* cl, char* name, struct sockaddr_in clientaddr) {
+// The lease for a registration from origin. A shard that forwards a
+// registration grants the lease from its own registry size, which can be
+// larger than this one's, so forwarded registrations are held twice as long.
+int origin_lease(struct origin* origin) {
+  return (origin->forwarded ? 2 : 1) * LEASE_FACTOR * leases.refresh;
+}
+
+// Returns 0 if the name is not registered, 1 if it is and 2 if it is and
+// its address changed.
+int update_client(struct client_list* cl, struct slice name, struct origin* origin) {
   struct client* current = cl->head;
   struct client* temp;
   while (current != NULL) {
     temp = current;
     current = current->next;
 
-    if (!strcmp(name, temp->name)) {
+    if (slice_equals(name, temp->name)) {
+      int moved = strcmp(temp->ip, inet_ntoa(origin->addr.sin_addr)) ||
+                  temp->port != ntohs(origin->addr.sin_port);
       free(temp->ip);
-      temp->ip = strdup(inet_ntoa(clientaddr.sin_addr));
-      temp->port = ntohs(clientaddr.sin_port);
+      temp->ip = strdup(inet_ntoa(origin->addr.sin_addr));
+      temp->port = ntohs(origin->addr.sin_port);
+      temp->via = origin->via;
+      temp->forwarded = origin->forwarded;
       temp->heartbeat = time(NULL);
-      return 1;
+      temp->lease = origin_lease(origin);
+      return moved ? 2 : 1;
     }
   }
   return 0;
 }
 
-void push_back_client(struct client_list* cl, char* name, struct sockaddr_in clientaddr) {
+void push_back_client(struct client_list* cl, struct slice name, struct origin* origin) {
   struct client* client = malloc(sizeof(struct client));
-  client->name = strdup(name);
-  client->ip = strdup(inet_ntoa(clientaddr.sin_addr));
-  client->port = ntohs(clientaddr.sin_port);
+  client->name = strndup(name.ptr, name.len);
+  client->ip = strdup(inet_ntoa(origin->addr.sin_addr));
+  client->port = ntohs(origin->addr.sin_port);
+  client->via = origin->via;
+  client->forwarded = origin->forwarded;
   client->heartbeat = time(NULL);
+  client->lease = origin_lease(origin);
   client->next = NULL;
 
   if (cl->tail != NULL)
@@ -119,11 +316,9 @@ void pop_client(struct client_list* cl, char* name) {
 
     while (current != NULL) {
       if (!strcmp(current->name, name)) {
-        if (current->next != NULL) {
-          prev->next = current->next;;
-        } else {
+        prev->next = current->next;
+        if (current->next == NULL)
           cl->tail = prev;
-        }
         cl->size -= 1;
         destroy_client(current);
         return;
@@ -135,65 +330,1422 @@ void pop_client(struct client_list* cl, char* name) {
 
 }
 
+struct client* find_client(struct client_list* cl, struct slice name) {
+  struct client* current = cl->head;
+  while (current != NULL) {
+    if (slice_equals(name, current->name))
+      return current;
+    current = current->next;
+  }
+  return NULL;
+}
+
+struct client* find_client_by_address(struct client_list* cl, struct sockaddr_in clientaddr) {
+  struct client* current = cl->head;
+  while (current != NULL) {
+    if (current->port == ntohs(clientaddr.sin_port) &&
+        !strcmp(current->ip, inet_ntoa(clientaddr.sin_addr)))
+      return current;
+    current = current->next;
+  }
+  return NULL;
+}
+
+struct subscription** subscription_bucket(struct subscription** buckets, struct slice name) {
+  return &buckets[cluster_hash(name.ptr, name.len) & (SUB_BUCKETS - 1)];
+}
+
+int count_subscriptions(struct slice subscriber) {
+  int count = 0;
+  for (struct subscription* current = *subscription_bucket(subscriptions.by_subscriber, subscriber);
+       current != NULL; current = current->next_of_subscriber) {
+    if (slice_equals(subscriber, current->subscriber))
+      count += 1;
+  }
+  return count;
+}
+
+// Subscribes, or renews the subscription of, the client that sent origin.
+// A subscriber already holding SUBS_PER_SUBSCRIBER gets no new ones; it
+// finds out about those peers by timeouts, as without subscriptions.
+// Returns the subscription, or NULL if it was refused.
+struct subscription* add_subscription(struct slice nick, struct slice subscriber, struct origin* origin) {
+  struct subscription** bucket = subscription_bucket(subscriptions.by_nick, nick);
+  struct subscription** subscriber_bucket;
+  struct subscription* current = *bucket;
+  while (current != NULL) {
+    if (slice_equals(nick, current->nick) && slice_equals(subscriber, current->subscriber))
+      break;
+    current = current->next;
+  }
+
+  if (current == NULL) {
+    if (count_subscriptions(subscriber) >= SUBS_PER_SUBSCRIBER) {
+      subscriptions.refused += 1;
+      return NULL;
+    }
+    subscriber_bucket = subscription_bucket(subscriptions.by_subscriber, subscriber);
+    current = malloc(sizeof(struct subscription));
+    current->nick = strndup(nick.ptr, nick.len);
+    current->subscriber = strndup(subscriber.ptr, subscriber.len);
+    current->next = *bucket;
+    *bucket = current;
+    current->next_of_subscriber = *subscriber_bucket;
+    *subscriber_bucket = current;
+    subscriptions.size += 1;
+  }
+  current->addr = origin->addr;
+  current->via = origin->via;
+  current->forwarded = origin->forwarded;
+  current->refreshed = time(NULL);
+  return current;
+}
+
+void destroy_subscription(struct subscription* subscription) {
+  struct subscription** link = subscription_bucket(subscriptions.by_nick, slice_from_string(subscription->nick));
+  while (*link != subscription)
+    link = &(*link)->next;
+  *link = subscription->next;
+
+  link = subscription_bucket(subscriptions.by_subscriber, slice_from_string(subscription->subscriber));
+  while (*link != subscription)
+    link = &(*link)->next_of_subscriber;
+  *link = subscription->next_of_subscriber;
+
+  subscriptions.size -= 1;
+  free(subscription->nick);
+  free(subscription->subscriber);
+  free(subscription);
+}
+
+// Removes the subscriber's subscription to nick, or all of its subscriptions
+// if nick is NULL. A NULL subscriber matches subscriptions not renewed
+// within two leases instead, as a subscriber renews them with each heartbeat.
+void remove_subscriptions(struct slice* subscriber, struct slice* nick) {
+  struct subscription* current;
+  struct subscription* temp;
+  time_t current_time = time(NULL);
+
+  if (subscriber != NULL && nick != NULL) {
+    current = *subscription_bucket(subscriptions.by_nick, *nick);
+    while (current != NULL) {
+      temp = current;
+      current = current->next;
+      if (slice_equals(*nick, temp->nick) && slice_equals(*subscriber, temp->subscriber))
+        destroy_subscription(temp);
+    }
+  } else if (subscriber != NULL) {
+    current = *subscription_bucket(subscriptions.by_subscriber, *subscriber);
+    while (current != NULL) {
+      temp = current;
+      current = current->next_of_subscriber;
+      if (slice_equals(*subscriber, temp->subscriber))
+        destroy_subscription(temp);
+    }
+  } else {
+    for (int i = 0; i < SUB_BUCKETS; i++) {
+      current = subscriptions.by_nick[i];
+      while (current != NULL) {
+        temp = current;
+        current = current->next;
+        if (calculate_time_interval(temp->refreshed, current_time) > 2 * LEASE_FACTOR * leases.refresh)
+          destroy_subscription(temp);
+      }
+    }
+  }
+}
+
+void destroy_subscriptions() {
+  for (int i = 0; i < SUB_BUCKETS; i++) {
+    while (subscriptions.by_nick[i] != NULL)
+      destroy_subscription(subscriptions.by_nick[i]);
+  }
+}
+
+void print_subscription_stats(FILE* out) {
+  fprintf(out, "SUBSCRIPTIONS: %d held, %ld refused\n", subscriptions.size, subscriptions.refused);
+}
+
+// Sends buf to a client, directly or, if via is not NULL, wrapped as
+// "OUT <ip> <port> <buf>" through the shard the client talks to.
+void send_to(struct sockaddr_in* addr, struct sockaddr_in* via, char* buf, int len) {
+  char packet[BUFSIZE + FWD_HEADER_SIZE];
+  int rc, header;
+
+  TRACE(reply_send, ntohs(addr->sin_port), buf[4] - '0', buf, len); // Every reply is "XXX <seq> ..."
+  if (via == NULL) {
+    rc = send_packet(server_socket, buf, len, 0, (struct sockaddr*)addr, sizeof(*addr));
+  } else {
+    header = snprintf(packet, sizeof(packet), "OUT %s %d ", inet_ntoa(addr->sin_addr), ntohs(addr->sin_port));
+    if (len > (int)sizeof(packet) - header)
+      len = sizeof(packet) - header;
+    memcpy(packet + header, buf, len);
+    rc = send_packet(server_socket, packet, header + len, 0, (struct sockaddr*)via, sizeof(*via));
+  }
+  check_error(rc, "send_packet");
+}
+
+void send_reply(struct origin* origin, char* buf, int len) {
+  send_to(&origin->addr, origin->forwarded ? &origin->via : NULL, buf, len);
+}
+
+void send_notice(struct client* dest, char* notice, int len) {
+  struct sockaddr_in addr;
+
+  addr.sin_family = AF_INET;
+  addr.sin_port = htons(dest->port);
+  inet_pton(AF_INET, dest->ip, &addr.sin_addr);
+  send_to(&addr, dest->forwarded ? &dest->via : NULL, notice, len);
+}
+
+// Tells everyone subscribed to client where it now is, or that it is gone.
+// Notices are not acknowledged: a lost one costs the subscriber the same
+// retransmits and lookup it would have needed without a subscription.
+void notify_subscribers(struct client* client, int gone) {
+  struct subscription* current = *subscription_bucket(subscriptions.by_nick, slice_from_string(client->name));
+  char notice[NOTICESIZE];
+  int len;
+
+  if (gone)
+    len = snprintf(notice, NOTICESIZE, "PKT 0 NOTIFY NICK %s GONE", client->name);
+  else
+    len = snprintf(notice, NOTICESIZE, "PKT 0 NOTIFY NICK %s IP %s PORT %d", client->name, client->ip, client->port);
+  if (len >= NOTICESIZE)
+    return;
+
+  for (; current != NULL; current = current->next) {
+    if (!strcmp(current->nick, client->name))
+      send_to(&current->addr, current->forwarded ? &current->via : NULL, notice, len);
+  }
+}
+
+// Tells peer where the requester that just looked it up can be reached, so
+// the peer's first reply needs no lookup of its own. Like presence notices,
+// introductions are not acknowledged: a lost one only costs that lookup.
+void send_introduction(struct slice requester, struct origin* origin, struct client* peer) {
+  char notice[NOTICESIZE];
+  int len;
+
+  len = snprintf(notice, NOTICESIZE, "PKT 0 INTRO NICK %.*s IP %s PORT %d", (int)requester.len,
+                 requester.ptr, inet_ntoa(origin->addr.sin_addr), ntohs(origin->addr.sin_port));
+  if (len < NOTICESIZE && !slice_equals(requester, peer->name))
+    send_notice(peer, notice, len);
+}
+
+void publish_change(struct client* client, int gone);
+
+// A replica never expires entries itself, it waits for the primary's DEL.
 int is_old_registration(struct client_list* cl, struct client* client) {
   time_t current_time = time(NULL);
-  if (calculate_time_interval(client->heartbeat, current_time) > HEARTBEAT) {
+  if (!replication.following && calculate_time_interval(client->heartbeat, current_time) > client->lease) {
+    struct slice name = slice_from_string(client->name);
+    notify_subscribers(client, 1);
+    publish_change(client, 1);
+    remove_subscriptions(&name, NULL);
     pop_client(cl, client->name);
     return 1;
   }
   return 0;
 }
 
-void create_ack(char* ack, char* seq_num, char* msg) {
+// Expires registrations nobody is looking up, so their subscribers hear
+// about it within SWEEP_INTERVAL rather than on the next lookup.
+void expire_clients(struct client_list* cl) {
+  struct client* current = cl->head;
+  struct client* temp;
+  while (current != NULL) {
+    temp = current;
+    current = current->next;
+    is_old_registration(cl, temp);
+  }
+}
+
+void create_ack(char* ack, char seq_num, char* msg) {
+  memset(ack, 0, ACKSIZE);
+  snprintf(ack, ACKSIZE, "ACK %c %s", seq_num, msg);
+}
+
+// Sets the refresh interval for the registry's current size. Called for
+// every new registration, so a fleet that registers at once is spread out
+// from its first lease on.
+void adjust_refresh(struct client_list* cl) {
+  int refresh = cl->size / HEARTBEAT_RATE;
+  leases.refresh = refresh < REFRESH_MIN ? REFRESH_MIN : refresh > REFRESH_MAX ? REFRESH_MAX : refresh;
+}
+
+// Acknowledges a registration or heartbeat with "ACK <seq> OK LEASE <lease>
+// REFRESH <refresh>". The refresh interval is moved by up to a quarter
+// either way at random, so clients that registered together drift apart
+// while heartbeats still arrive at the planned rate on average.
+void create_lease_ack(char* ack, char seq_num) {
+  int refresh = leases.refresh - leases.refresh / 4 + lrand48() % (leases.refresh / 2 + 1);
   memset(ack, 0, ACKSIZE);
-  snprintf(ack, ACKSIZE, "ACK %s %s", seq_num, msg);
+  snprintf(ack, ACKSIZE, "ACK %c OK LEASE %d REFRESH %d", seq_num, LEASE_FACTOR * leases.refresh, refresh);
+}
+
+void print_lease_stats(FILE* out) {
+  fprintf(out, "LEASES: refresh %d s, %ld registrations, %ld heartbeats, %ld unknown\n",
+          leases.refresh, leases.registrations, leases.heartbeats, leases.unknown);
 }
 
 void print_clients(struct client_list* cl) {
   struct client* next = cl->head;
 
   while (next != NULL) {
-    printf("%s\n", next->name);
-    printf("%s\n", next->ip);
-    printf("%d\n", next->port);
-    printf("\n");
+    console_log(CONSOLE_DEBUG, "%s\n%s\n%d\n\n", next->name, next->ip, next->port);
 
     next = next->next;
   }
 }
 
-struct client* find_client(struct client_list* cl, char* name) {
-  struct client* current = cl->head;
+// Renders "<nick> <ip> <port>" for a registered nick and "<nick> - -" for
+// one that is not. Returns the length, or 0 if the nick is too long.
+int render_batch_entry(char* entry, struct client_list* cl, struct slice nick) {
+  struct client* lookup = find_client(cl, nick);
+  int len;
+
+  TRACE(registry_lookup, nick.ptr, nick.len, lookup != NULL, cl->size);
+  if (lookup == NULL || is_old_registration(cl, lookup))
+    len = snprintf(entry, ENTRYSIZE, "%.*s - -", (int)nick.len, nick.ptr);
+  else
+    len = snprintf(entry, ENTRYSIZE, "%s %s %d", lookup->name, lookup->ip, lookup->port);
+  return len < ENTRYSIZE ? len : 0;
+}
+
+// Answers "PKT s LOOKUP n1 n2 ..." with one or more "ACK s BATCH p n ..."
+// datagrams, packing as many entries as fit in each.
+void answer_batch_lookup(struct client_list* cl, struct packet* pkt, struct origin* origin) {
+  char entries[MAX_BATCH][ENTRYSIZE];
+  int lengths[MAX_BATCH];
+  int first[MAX_BATCH + 1];
+  char reply[REPLYSIZE + 1];
+  struct slice rest = pkt->text;
+  struct slice nick;
+  int count = 0, parts = 0, used = REPLYSIZE, len;
+
+  while (count < MAX_BATCH && slice_next_token(&rest, &nick)) {
+    lengths[count] = render_batch_entry(entries[count], cl, nick);
+    if (lengths[count] == 0)
+      continue;
+    if (used + 1 + lengths[count] > REPLYSIZE - BATCH_HEADER_SIZE) {
+      first[parts++] = count;
+      used = 0;
+    }
+    used += 1 + lengths[count];
+    count += 1;
+  }
+  if (parts == 0) // Still answer, so the client does not wait for a timeout
+    first[parts++] = 0;
+  first[parts] = count;
+
+  for (int part = 0; part < parts; part++) {
+    len = snprintf(reply, sizeof(reply), "ACK %c BATCH %d %d", pkt->seq, part + 1, parts);
+    for (int i = first[part]; i < first[part + 1]; i++)
+      len += sprintf(reply + len, " %s", entries[i]);
+    send_reply(origin, reply, len);
+  }
+}
+
+long relayed_message_bytes(struct relayed_message* message) {
+  return sizeof(struct relayed_message) + strlen(message->from) + strlen(message->text) + 2;
+}
+
+struct relay_queue* find_relay_queue(struct slice nick) {
+  struct relay_queue* current = relays.head;
   while (current != NULL) {
-    if (!strcmp(current->name, name))
+    if (slice_equals(nick, current->nick))
       return current;
     current = current->next;
   }
   return NULL;
 }
 
-int main(int argc, char const *argv[]) {
+void destroy_relayed_message(struct relayed_message* message) {
+  relays.bytes -= relayed_message_bytes(message);
+  free(message->from);
+  free(message->text);
+  free(message);
+}
+
+// Unlinks and frees message, which follows prev in queue (or heads it if
+// prev is NULL).
+void remove_relayed_message(struct relay_queue* queue, struct relayed_message* prev,
+                            struct relayed_message* message) {
+  if (prev != NULL)
+    prev->next = message->next;
+  else
+    queue->head = message->next;
+  if (message->next == NULL)
+    queue->tail = prev;
+  if (message->seq)
+    queue->in_flight -= 1;
+  queue->size -= 1;
+  destroy_relayed_message(message);
+}
+
+void destroy_relay_queue(struct relay_queue* queue) {
+  while (queue->head != NULL)
+    remove_relayed_message(queue, NULL, queue->head);
+  free(queue->nick);
+  free(queue);
+}
+
+void destroy_relays() {
+  while (relays.head != NULL) {
+    struct relay_queue* temp = relays.head;
+    relays.head = temp->next;
+    destroy_relay_queue(temp);
+  }
+  relays.size = 0;
+}
+
+// Holds a RELAY packet for its recipient. Returns 0 if the recipient's queue
+// or the memory budget is full.
+int relay_message(struct packet* pkt) {
+  struct relay_queue* queue = find_relay_queue(pkt->to);
+  struct relayed_message* message;
+  long bytes = sizeof(struct relayed_message) + pkt->from.len + pkt->msg.len + 2;
+
+  if (relays.bytes + bytes > RELAY_BUDGET || (queue != NULL && queue->size >= RELAY_QUEUE_MAX)) {
+    relays.refused += 1;
+    return 0;
+  }
+
+  if (queue == NULL) {
+    queue = calloc(1, sizeof(struct relay_queue));
+    queue->nick = strndup(pkt->to.ptr, pkt->to.len);
+    queue->next = relays.head;
+    relays.head = queue;
+    relays.size += 1;
+  }
+
+  message = malloc(sizeof(struct relayed_message));
+  message->from = strndup(pkt->from.ptr, pkt->from.len);
+  message->text = strndup(pkt->msg.ptr, pkt->msg.len);
+  message->seq = 0;
+  message->received = time(NULL);
+  message->next = NULL;
+  if (queue->tail != NULL)
+    queue->tail->next = message;
+  else
+    queue->head = message;
+  queue->tail = message;
+  queue->size += 1;
+  relays.bytes += bytes;
+  relays.accepted += 1;
+  return 1;
+}
+
+// Sends the recipient up to RELAY_WINDOW held messages, numbered with the
+// digits 0-9 so each ACK names the message it is for. Messages still in
+// flight from an earlier batch are taken to be lost and are sent again.
+void send_relay_batch(struct relay_queue* queue, struct client* recipient) {
+  struct relayed_message* message = queue->head;
+  char packet[BUFSIZE + 2 * ENTRYSIZE];
+  int len;
+
+  queue->in_flight = 0;
+  for (; message != NULL; message = message->next)
+    message->seq = 0;
+
+  for (message = queue->head; message != NULL && queue->in_flight < RELAY_WINDOW; message = message->next) {
+    message->seq = '0' + queue->in_flight;
+    queue->in_flight += 1;
+    len = snprintf(packet, sizeof(packet), "PKT %c FROM %s TO %s MSG %s",
+                   message->seq, message->from, queue->nick, message->text);
+    if (len >= (int)sizeof(packet))
+      len = sizeof(packet) - 1;
+    send_notice(recipient, packet, len);
+  }
+}
+
+// Delivers held messages to a recipient that just registered.
+void deliver_relayed(struct client* recipient) {
+  struct relay_queue* queue = find_relay_queue(slice_from_string(recipient->name));
+  if (queue != NULL && queue->head != NULL)
+    send_relay_batch(queue, recipient);
+}
+
+// Retires the relayed message a recipient acknowledged, and sends the next
+// batch once the whole window is acknowledged.
+void relay_ack(struct client_list* cl, struct slice nick, char seq) {
+  struct relay_queue* queue = find_relay_queue(nick);
+  struct client* recipient = find_client(cl, nick);
+  struct relayed_message* message;
+  struct relayed_message* prev = NULL;
+
+  if (queue == NULL || recipient == NULL)
+    return;
+  for (message = queue->head; message != NULL; prev = message, message = message->next) {
+    if (message->seq == seq) {
+      remove_relayed_message(queue, prev, message);
+      relays.delivered += 1;
+      break;
+    }
+  }
+  if (queue->in_flight == 0 && queue->head != NULL)
+    send_relay_batch(queue, recipient);
+}
+
+// Drops messages held longer than RELAY_TTL, and queues left empty.
+void expire_relayed() {
+  struct relay_queue* queue = relays.head;
+  struct relay_queue* prev = NULL;
+  struct relay_queue* temp;
+  time_t current_time = time(NULL);
+
+  while (queue != NULL) {
+    while (queue->head != NULL && calculate_time_interval(queue->head->received, current_time) > RELAY_TTL) {
+      remove_relayed_message(queue, NULL, queue->head);
+      relays.expired += 1;
+    }
+
+    temp = queue;
+    queue = queue->next;
+    if (temp->head == NULL) {
+      if (prev != NULL)
+        prev->next = queue;
+      else
+        relays.head = queue;
+      relays.size -= 1;
+      destroy_relay_queue(temp);
+    } else {
+      prev = temp;
+    }
+  }
+}
+
+void print_relay_stats(FILE* out) {
+  fprintf(out, "RELAY: %ld accepted, %ld refused, %ld delivered, %ld expired, %ld bytes held\n",
+          relays.accepted, relays.refused, relays.delivered, relays.expired, relays.bytes);
+}
+
+void send_to_replicas(char* buf, int len) {
+  int rc;
+  for (struct replica* current = replication.head; current != NULL; current = current->next) {
+    rc = send_packet(server_socket, buf, len, 0, (struct sockaddr*)&current->addr, sizeof(current->addr));
+    check_error(rc, "send_packet");
+  }
+}
+
+void publish_change(struct client* client, int gone) {
+  char change[NOTICESIZE];
+  int len;
+
+  if (replication.following)
+    return;
+  replication.seqno += 1;
+  replication.changes += 1;
+  if (replication.head == NULL)
+    return;
+
+  if (gone)
+    len = snprintf(change, NOTICESIZE, "CHG %ld %ld DEL %s", replication.epoch, replication.seqno, client->name);
+  else
+    len = snprintf(change, NOTICESIZE, "CHG %ld %ld REG %s %s %d", replication.epoch, replication.seqno,
+                   client->name, client->ip, client->port);
+  if (len < NOTICESIZE)
+    send_to_replicas(change, len);
+}
+
+// Sends a replica the whole registry as "SNAP <epoch> <seqno> BEGIN", then
+// "SNAP <epoch> <seqno> ENTRIES <nick> <ip> <port> ..." packed like batch
+// lookup replies, then "SNAP <epoch> <seqno> END <count>". The replica
+// resumes the change stream after seqno.
+void send_snapshot(struct client_list* cl, struct sockaddr_in* addr) {
+  char packet[REPLYSIZE + 1];
+  char entry[ENTRYSIZE];
+  int len, header, entry_len, count = 0, rc;
+
+  header = snprintf(packet, sizeof(packet), "SNAP %ld %ld ", replication.epoch, replication.seqno);
+  len = header + sprintf(packet + header, "BEGIN");
+  rc = send_packet(server_socket, packet, len, 0, (struct sockaddr*)addr, sizeof(*addr));
+  check_error(rc, "send_packet");
+
+  len = header + sprintf(packet + header, "ENTRIES");
+  for (struct client* current = cl->head; current != NULL; current = current->next) {
+    entry_len = snprintf(entry, ENTRYSIZE, " %s %s %d", current->name, current->ip, current->port);
+    if (entry_len >= ENTRYSIZE)
+      continue;
+    if (len + entry_len > REPLYSIZE) {
+      rc = send_packet(server_socket, packet, len, 0, (struct sockaddr*)addr, sizeof(*addr));
+      check_error(rc, "send_packet");
+      len = header + sprintf(packet + header, "ENTRIES");
+    }
+    memcpy(packet + len, entry, entry_len);
+    len += entry_len;
+    count += 1;
+  }
+  if (count > 0) {
+    rc = send_packet(server_socket, packet, len, 0, (struct sockaddr*)addr, sizeof(*addr));
+    check_error(rc, "send_packet");
+  }
+
+  len = header + sprintf(packet + header, "END %d", count);
+  rc = send_packet(server_socket, packet, len, 0, (struct sockaddr*)addr, sizeof(*addr));
+  check_error(rc, "send_packet");
+  replication.snapshots += 1;
+}
+
+// Parses the replica addresses given with -P, "ip:port,ip:port,...".
+// Returns -1 if the list is invalid.
+int set_allowed_replicas(const char* spec) {
+  char copy[256];
+  char ip[INET_ADDRSTRLEN];
+  char* member;
+  char* saveptr;
+  struct sockaddr_in* addr;
+  int port;
+
+  if (strlen(spec) >= sizeof(copy))
+    return -1;
+  strcpy(copy, spec);
+
+  for (member = strtok_r(copy, ",", &saveptr); member != NULL; member = strtok_r(NULL, ",", &saveptr)) {
+    addr = &replication.allowed[replication.allowed_count];
+    if (replication.allowed_count == MAX_REPLICAS || sscanf(member, "%15[0-9.]:%d", ip, &port) != 2 ||
+        port <= 0 || port > 65535 || inet_pton(AF_INET, ip, &addr->sin_addr) != 1)
+      return -1;
+    addr->sin_family = AF_INET;
+    addr->sin_port = htons(port);
+    replication.allowed_count += 1;
+  }
+  return 0;
+}
+
+int is_allowed_replica(struct sockaddr_in* addr) {
+  for (int i = 0; i < replication.allowed_count; i++) {
+    if (replication.allowed[i].sin_port == addr->sin_port &&
+        replication.allowed[i].sin_addr.s_addr == addr->sin_addr.s_addr)
+      return 1;
+  }
+  return 0;
+}
+
+// Handles "SYNC" and "RESYNC" from a replica on the primary. Either one
+// keeps the replica subscribed; RESYNC, sent by new replicas and ones that
+// found a gap, also gets a snapshot. Only the replicas given with -P are
+// served: a snapshot is many full datagrams in answer to one short request,
+// and the change stream that follows carries every registration.
+void handle_replica_request(struct client_list* cl, struct slice verb, struct sockaddr_in* addr) {
+  struct replica* current = replication.head;
+
+  if (!is_allowed_replica(addr)) {
+    replication.refused += 1;
+    return;
+  }
+
+  while (current != NULL && (current->addr.sin_port != addr->sin_port ||
+                             current->addr.sin_addr.s_addr != addr->sin_addr.s_addr))
+    current = current->next;
+  if (current == NULL) {
+    current = malloc(sizeof(struct replica));
+    current->addr = *addr;
+    current->next = replication.head;
+    replication.head = current;
+    replication.size += 1;
+  }
+  current->heard = time(NULL);
+
+  if (slice_equals(verb, "RESYNC"))
+    send_snapshot(cl, addr);
+}
+
+// Drops replicas that stopped asking, and tells the rest how far the stream
+// has got.
+void sweep_replicas() {
+  struct replica* current = replication.head;
+  struct replica* prev = NULL;
+  struct replica* temp;
+  char nop[NOTICESIZE];
+  int len;
+
+  while (current != NULL) {
+    temp = current;
+    current = current->next;
+    if (calculate_time_interval(temp->heard, time(NULL)) > REPLICA_TIMEOUT) {
+      if (prev != NULL)
+        prev->next = current;
+      else
+        replication.head = current;
+      replication.size -= 1;
+      free(temp);
+    } else {
+      prev = temp;
+    }
+  }
+
+  len = snprintf(nop, NOTICESIZE, "NOP %ld %ld", replication.epoch, replication.seqno);
+  send_to_replicas(nop, len);
+}
+
+void destroy_replicas() {
+  while (replication.head != NULL) {
+    struct replica* temp = replication.head;
+    replication.head = temp->next;
+    free(temp);
+  }
+  replication.size = 0;
+}
+
+// Sent by a replica to the primary. RESYNC is held back to one per
+// RESYNC_INTERVAL, as a burst of lost changes would otherwise ask for a
+// snapshot each.
+void send_replica_request(const char* verb) {
+  int rc;
+
+  if (!strcmp(verb, "RESYNC")) {
+    replication.synced = 0;
+    if (calculate_time_interval(replication.last_request, time(NULL)) < RESYNC_INTERVAL)
+      return;
+  }
+  rc = send_packet(server_socket, (char*)verb, strlen(verb), 0, (struct sockaddr*)&replication.primary,
+                   sizeof(replication.primary));
+  check_error(rc, "send_packet");
+  replication.last_request = time(NULL);
+}
+
+// Applies "<nick> <ip> <port>" from a change or snapshot to a replica's copy.
+int apply_entry(struct client_list* cl, struct slice* rest) {
+  struct slice nick, ip, port;
+  struct origin origin;
+  char address[INET_ADDRSTRLEN];
+  long long number;
+
+  if (!next_batch_entry(rest, &nick, &ip, &port) || slice_copy(address, sizeof(address), ip) == -1 ||
+      !slice_to_number(port, &number) || number > 65535)
+    return 0;
+
+  memset(&origin, 0, sizeof(origin));
+  origin.addr.sin_family = AF_INET;
+  origin.addr.sin_port = htons(number);
+  if (inet_pton(AF_INET, address, &origin.addr.sin_addr) != 1)
+    return 0;
+  if (!update_client(cl, nick, &origin))
+    push_back_client(cl, nick, &origin);
+  return 1;
+}
+
+// Handles the primary's CHG, NOP and SNAP packets on a replica. Anything out
+// of order means a change was lost, and the replica asks for a snapshot.
+void handle_replication(struct client_list* cl, const char* buf, int len) {
+  struct slice rest = { buf, len };
+  struct slice verb, token, nick;
+  struct client* client;
+  long long epoch, seqno, count;
+  static int snapshot_count;
+
+  if (!slice_next_token(&rest, &verb) || !slice_next_token(&rest, &token) ||
+      !slice_to_number(token, &epoch) || !slice_next_token(&rest, &token) ||
+      !slice_to_number(token, &seqno))
+    return;
+
+  if (slice_equals(verb, "SNAP")) {
+    if (!slice_next_token(&rest, &token))
+      return;
+    if (slice_equals(token, "BEGIN")) {
+      while (cl->head != NULL)
+        pop_client(cl, cl->head->name);
+      replication.epoch = epoch;
+      replication.seqno = seqno;
+      snapshot_count = 0;
+    } else if (epoch != replication.epoch || seqno != replication.seqno) {
+      return; // Left over from an older snapshot
+    } else if (slice_equals(token, "ENTRIES")) {
+      while (apply_entry(cl, &rest))
+        snapshot_count += 1;
+    } else if (slice_equals(token, "END") && slice_next_token(&rest, &token) &&
+               slice_to_number(token, &count)) {
+      replication.synced = count == snapshot_count;
+      replication.snapshots += 1;
+      if (!replication.synced) {
+        replication.gaps += 1;
+        send_replica_request("RESYNC");
+      }
+    }
+    return;
+  }
+
+  if (!replication.synced)
+    return;
+  if (epoch != replication.epoch ||
+      seqno != replication.seqno + (slice_equals(verb, "CHG") ? 1 : 0)) {
+    replication.gaps += 1;
+    send_replica_request("RESYNC");
+    return;
+  }
+
+  if (slice_equals(verb, "CHG")) {
+    replication.seqno = seqno;
+    replication.changes += 1;
+    if (!slice_next_token(&rest, &token))
+      return;
+    if (slice_equals(token, "REG")) {
+      apply_entry(cl, &rest);
+    } else if (slice_equals(token, "DEL") && slice_next_token(&rest, &nick)) {
+      client = find_client(cl, nick);
+      if (client != NULL)
+        pop_client(cl, client->name);
+    }
+  }
+}
+
+void print_replication_stats(FILE* out) {
+  if (replication.following)
+    fprintf(out, "REPLICA: at %ld, %ld changes applied, %ld snapshots, %ld gaps\n",
+            replication.seqno, replication.changes, replication.snapshots, replication.gaps);
+  else
+    fprintf(out, "REPLICATION: at %ld, %d replicas, %ld snapshots sent, %ld requests refused\n",
+            replication.seqno, replication.size, replication.snapshots, replication.refused);
+}
+
+// The nick of the client that sent origin, as the forwarding shard named
+// it or as registered from its address. Empty if it is not registered.
+struct slice find_requester(struct client_list* cl, struct origin* origin) {
+  struct client* client;
+  struct slice none = { NULL, 0 };
+
+  if (origin->forwarded)
+    return origin->requester;
+  client = find_client_by_address(cl, origin->addr);
+  return client != NULL ? slice_from_string(client->name) : none;
+}
+
+// Returns 1 if nick belongs to this server: always, unless it is a shard.
+int owns_nick(struct slice nick) {
+  return !cluster_enabled() || cluster_owner(nick) == cluster_self();
+}
+
+void handle_packet(struct client_list* cl, const char* buf, int len, struct origin* origin) {
+  struct packet pkt;
+  char ack[ACKSIZE];
+  char reply[REPLYSIZE];
+  struct client* lookup;
+  struct slice requester, rest, nick;
+  int rc, reply_len;
+
+  parse_packet(buf, len, &pkt);
+  TRACE(parse_done, ntohs(origin->addr.sin_port), pkt.seq - '0', pkt.type, pkt.nick.ptr, pkt.nick.len);
+
+  // A shard answers REG, HB, SUB and UNSUB itself before forwarding them,
+  // so the owner only updates its state. A forwarded heartbeat is taken as
+  // a registration, the forwarding shard having vouched for it, so an owner
+  // that lost the entry gets it back.
+  if (pkt.type == PACKET_REG || (pkt.type == PACKET_HB && origin->forwarded)) {
+    create_lease_ack(ack, pkt.seq);
+    if (!origin->forwarded)
+      send_reply(origin, ack, strlen(ack));
+    leases.registrations += pkt.type == PACKET_REG;
+    leases.heartbeats += pkt.type == PACKET_HB;
+
+    rc = update_client(cl, pkt.nick, origin);
+    if (rc == 0) {
+      push_back_client(cl, pkt.nick, origin);
+      adjust_refresh(cl);
+      notify_subscribers(cl->tail, 0);
+      publish_change(cl->tail, 0);
+    } else if (rc == 2) {
+      notify_subscribers(find_client(cl, pkt.nick), 0);
+      publish_change(find_client(cl, pkt.nick), 0);
+    }
+    deliver_relayed(find_client(cl, pkt.nick));
+
+  } else if (pkt.type == PACKET_HB) { // Renews a lease without a full registration
+    lookup = find_client(cl, pkt.nick);
+    leases.heartbeats += 1;
+    if (lookup == NULL || lookup->port != ntohs(origin->addr.sin_port) ||
+        strcmp(lookup->ip, inet_ntoa(origin->addr.sin_addr))) {
+      leases.unknown += 1;
+      create_ack(ack, pkt.seq, "NOT REGISTERED"); // The client registers again
+      send_reply(origin, ack, strlen(ack));
+    } else {
+      lookup->heartbeat = time(NULL);
+      lookup->lease = origin_lease(origin);
+      create_lease_ack(ack, pkt.seq);
+      send_reply(origin, ack, strlen(ack));
+      // Clients only register again after losing their registration, so
+      // relayed messages reach a client that stays with its heartbeat.
+      deliver_relayed(lookup);
+    }
+
+  } else if (pkt.type == PACKET_RELAY) {
+    requester = find_requester(cl, origin);
+
+    if (requester.ptr == NULL || !slices_equal(requester, pkt.from))
+      create_ack(ack, pkt.seq, "WRONG NAME");
+    else if (!relay_message(&pkt))
+      create_ack(ack, pkt.seq, "RELAY FULL");
+    else
+      create_ack(ack, pkt.seq, "OK");
+    send_reply(origin, ack, strlen(ack));
+
+  } else if (pkt.type == PACKET_ACK) { // A recipient acknowledging a relayed message
+    requester = find_requester(cl, origin);
+    if (requester.ptr != NULL)
+      relay_ack(cl, requester, pkt.seq);
+
+  } else if (pkt.type == PACKET_SUB || pkt.type == PACKET_UNSUB) {
+    requester = find_requester(cl, origin);
+
+    if (requester.ptr == NULL) {
+      create_ack(ack, pkt.seq, "NOT REGISTERED");
+    } else {
+      rest = pkt.text;
+      while (slice_next_token(&rest, &nick)) {
+        if (!owns_nick(nick)) // The owner is told by a forwarded copy.
+          continue;
+        if (pkt.type == PACKET_SUB)
+          add_subscription(nick, requester, origin);
+        else
+          remove_subscriptions(&requester, &nick);
+      }
+      create_ack(ack, pkt.seq, "OK");
+    }
+    if (!origin->forwarded)
+      send_reply(origin, ack, strlen(ack));
+
+  } else if (pkt.type == PACKET_LOOKUP && pkt.text.len != pkt.nick.len) {
+    answer_batch_lookup(cl, &pkt, origin);
+
+  } else if (pkt.type == PACKET_LOOKUP) {
+    lookup = find_client(cl, pkt.nick);
+    TRACE(registry_lookup, pkt.nick.ptr, pkt.nick.len, lookup != NULL, cl->size);
+
+    // A nick too long for its reply to fit a datagram cannot be reached
+    // either.
+    reply_len = REPLYSIZE;
+    if (lookup != NULL && !is_old_registration(cl, lookup))
+      reply_len = snprintf(reply, REPLYSIZE, "ACK %c NICK %s IP %s PORT %d", pkt.seq, lookup->name, lookup->ip,
+                           lookup->port);
+    if (reply_len >= REPLYSIZE) {
+      create_ack(ack, pkt.seq, "NOT FOUND");
+      send_reply(origin, ack, strlen(ack));
+    } else {
+      send_reply(origin, reply, reply_len);
+
+      requester = find_requester(cl, origin);
+      if (requester.ptr != NULL)
+        send_introduction(requester, origin, lookup);
+    }
+
+  }
+}
+
+// Sends a client's packet to the shard that owns key as
+// "FWD <ip> <port> <nick> <packet>", naming the client by the nick it is
+// registered with here, or "-".
+void forward_packet(struct client_list* cl, int shard, struct origin* origin, const char* buf, int len) {
+  char packet[BUFSIZE + FWD_HEADER_SIZE];
+  struct slice requester = find_requester(cl, origin);
+  int rc, header;
+
+  if (requester.ptr == NULL || requester.len > MAX_FWD_NICK)
+    requester = slice_from_string("-");
+  header = snprintf(packet, sizeof(packet), "FWD %s %d %.*s ", inet_ntoa(origin->addr.sin_addr),
+                    ntohs(origin->addr.sin_port), (int)requester.len, requester.ptr);
+  // A client may send up to the size of the receive buffer, which leaves no
+  // room for the header; such a packet is no valid request and is dropped.
+  if (header < 0 || len < 0 || (size_t)header + len > sizeof(packet)) {
+    console_log(CONSOLE_WARNING, "PACKET TOO LONG TO FORWARD (%d BYTES)\n", len);
+    return;
+  }
+  memcpy(packet + header, buf, len);
+  rc = send_packet(server_socket, packet, header + len, 0, (struct sockaddr*)cluster_shard(shard),
+                   sizeof(struct sockaddr_in));
+  check_error(rc, "send_packet");
+}
+
+// Handles a packet straight from a client on a shard. Registrations are kept
+// here too, so the shard knows its own clients, and copied to the owner;
+// everything keyed by a nick another shard owns is forwarded to it.
+void route_packet(struct client_list* cl, const char* buf, int len, struct origin* origin) {
+  struct packet pkt;
+  struct client* lookup;
+  struct slice requester, rest, nick;
+  char ack[ACKSIZE];
+  int owners[MAX_SHARDS] = { 0 };
+  int shard;
+
+  switch (parse_packet(buf, len, &pkt)) {
+    case PACKET_REG:
+    case PACKET_HB:
+      handle_packet(cl, buf, len, origin);
+      if (!owns_nick(pkt.nick))
+        forward_packet(cl, cluster_owner(pkt.nick), origin, buf, len);
+      return;
+    case PACKET_LOOKUP:
+      lookup = find_client(cl, pkt.nick);
+      if (pkt.text.len == pkt.nick.len && !owns_nick(pkt.nick) && lookup == NULL) {
+        forward_packet(cl, cluster_owner(pkt.nick), origin, buf, len);
+        return;
+      }
+      break;
+    case PACKET_SUB:
+    case PACKET_UNSUB:
+      handle_packet(cl, buf, len, origin);
+      rest = pkt.text;
+      while (slice_next_token(&rest, &nick))
+        owners[cluster_owner(nick)] = 1;
+      for (shard = 0; shard < cluster_size(); shard++) {
+        if (owners[shard] && shard != cluster_self())
+          forward_packet(cl, shard, origin, buf, len);
+      }
+      return;
+    case PACKET_RELAY:
+      requester = find_requester(cl, origin);
+      if (owns_nick(pkt.to))
+        break;
+      if (requester.ptr != NULL && slices_equal(requester, pkt.from)) {
+        forward_packet(cl, cluster_owner(pkt.to), origin, buf, len);
+      } else {
+        create_ack(ack, pkt.seq, "WRONG NAME");
+        send_reply(origin, ack, strlen(ack));
+      }
+      return;
+    case PACKET_ACK: // Relay queues live with the recipient's owner.
+      requester = find_requester(cl, origin);
+      if (requester.ptr != NULL && !owns_nick(requester)) {
+        forward_packet(cl, cluster_owner(requester), origin, buf, len);
+        return;
+      }
+      break;
+    default:
+      break;
+  }
+  handle_packet(cl, buf, len, origin);
+}
+
+// Reads "<ip> <port> " off the front of rest into addr.
+int parse_shard_address(struct slice* rest, struct sockaddr_in* addr) {
+  struct slice ip, port;
+  char address[INET_ADDRSTRLEN];
+  long long number;
+
+  if (!slice_next_token(rest, &ip) || !slice_next_token(rest, &port) ||
+      slice_copy(address, sizeof(address), ip) == -1 || !slice_to_number(port, &number) ||
+      number > 65535)
+    return 0;
+  memset(addr, 0, sizeof(struct sockaddr_in));
+  addr->sin_family = AF_INET;
+  addr->sin_port = htons(number);
+  return inet_pton(AF_INET, address, &addr->sin_addr) == 1;
+}
+
+// Handles "FWD <ip> <port> <nick> <packet>" from another shard, as if the
+// client had sent the packet here, and "OUT <ip> <port> <packet>", which is
+// passed on to a client of this shard.
+void handle_shard_packet(struct client_list* cl, const char* buf, int len, struct sockaddr_in* shardaddr) {
+  struct slice rest = { buf, len };
+  struct slice verb;
+  struct origin origin;
+  int rc;
+
+  if (!slice_next_token(&rest, &verb) || !parse_shard_address(&rest, &origin.addr))
+    return;
+
+  if (slice_equals(verb, "FWD") && slice_next_token(&rest, &origin.requester)) {
+    if (slice_equals(origin.requester, "-"))
+      origin.requester.ptr = NULL;
+    origin.via = *shardaddr;
+    origin.forwarded = 1;
+    handle_packet(cl, rest.ptr, rest.len, &origin);
+  } else if (slice_equals(verb, "OUT")) {
+    rc = send_packet(server_socket, (void*)rest.ptr, rest.len, 0, (struct sockaddr*)&origin.addr,
+                     sizeof(origin.addr));
+    check_error(rc, "send_packet");
+  }
+}
+
+// Writes everything a successor needs to carry on, one record per line:
+//   HANDOVER <epoch> <seqno>
+//   C <nick> <ip> <port> <heartbeat> <lease> <forwarded> <via addr> <via port>
+//   S <nick> <subscriber> <addr> <port> <refreshed> <forwarded> <via addr> <via port>
+//   R <to> <from> <received> <len>, then len bytes of text and a newline
+//   P <addr> <port> <heard> for each replica
+//   END <accepted> <refused> <delivered> <expired>
+// Addresses and ports are written as the numbers in sockaddr_in, in network
+// byte order.
+void write_state(FILE* out, struct client_list* cl) {
+  fprintf(out, "HANDOVER %d %ld %ld\n", HANDOVER_VERSION, replication.epoch, replication.seqno);
+  for (struct client* c = cl->head; c != NULL; c = c->next)
+    fprintf(out, "C %s %s %d %ld %d %d %u %u\n", c->name, c->ip, c->port, (long)c->heartbeat, c->lease,
+            c->forwarded, c->via.sin_addr.s_addr, c->via.sin_port);
+  for (int i = 0; i < SUB_BUCKETS; i++) {
+    for (struct subscription* s = subscriptions.by_nick[i]; s != NULL; s = s->next)
+      fprintf(out, "S %s %s %u %u %ld %d %u %u\n", s->nick, s->subscriber, s->addr.sin_addr.s_addr,
+              s->addr.sin_port, (long)s->refreshed, s->forwarded, s->via.sin_addr.s_addr, s->via.sin_port);
+  }
+  for (struct relay_queue* q = relays.head; q != NULL; q = q->next) {
+    for (struct relayed_message* m = q->head; m != NULL; m = m->next)
+      fprintf(out, "R %s %s %ld %zu\n%s\n", q->nick, m->from, (long)m->received, strlen(m->text), m->text);
+  }
+  for (struct replica* r = replication.head; r != NULL; r = r->next)
+    fprintf(out, "P %u %u %ld\n", r->addr.sin_addr.s_addr, r->addr.sin_port, (long)r->heard);
+  fprintf(out, "END %ld %ld %ld %ld\n", relays.accepted, relays.refused, relays.delivered, relays.expired);
+}
+
+// Rebuilds what write_state wrote. Returns -1 if the stream ends before END
+// or holds a record it does not know, in which case the state is partial.
+int read_state(FILE* in, struct client_list* cl) {
+  char line[3 * BUFSIZE]; // Nicks are only bounded by the datagram size
+  char name[sizeof(line)], other[sizeof(line)], ip[INET_ADDRSTRLEN];
+  unsigned int addr, port, via_addr, via_port;
+  long when, counters[4];
+  long version;
+  int lease, fields;
+  size_t len;
+  struct origin origin;
+  struct subscription* subscription;
+  struct packet pkt;
+  char* text;
+
+  // "HANDOVER <version> <epoch> <seqno>", or "HANDOVER <epoch> <seqno>"
+  // from a server that predates versions.
+  if (fgets(line, sizeof(line), in) == NULL)
+    return -1;
+  fields = sscanf(line, "HANDOVER %ld %ld %ld", &version, &replication.epoch, &replication.seqno);
+  if (fields == 2) {
+    replication.seqno = replication.epoch;
+    replication.epoch = version;
+    version = 1;
+  } else if (fields != 3 || version < 1 || version > HANDOVER_VERSION) {
+    return -1;
+  }
+
+  memset(&origin, 0, sizeof(origin));
+  origin.addr.sin_family = AF_INET;
+  origin.via.sin_family = AF_INET;
+  while (fgets(line, sizeof(line), in) != NULL) {
+    // Version 1 clients have no lease and get the one a registration
+    // would get now.
+    if (version == 1)
+      fields = sscanf(line, "C %s %15s %u %ld %d %u %u", name, ip, &port, &when, &origin.forwarded,
+                      &via_addr, &via_port) + 1;
+    else
+      fields = sscanf(line, "C %s %15s %u %ld %d %d %u %u", name, ip, &port, &when, &lease, &origin.forwarded,
+                      &via_addr, &via_port);
+    if (fields == 8) {
+      origin.addr.sin_port = htons(port);
+      inet_pton(AF_INET, ip, &origin.addr.sin_addr);
+      origin.via.sin_addr.s_addr = via_addr;
+      origin.via.sin_port = via_port;
+      push_back_client(cl, slice_from_string(name), &origin);
+      cl->tail->heartbeat = when;
+      if (version > 1)
+        cl->tail->lease = lease;
+    } else if (sscanf(line, "S %s %s %u %u %ld %d %u %u", name, other, &addr, &port, &when,
+                      &origin.forwarded, &via_addr, &via_port) == 8) {
+      origin.addr.sin_addr.s_addr = addr;
+      origin.addr.sin_port = port;
+      origin.via.sin_addr.s_addr = via_addr;
+      origin.via.sin_port = via_port;
+      subscription = add_subscription(slice_from_string(name), slice_from_string(other), &origin);
+      if (subscription != NULL)
+        subscription->refreshed = when;
+    } else if (sscanf(line, "R %s %s %ld %zu", name, other, &when, &len) == 4 && len < BUFSIZE) {
+      text = malloc(len + 1);
+      if (fread(text, 1, len + 1, in) != len + 1) {
+        free(text);
+        return -1;
+      }
+      pkt.to = slice_from_string(name);
+      pkt.from = slice_from_string(other);
+      pkt.msg.ptr = text;
+      pkt.msg.len = len;
+      if (relay_message(&pkt))
+        find_relay_queue(pkt.to)->tail->received = when;
+      free(text);
+    } else if (sscanf(line, "P %u %u %ld", &addr, &port, &when) == 3) {
+      origin.addr.sin_addr.s_addr = addr;
+      origin.addr.sin_port = port;
+      // Replicas left out of this server's -P are dropped with the rest.
+      if (is_allowed_replica(&origin.addr)) {
+        handle_replica_request(cl, slice_from_string("SYNC"), &origin.addr);
+        replication.head->heard = when;
+      }
+    } else if (sscanf(line, "END %ld %ld %ld %ld", &counters[0], &counters[1], &counters[2],
+                      &counters[3]) == 4) {
+      relays.accepted = counters[0];
+      relays.refused = counters[1];
+      relays.delivered = counters[2];
+      relays.expired = counters[3];
+      return 0;
+    } else {
+      return -1;
+    }
+  }
+  return -1;
+}
+
+void handle_stop_signal(int sig) {
+  (void)sig;
+  stop_server = 1;
+}
+
+// Parses "<rate>[:<burst>]", where a rate of 0 admits everything. Returns -1
+// if the spec is invalid.
+int set_admission(const char* spec) {
+  int rate, burst;
+  int n = sscanf(spec, "%d:%d", &rate, &burst);
+
+  if (n < 1 || rate < 0 || (n == 2 && burst < 1))
+    return -1;
+  admission.rate = rate;
+  admission.burst = n == 2 ? burst : 2 * rate;
+  return 0;
+}
+
+long long monotonic_usec() {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return now.tv_sec * 1000000LL + now.tv_nsec / 1000;
+}
+
+// Takes a token from the bucket of the datagram's source. Shards and the
+// primary are trusted and never limited.
+int admit_datagram(struct datagram* d, long long now) {
+  struct admission_slot* slot;
+  uint32_t hash;
+
+  if (admission.rate == 0 ||
+      (cluster_enabled() && cluster_find_shard(&d->addr) != -1) ||
+      (replication.following && d->addr.sin_port == replication.primary.sin_port &&
+       d->addr.sin_addr.s_addr == replication.primary.sin_addr.s_addr)) {
+    d->tokens = admission.burst;
+    return 1;
+  }
+
+  hash = (d->addr.sin_addr.s_addr ^ ((uint32_t)d->addr.sin_port << 16)) * 2654435761u;
+  slot = &admission.slots[hash >> 20 & (ADMIT_SLOTS - 1)];
+  if (slot->ip != d->addr.sin_addr.s_addr || slot->port != d->addr.sin_port || slot->refilled == 0) {
+    slot->ip = d->addr.sin_addr.s_addr;
+    slot->port = d->addr.sin_port;
+    slot->tokens = admission.burst;
+  } else {
+    slot->tokens += (now - slot->refilled) * admission.rate / 1000000.0;
+    if (slot->tokens > admission.burst)
+      slot->tokens = admission.burst;
+  }
+  slot->refilled = now;
+
+  if (slot->tokens < 1) {
+    admission.limited += 1;
+    return 0;
+  }
+  slot->tokens -= 1;
+  d->tokens = slot->tokens;
+  admission.admitted += 1;
+  return 1;
+}
+
+// Tells a LOOKUP from the rest without a full parse: "PKT <seq> LOOKUP ...".
+int is_lookup(const char* buf, int len) {
+  struct slice rest = { buf, len };
+  struct slice token;
+
+  return slice_next_token(&rest, &token) && slice_equals(token, "PKT") &&
+         slice_next_token(&rest, &token) && slice_next_token(&rest, &token) &&
+         slice_equals(token, "LOOKUP");
+}
+
+void print_admission_stats(FILE* out) {
+  fprintf(out, "ADMISSION: %ld admitted, %ld rate limited, %ld lookups shed, %ld overloaded batches\n",
+          admission.admitted, admission.limited, admission.shed, admission.overloaded);
+}
+
+void handle_datagram(struct client_list* cl, struct datagram* d) {
+  struct slice rest, verb;
+  struct origin origin;
+  char* buf = d->buf;
+  int rc = d->len;
+
+  console_log(CONSOLE_DEBUG, "%s\n", buf);
+
+  if (!strcmp(buf, "quit")) { // This is just here for an easy way to close the server.
+    stop_server = 1;
+    return;
+  }
+
+  if (replication.following) {
+    // A replica takes the change stream from the primary and LOOKUPs from
+    // anyone; registrations belong on the primary.
+    if (d->addr.sin_port == replication.primary.sin_port &&
+        d->addr.sin_addr.s_addr == replication.primary.sin_addr.s_addr) {
+      handle_replication(cl, buf, rc);
+    } else if (d->lookup && parse_packet(buf, rc, &(struct packet){0}) == PACKET_LOOKUP) {
+      origin.addr = d->addr;
+      origin.forwarded = 0;
+      handle_packet(cl, buf, rc, &origin);
+    }
+    return;
+  }
+
+  rest.ptr = buf;
+  rest.len = rc;
+  if (slice_next_token(&rest, &verb) && (slice_equals(verb, "SYNC") || slice_equals(verb, "RESYNC")) &&
+      rest.len == 0) {
+    handle_replica_request(cl, verb, &d->addr);
+    return;
+  }
+
+  if (cluster_enabled() && cluster_find_shard(&d->addr) != -1) {
+    handle_shard_packet(cl, buf, rc, &d->addr);
+    return;
+  }
+
+  origin.addr = d->addr;
+  origin.forwarded = 0;
+  if (cluster_enabled())
+    route_packet(cl, buf, rc, &origin);
+  else
+    handle_packet(cl, buf, rc, &origin);
+}
+
+// Serves a batch by priority: registrations, heartbeats and everything else
+// first, in arrival order, then LOOKUPs. A full batch means datagrams are
+// arriving faster than they are served, and then LOOKUPs from sources that
+// have spent more than half their burst are shed, so heartbeats and the
+// lookups of well-behaved clients keep getting through.
+void serve_batch(struct client_list* cl, int count, FILE* capture) {
+  long long now = monotonic_usec();
+  int overloaded = count == ADMIT_BATCH;
+  int i;
+
+  if (overloaded)
+    admission.overloaded += 1;
+  for (i = 0; i < count; i++) {
+    if (capture != NULL)
+      capture_datagram(capture, batch[i].buf, batch[i].len, &batch[i].addr);
+    batch[i].buf[batch[i].len] = '\0';
+    TRACE(datagram_receive, ntohs(batch[i].addr.sin_port), batch[i].len, now);
+    batch[i].lookup = is_lookup(batch[i].buf, batch[i].len);
+    if (!admit_datagram(&batch[i], now))
+      batch[i].len = -1;
+  }
+
+  for (i = 0; i < count && !stop_server; i++) {
+    if (batch[i].len >= 0 && !batch[i].lookup)
+      handle_datagram(cl, &batch[i]);
+  }
+  for (i = 0; i < count && !stop_server; i++) {
+    if (batch[i].len < 0 || !batch[i].lookup)
+      continue;
+    if (overloaded && batch[i].tokens < admission.burst / 2) {
+      admission.shed += 1;
+      continue;
+    }
+    handle_datagram(cl, &batch[i]);
+  }
+}
+
+int main(int argc, char* const argv[]) {
   unsigned short port;
-  int so, rc;
+  int so, rc, opt;
   struct sockaddr_in my_addr;
   struct in_addr ip_addr;
-  char buf[BUFSIZE];
   struct client_list* cl;
+  struct sigaction sa;
+  FILE* capture = NULL;
+  struct timeval sweep;
+  time_t next_sweep;
+  const char* capture_file = NULL;
+  const char* netem_spec = NULL;
+  const char* cluster_spec = NULL;
+  const char* primary_spec = NULL;
+  const char* handover_path = NULL;
+  const char* io_backend = NULL;
+  const char* log_level = NULL;
+  const char* admission_spec = NULL;
+  FILE* state = NULL;
+  int listener = -1, handing_over = 0, handed_over = 0, count;
+  fd_set set;
+
+  while ((opt = getopt(argc, argv, "c:n:C:F:P:H:i:l:a:")) != -1) {
+    if (opt == 'c') {
+      capture_file = optarg;
+    } else if (opt == 'n') {
+      netem_spec = optarg;
+    } else if (opt == 'C') {
+      cluster_spec = optarg;
+    } else if (opt == 'F') {
+      primary_spec = optarg;
+    } else if (opt == 'P') {
+      if (set_allowed_replicas(optarg) == -1) {
+        fprintf(stderr, "INVALID REPLICA LIST\n");
+        exit(EXIT_FAILURE);
+      }
+    } else if (opt == 'H') {
+      handover_path = optarg;
+    } else if (opt == 'i') {
+      io_backend = optarg;
+    } else if (opt == 'l') {
+      log_level = optarg;
+    } else if (opt == 'a') {
+      admission_spec = optarg;
+    } else {
+      argc = 0;
+    }
+  }
+  argc -= optind - 1;
+  argv += optind - 1;
 
   if (argc < 3) {
-      printf("Usage: ./server <port> <loss_probability>\n");
+      printf("Usage: ./server [-c <capture_file>] [-n <netem_spec>] [-C <shards>] [-F <primary>] [-P <replicas>] [-H <handover_socket>] [-i <io_backend>] [-l <log_level>] [-a <rate>[:<burst>]] <port> <loss_probability>\n");
+      printf("  -c  record every received datagram with its time and source for upush_replay\n");
+      printf("  -n  emulate the network behind send_packet, e.g. delay=20,jitter=5,ge=1:30:0:50\n");
+      printf("  -C  run as one shard of a cluster, e.g. 127.0.0.1:2000,127.0.0.1:2001 (this one included)\n");
+      printf("  -F  run as a read-only replica answering LOOKUPs for the primary at ip:port\n");
+      printf("  -P  serve the change stream to these replicas only, e.g. 127.0.0.1:2010,127.0.0.1:2011\n");
+      printf("  -H  take over from the server listening on this Unix socket, if any, then listen there for a successor\n");
+      printf("  -i  I/O backend: select (default), epoll or uring; uring falls back to epoll where unsupported\n");
+      printf("  -l  most verbose output: error, warning, info (default) or debug, which shows every datagram\n");
+      printf("  -a  datagrams per second and burst one source address may send, %d:%d by default, 0 for no limit\n",
+             ADMIT_RATE, ADMIT_BURST);
       return 0;
   }
   // valgrind ./upush_server 2000 0
+  // ./upush_server -c traffic.cap 2000 0
+  // ./upush_server -C 127.0.0.1:2000,127.0.0.1:2001 2000 0
+  // ./upush_server -F 127.0.0.1:2000 2010 0
+  // ./upush_server -l debug 2000 0
+  // ./upush_server -H /tmp/upush.sock 2000 0 (run it again to upgrade in place)
 
   // Currently assumes command line arguments are correct.
   port = atoi(argv[1]);
+  if (log_level != NULL && console_set_level(log_level) == -1) {
+    fprintf(stderr, "INVALID LOG LEVEL\n");
+    exit(EXIT_FAILURE);
+  }
+  if (admission_spec != NULL && set_admission(admission_spec) == -1) {
+    fprintf(stderr, "INVALID ADMISSION SPEC\n");
+    exit(EXIT_FAILURE);
+  }
   set_loss_probability(atoi(argv[2]));
+  if (io_backend != NULL && set_io_backend(io_backend) == -1) {
+    fprintf(stderr, "IO BACKEND %s UNAVAILABLE, FALLING BACK TO epoll\n", io_backend);
+    set_io_backend("epoll");
+  }
+  if (netem_spec != NULL && set_network_emulation(netem_spec) == -1) {
+    fprintf(stderr, "INVALID NETWORK EMULATION SPEC\n");
+    exit(EXIT_FAILURE);
+  }
 
   cl = create_client_list();
 
-  so = socket(AF_INET, SOCK_DGRAM, 0);
-  check_error(so, "socket");
+  if (capture_file != NULL) {
+    capture = capture_open(capture_file);
+    if (capture == NULL) {
+      perror(capture_file);
+      exit(EXIT_FAILURE);
+    }
+  }
+
+  // Stop on SIGINT/SIGTERM without SA_RESTART, so a blocked recvfrom returns
+  // and the capture and registry are cleaned up.
+  memset(&sa, 0, sizeof(sa));
+  sa.sa_handler = handle_stop_signal;
+  sigaction(SIGINT, &sa, NULL);
+  sigaction(SIGTERM, &sa, NULL);
 
   inet_pton(AF_INET, IP, &ip_addr);
 
@@ -201,63 +1753,153 @@ int main(int argc, char const *argv[]) {
   my_addr.sin_port = htons(port);
   my_addr.sin_addr = ip_addr;
 
-  rc = bind(so, (struct sockaddr*)&my_addr, sizeof(my_addr));
-  check_error(rc, "bind");
-
-  socklen_t clientaddr_len = sizeof(struct sockaddr_in);
-  struct sockaddr_in clientaddr;
-
-  buf[0] = '\0';
-  char* seq_num;
-  char* command;
-  char* name;
-  char ack[ACKSIZE];
-  struct client* lookup;
-  char lookup_reply[ACKSIZE];
-  while (strcmp(buf, "quit")) { // This is just here for an easy way to close the server.
-    rc = recvfrom(so, buf, BUFSIZE - 1, 0, (struct sockaddr*)&clientaddr, &clientaddr_len);
-    check_error(rc, "read");
-    buf[rc] = '\0';
-    printf("%s\n", buf); // Only for debugging.
+  // A predecessor hands over its socket still bound, so whatever arrives
+  // during the handover waits in the socket for this process to read.
+  if (handover_path != NULL)
+    state = handover_take(handover_path, &so);
+  if (state != NULL) {
+    socklen_t my_addr_len = sizeof(my_addr);
+    rc = getsockname(so, (struct sockaddr*)&my_addr, &my_addr_len);
+    check_error(rc, "getsockname");
+  } else {
+    so = socket(AF_INET, SOCK_DGRAM, 0);
+    check_error(so, "socket");
+  }
 
-    if (!strcmp(buf, "quit")) { // This is just here for an easy way to close the server.
-      continue;
+  if (cluster_spec != NULL && cluster_configure(cluster_spec, &my_addr) == -1) {
+    fprintf(stderr, "INVALID CLUSTER SPEC\n");
+    exit(EXIT_FAILURE);
+  }
+  replication.epoch = time(NULL);
+  if (primary_spec != NULL) {
+    char primary_ip[INET_ADDRSTRLEN];
+    int primary_port;
+    replication.following = 1;
+    replication.primary.sin_family = AF_INET;
+    if (sscanf(primary_spec, "%15[0-9.]:%d", primary_ip, &primary_port) != 2 ||
+        inet_pton(AF_INET, primary_ip, &replication.primary.sin_addr) != 1) {
+      fprintf(stderr, "INVALID PRIMARY\n");
+      exit(EXIT_FAILURE);
     }
+    replication.primary.sin_port = htons(primary_port);
+  }
 
-    strtok(buf, " "); // Skipping over PKT
-    seq_num = strtok(NULL, " ");
-    command = strtok(NULL, " ");
-    name = strtok(NULL, " ");
-
-    if (!strcmp(command, "REG")) {
-      create_ack(ack, seq_num, "OK");
-      rc = send_packet(so, ack, strlen(ack), 0, (struct sockaddr*)&clientaddr, sizeof(clientaddr));
-      check_error(rc, "send_packet");
-
-      if (!update_client(cl, name, clientaddr))
-        push_back_client(cl, name, clientaddr);
+  if (state != NULL) {
+    if (read_state(state, cl) == -1)
+      console_log(CONSOLE_WARNING, "INCOMPLETE HANDOVER\n");
+    fclose(state);
+    console_log(CONSOLE_INFO, "TOOK OVER %d clients, %d subscriptions, %d relay queues on port %d\n", cl->size,
+           subscriptions.size, relays.size, ntohs(my_addr.sin_port));
+  } else {
+    rc = bind(so, (struct sockaddr*)&my_addr, sizeof(my_addr));
+    check_error(rc, "bind");
+  }
+  server_socket = so;
+  if (handover_path != NULL) {
+    listener = handover_listen(handover_path);
+    check_error(listener, "handover_listen");
+  }
+  if (replication.following)
+    send_replica_request("RESYNC");
 
-    } else {
-      lookup = find_client(cl, name);
+  socklen_t clientaddr_len = sizeof(struct sockaddr_in);
 
-      if (lookup == NULL || is_old_registration(cl, lookup)) {
-        create_ack(ack, seq_num, "NOT FOUND");
-        rc = send_packet(so, ack, strlen(ack), 0, (struct sockaddr*)&clientaddr, sizeof(clientaddr));
-        check_error(rc, "send_packet");
-      } else {
-        memset(lookup_reply, 0, ACKSIZE);
-        snprintf(lookup_reply, ACKSIZE, "NICK %s IP %s PORT %d", lookup->name, lookup->ip, lookup->port);
-        create_ack(ack, seq_num, lookup_reply);
-        rc = send_packet(so, ack, strlen(ack), 0, (struct sockaddr*)&clientaddr, sizeof(clientaddr));
-        check_error(rc, "send_packet");
+  // From here on output is written by a thread of its own, so a slow
+  // terminal or log file does not hold up packets.
+  if (console_start() == -1)
+    console_log(CONSOLE_WARNING, "CONSOLE THREAD UNAVAILABLE, WRITING DIRECTLY\n");
+  next_sweep = time(NULL) + SWEEP_INTERVAL;
+  while (!stop_server) {
+    // With a successor waiting, the socket is released and the datagrams
+    // the I/O backend already took off it are handled before handing it
+    // over. Nothing more is read from it after that.
+    if (handing_over && pending_packets(so) == 0) {
+      state = handover_give(listener, so);
+      if (state != NULL) {
+        write_state(state, cl);
+        fclose(state);
+        handed_over = 1;
+        break;
       }
+      handing_over = 0; // The next select_packet takes up receiving again
+    }
+    if (!handing_over) {
+      FD_ZERO(&set);
+      FD_SET(so, &set);
+      if (listener != -1)
+        FD_SET(listener, &set);
+      sweep.tv_sec = SWEEP_INTERVAL;
+      sweep.tv_usec = 0;
+      rc = select_packet((so > listener ? so : listener) + 1, &set, &sweep); // Also sends replies held back by the emulation.
+      if (rc == -1 && errno == EINTR)
+        continue;
+      check_error(rc, "select");
+      if (time(NULL) >= next_sweep) {
+        adjust_refresh(cl);
+        expire_clients(cl);
+        expire_relayed();
+        remove_subscriptions(NULL, NULL);
+        if (!replication.following)
+          sweep_replicas();
+        else if (!replication.synced)
+          send_replica_request("RESYNC");
+        else if (calculate_time_interval(replication.last_request, time(NULL)) >= REPLICA_KEEPALIVE)
+          send_replica_request("SYNC");
+        next_sweep = time(NULL) + SWEEP_INTERVAL;
+      }
+      if (rc == 0)
+        continue;
 
+      if (listener != -1 && FD_ISSET(listener, &set)) {
+        release_packets(so);
+        handing_over = 1;
+        continue;
+      }
+      if (!FD_ISSET(so, &set))
+        continue;
     }
 
+    rc = recv_packet(so, batch[0].buf, BUFSIZE + FWD_HEADER_SIZE - 1, 0, (struct sockaddr*)&batch[0].addr,
+                     &clientaddr_len);
+    if (rc == -1 && errno == EINTR)
+      continue;
+    check_error(rc, "read");
+    batch[0].len = rc;
+
+    // Whatever else is already waiting joins the batch, so it can be served
+    // by priority rather than in arrival order.
+    for (count = 1; count < ADMIT_BATCH; count++) {
+      rc = recv_packet(so, batch[count].buf, BUFSIZE + FWD_HEADER_SIZE - 1, MSG_DONTWAIT,
+                       (struct sockaddr*)&batch[count].addr, &clientaddr_len);
+      if (rc == -1)
+        break;
+      batch[count].len = rc;
+    }
+    serve_batch(cl, count, capture);
   }
 
-  print_clients(cl); // Only for debugging.
+  if (capture != NULL)
+    fclose(capture);
+  print_clients(cl);
+  console_stop();
+  print_packet_stats(stdout);
+  print_relay_stats(stdout);
+  print_subscription_stats(stdout);
+  print_lease_stats(stdout);
+  print_replication_stats(stdout);
+  print_admission_stats(stdout);
+  print_console_stats(stdout);
+  if (handed_over)
+    printf("HANDED OVER to the server on %s\n", handover_path);
+  else if (listener != -1)
+    unlink(handover_path);
+  if (listener != -1)
+    close(listener);
   destroy_client_list(cl);
+  destroy_subscriptions();
+  destroy_relays();
+  destroy_replicas();
+  flush_packets();
   close(so);
   return EXIT_SUCCESS;
 }